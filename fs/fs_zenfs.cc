@@ -17,6 +17,8 @@
 #include <string.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <deque>
 #include <iostream>
 #include <utility>
 #include <vector>
@@ -28,6 +30,21 @@
 
 #define DEFAULT_ZENV_LOG_PATH "/tmp/"
 
+/* Recovery time budget for background checkpoints and the replay cost of an
+ * op log record assumed until one has been measured on mount */
+#define ZENFS_DEFAULT_RECOVERY_BUDGET_MS (1000)
+#define ZENFS_DEFAULT_REPLAY_NS_PER_RECORD (2000)
+/* Records to replay before the measured cost replaces the default */
+#define ZENFS_MIN_REPLAY_SAMPLE (1000)
+/* Snapshots are streamed to the snapshot log in records of about this size */
+#define ZENFS_SNAPSHOT_CHUNK_SIZE (1024 * 1024)
+/* Files of file system snapshots live below this directory, see
+ * ZenFS::CreateSnapshot */
+#define ZENFS_FS_SNAPSHOT_DIR "/.zenfs_snapshots/"
+/* Table files overshoot their target size by up to a data block plus the
+ * index and filter blocks, advised sizes leave this much of a zone free */
+#define ZENFS_FILE_SIZE_SLACK_PCT (2)
+
 namespace ROCKSDB_NAMESPACE {
 
 Status Superblock::DecodeFrom(Slice* input) {
@@ -50,6 +67,10 @@ Status Superblock::DecodeFrom(Slice* input) {
   input->remove_prefix(sizeof(aux_fs_path_));
   GetFixed32(input, &max_active_limit_);
   GetFixed32(input, &max_open_limit_);
+  GetFixed32(input, &nr_op_streams_);
+  GetFixed32(input, &nr_devices_);
+  GetFixed32(input, &range_first_);
+  GetFixed32(input, &range_nr_);
   memcpy(&reserved_, input->data(), sizeof(reserved_));
   input->remove_prefix(sizeof(reserved_));
   assert(input->size() == 0);
@@ -77,6 +98,10 @@ void Superblock::EncodeTo(std::string* output) {
   output->append(aux_fs_path_, sizeof(aux_fs_path_));
   PutFixed32(output, max_active_limit_);
   PutFixed32(output, max_open_limit_);
+  PutFixed32(output, nr_op_streams_);
+  PutFixed32(output, nr_devices_);
+  PutFixed32(output, range_first_);
+  PutFixed32(output, range_nr_);
   output->append(reserved_, sizeof(reserved_));
   assert(output->length() == ENCODED_SIZE);
 }
@@ -87,6 +112,17 @@ Status Superblock::CompatibleWith(ZonedBlockDevice* zbd) {
                               "Error: block size missmatch");
   if (zone_size_ != (zbd->GetZoneSize() / block_size_))
     return Status::Corruption("ZenFS Superblock", "Error: zone size missmatch");
+  if (((flags_ & FLAG_MIRRORED) != 0) != zbd->IsMirrored())
+    return Status::Corruption("ZenFS Superblock",
+                              "Error: mirror mode missmatch");
+  if (GetNrDevices() != zbd->GetNrDevices())
+    return Status::Corruption("ZenFS Superblock",
+                              "Error: nr of devices missmatch");
+  if (range_nr_ == 0 ? zbd->GetRangeNrZones() != zbd->GetNrZones()
+                     : (range_first_ != zbd->GetRangeFirstZone() ||
+                        range_nr_ != zbd->GetRangeNrZones()))
+    return Status::Corruption("ZenFS Superblock",
+                              "Error: zone range missmatch");
   if (nr_zones_ > zbd->GetNrZones())
     return Status::Corruption("ZenFS Superblock",
                               "Error: nr of zones missmatch");
@@ -101,19 +137,28 @@ Status Superblock::CompatibleWith(ZonedBlockDevice* zbd) {
 }
 
 IOStatus ZenMetaLog::AddRecord(const Slice& slice) {
-  uint32_t record_sz = slice.size();
-  const char* data = slice.data();
-  size_t phys_sz;
-  uint32_t crc = 0;
+  return AddRecords(std::vector<Slice>(1, slice));
+}
+
+/* Headers never straddle a block boundary, the rest of the block is padding
+ * if a header does not fit */
+size_t ZenMetaLog::AlignForHeader(size_t pos) {
+  if ((bs_ - (pos % bs_)) < zMetaHeaderSize) pos += bs_ - (pos % bs_);
+  return pos;
+}
+
+IOStatus ZenMetaLog::AddRecords(const std::vector<Slice>& records) {
+  size_t phys_sz = 0;
+  size_t pos = 0;
   char* buffer;
   int ret;
   IOStatus s;
 
-  phys_sz = record_sz + zMetaHeaderSize;
+  for (const auto& record : records)
+    phys_sz = AlignForHeader(phys_sz) + zMetaHeaderSize + record.size();
 
   if (phys_sz % bs_) phys_sz += bs_ - phys_sz % bs_;
 
-  assert(data != nullptr);
   assert((phys_sz % bs_) == 0);
 
   ret = posix_memalign((void**)&buffer, sysconf(_SC_PAGESIZE), phys_sz);
@@ -121,13 +166,23 @@ IOStatus ZenMetaLog::AddRecord(const Slice& slice) {
 
   memset(buffer, 0, phys_sz);
 
-  crc = crc32c::Extend(crc, (const char*)&record_sz, sizeof(uint32_t));
-  crc = crc32c::Extend(crc, data, record_sz);
-  crc = crc32c::Mask(crc);
+  for (const auto& record : records) {
+    uint32_t record_sz = record.size();
+    const char* data = record.data();
+    uint32_t crc = 0;
+
+    assert(data != nullptr);
+
+    crc = crc32c::Extend(crc, (const char*)&record_sz, sizeof(uint32_t));
+    crc = crc32c::Extend(crc, data, record_sz);
+    crc = crc32c::Mask(crc);
 
-  EncodeFixed32(buffer, crc);
-  EncodeFixed32(buffer + sizeof(uint32_t), record_sz);
-  memcpy(buffer + sizeof(uint32_t) * 2, data, record_sz);
+    pos = AlignForHeader(pos);
+    EncodeFixed32(buffer + pos, crc);
+    EncodeFixed32(buffer + pos + sizeof(uint32_t), record_sz);
+    memcpy(buffer + pos + zMetaHeaderSize, data, record_sz);
+    pos += zMetaHeaderSize + record_sz;
+  }
 
   s = zone_->Append(buffer, phys_sz);
 
@@ -136,7 +191,8 @@ IOStatus ZenMetaLog::AddRecord(const Slice& slice) {
 }
 
 IOStatus ZenMetaLog::Read(Slice* slice) {
-  int f = zbd_->GetReadFD();
+  ZoneDevice* dev = zone_->GetDevice();
+  int f = dev->read_f;
   const char* data = slice->data();
   size_t read = 0;
   size_t to_read = slice->size();
@@ -153,7 +209,8 @@ IOStatus ZenMetaLog::Read(Slice* slice) {
   }
 
   while (read < to_read) {
-    ret = pread(f, (void*)(data + read), to_read - read, read_pos_);
+    ret = pread(f, (void*)(data + read), to_read - read,
+                read_pos_ - dev->base);
 
     if (ret == -1 && errno == EINTR) continue;
     if (ret < 0) return IOStatus::IOError("Read failed");
@@ -172,23 +229,33 @@ IOStatus ZenMetaLog::ReadRecord(Slice* record, std::string* scratch) {
   uint32_t actual_crc;
   IOStatus s;
 
-  scratch->clear();
-  record->clear();
+  while (true) {
+    scratch->clear();
+    record->clear();
 
-  scratch->append(zMetaHeaderSize, 0);
-  header = Slice(scratch->c_str(), zMetaHeaderSize);
+    read_pos_ = AlignForHeader(read_pos_);
+    scratch->append(zMetaHeaderSize, 0);
+    header = Slice(scratch->c_str(), zMetaHeaderSize);
 
-  s = Read(&header);
-  if (!s.ok()) return s;
+    s = Read(&header);
+    if (!s.ok()) return s;
 
-  // EOF?
-  if (header.size() == 0) {
-    record->clear();
-    return IOStatus::OK();
-  }
+    // EOF?
+    if (header.size() == 0) {
+      record->clear();
+      return IOStatus::OK();
+    }
 
-  GetFixed32(&header, &record_crc);
-  GetFixed32(&header, &record_sz);
+    GetFixed32(&header, &record_crc);
+    GetFixed32(&header, &record_sz);
+
+    /* A zero header is padding, the next record starts in the next block */
+    if (record_crc == 0 && record_sz == 0) {
+      if (read_pos_ % bs_) read_pos_ += bs_ - (read_pos_ % bs_);
+      continue;
+    }
+    break;
+  }
 
   scratch->clear();
   scratch->append(record_sz, 0);
@@ -204,9 +271,6 @@ IOStatus ZenMetaLog::ReadRecord(Slice* record, std::string* scratch) {
     return IOStatus::IOError("Not a valid record");
   }
 
-  /* Next record starts on a block boundary */
-  if (read_pos_ % bs_) read_pos_ += bs_ - (read_pos_ % bs_);
-
   return IOStatus::OK();
 }
 
@@ -220,6 +284,8 @@ ZenFS::ZenFS(ZonedBlockDevice* zbd, std::shared_ptr<FileSystem> aux_fs,
   Info(logger_, "ZenFS initializing");
   next_file_id_ = 1;
   metadata_writer_.zenFS = this;
+  recovery_budget_ms_ = ZENFS_DEFAULT_RECOVERY_BUDGET_MS;
+  replay_ns_per_record_ = ZENFS_DEFAULT_REPLAY_NS_PER_RECORD;
 }
 
 ZenFS::~ZenFS() {
@@ -228,7 +294,13 @@ ZenFS::~ZenFS() {
   zbd_->LogZoneUsage();
   LogFiles();
 
-  op_log_.reset(nullptr);
+  /* A checkpoint in flight still uses the snapshot log */
+  {
+    std::unique_lock<std::mutex> lk(checkpoint_mtx_);
+    checkpoint_cv_.wait(lk, [this] { return !checkpoint_pending_; });
+  }
+
+  op_streams_.clear();
   snapshot_log_.reset(nullptr);
   ClearFiles();
   delete zbd_;
@@ -241,18 +313,16 @@ void ZenFS::LogFiles() {
   Info(logger_, "  Files:\n");
   for (it = files_.begin(); it != files_.end(); it++) {
     ZoneFile* zFile = it->second;
-    std::vector<ZoneExtent*> extents = zFile->GetExtents();
+    const std::vector<ZoneExtent>& extents = zFile->GetExtents();
 
     Info(logger_, "    %-45s sz: %lu lh: %d", it->first.c_str(),
          zFile->GetFileSize(), zFile->GetWriteLifeTimeHint());
     for (unsigned int i = 0; i < extents.size(); i++) {
-      ZoneExtent* extent = extents[i];
+      const ZoneExtent& extent = extents[i];
       Info(logger_, "          Extent %u {start=0x%lx, zone=%u, len=%u} ", i,
-           extent->start_,
-           (uint32_t)(extent->zone_->start_ / zbd_->GetZoneSize()),
-           extent->length_);
+           extent.start_, extent.zone_nr_, extent.length_);
 
-      total_size += extent->length_;
+      total_size += extent.length_;
     }
   }
   Info(logger_, "Sum of all files: %lu MB of data \n",
@@ -264,32 +334,92 @@ void ZenFS::ClearFiles() {
   files_mtx_.lock();
   for (it = files_.begin(); it != files_.end(); it++) delete it->second;
   files_.clear();
+  for (ZoneFile* f : unpersisted_deletes_) delete f;
+  unpersisted_deletes_.clear();
   files_mtx_.unlock();
 }
 
-/* Assumes that files_mutex_ is held */
-void ZenFS::WriteSnapshotLocked(std::string* snapshot) {
-  EncodeSnapshotTo(snapshot);
+IOStatus ZenFS::WriteSnapshotChunk(ZenMetaLog* meta_log, uint32_t index,
+                                   bool last, const std::string& entries) {
+  std::string chunk;
+  std::string record;
 
+  PutVarint32(&chunk, index);
+  PutVarint32(&chunk, last ? kLastSnapshotChunk : 0);
+  chunk.append(entries);
+
+  /* The snapshot covers all records sequenced so far */
+  PutFixed32(&record, kSequence);
+  PutVarint64(&record, op_seq_);
+  PutFixed32(&record, kSnapshotChunk);
+  PutLengthPrefixedSlice(&record, Slice(chunk));
+
+  return meta_log->AddRecord(record);
+}
+
+/* Assumes that files_mutex_ is held.
+ *
+ * Stream a snapshot of all files to meta_log. File records are collected in
+ * chunks of about ZENFS_SNAPSHOT_CHUNK_SIZE, each written as a separate,
+ * checksummed, meta log record, so memory use does not depend on the size of
+ * the file system. Recovery only uses a snapshot once its last chunk has
+ * been read. */
+IOStatus ZenFS::WriteSnapshotLocked(ZenMetaLog* meta_log) {
+  std::string entries;
+  std::string prev_name;
   uint64_t total_extent_length = 0;
+  uint32_t index = 0;
+  IOStatus s;
 
   for (auto& f : files_) {
+    std::string file_string;
     ZoneFile* file = f.second;
+
+    /* files_ is sorted by name, so neighbours share long prefixes */
+    file->EncodeSnapshotTo(&file_string, prev_name);
     file->MetadataSynced();
+    PutLengthPrefixedSlice(&entries, Slice(file_string));
+    prev_name = file->GetFilename();
+
+    if (entries.size() >= ZENFS_SNAPSHOT_CHUNK_SIZE) {
+      s = WriteSnapshotChunk(meta_log, index++, false, entries);
+      if (!s.ok()) return s;
+      entries.clear();
+    }
 
     // calculate extent length and add it to reporter
-    for (const ZoneExtent* extent : file->GetExtents()) {
-      total_extent_length += extent->length_;
+    for (const ZoneExtent& extent : file->GetExtents()) {
+      total_extent_length += extent.length_;
     }
   }
 
+  s = WriteSnapshotChunk(meta_log, index, true, entries);
+  if (!s.ok()) return s;
+
   Info(logger_, "total extent length %lu WriteSnapshotLocked\n", total_extent_length);
   zbd_->zbd_total_extent_length_reporter_.AddRecord(total_extent_length);
+
+  return s;
 }
 
-IOStatus ZenFS::RollSnapshotZone(std::string* snapshot) {
+/* Assumes that files_mutex_ is held */
+IOStatus ZenFS::PersistSnapshotLocked() {
+  IOStatus s = WriteSnapshotLocked(snapshot_log_.get());
+
+  // roll snapshot zone if no space left
+  if (s == IOStatus::NoSpace()) s = RollSnapshotZoneLocked();
+
+  if (s.ok()) {
+    records_since_checkpoint_ = 0;
+    snapshot_seq_ = op_seq_;
+  }
+  return s;
+}
+
+/* Assumes that files_mutex_ is held */
+IOStatus ZenFS::RollSnapshotZoneLocked() {
   IOStatus s;
-  ZenMetaLog* old_snapshot_log = snapshot_log_.get();
+  std::unique_ptr<ZenMetaLog> old_snapshot_log = std::move(snapshot_log_);
   Zone *new_snapshot_zone;
   LatencyHistGuard guard(&zbd_->roll_latency_reporter_);
   zbd_->roll_qps_reporter_.AddCount(1);
@@ -301,6 +431,7 @@ IOStatus ZenFS::RollSnapshotZone(std::string* snapshot) {
   // Get new snapshot zone.
   if ((new_snapshot_zone = zbd_->AllocateSnapshotZone()) == nullptr) {
     Error(logger_, "Out of snapshot zones, we should go to read only now.");
+    snapshot_log_ = std::move(old_snapshot_log);
     return IOStatus::NoSpace("Out of snapshot log zones");
   }
 
@@ -319,7 +450,7 @@ IOStatus ZenFS::RollSnapshotZone(std::string* snapshot) {
     return IOStatus::Corruption("Out of snapshot log zones");
   }
 
-  s = snapshot_log_->AddRecord(*snapshot);
+  s = WriteSnapshotLocked(snapshot_log_.get());
 
   if (s.ok()) {
     zbd_->ReportSpaceUtilization();
@@ -344,35 +475,48 @@ IOStatus ZenFS::WriteEndRecord(ZenMetaLog* meta_log) {
   return meta_log->AddRecord(endRecord);
 }
 
-/* Assumes the files_mtx_ is held */
-IOStatus ZenFS::RollMetaZoneLocked(bool async) {
+void ZenFS::InitOpStreams(uint32_t nr_streams) {
+  op_streams_.clear();
+  for (uint32_t i = 0; i < nr_streams; i++) {
+    op_streams_.emplace_back(new OpStream());
+    op_streams_.back()->id = i;
+  }
+}
+
+/* Assumes the files_mtx_ and the stream's sync_mtx are held */
+IOStatus ZenFS::RollMetaZoneLocked(OpStream* stream, bool async) {
   Zone *new_op_zone = nullptr;
   IOStatus s;
   LatencyHistGuard guard(&zbd_->roll_latency_reporter_);
   zbd_->roll_qps_reporter_.AddCount(1);
 
+  // persist a snapshot before any records of the old op log can go away
+  s = PersistSnapshotLocked();
+  if (!s.ok()) {
+    Error(logger_, "Could not write snapshot when rolling op log: %s",
+          s.ToString().c_str());
+    return s;
+  }
+
   // reserve write pointer to the old op log to close it later
-  std::shared_ptr<ZenMetaLog> old_op_log = std::move(op_log_);
+  std::shared_ptr<ZenMetaLog> old_op_log = std::move(stream->log);
 
-  // write snapshot in memory
-  std::shared_ptr<std::string> snapshot(new std::string);
-  WriteSnapshotLocked(snapshot.get());
-  
   // allocate new mete zone
-  if ((new_op_zone = zbd_->AllocateMetaZone()) == nullptr) {
+  if ((new_op_zone = zbd_->AllocateMetaZone(stream->id)) == nullptr) {
     assert(false);
     Error(logger_, "Out of op log zones, we should go to read only now.");
     return IOStatus::NoSpace("Out of op log zones");
   }
 
-  Info(logger_, "Rolling to op log %d\n", (int)new_op_zone->GetZoneNr());
+  Info(logger_, "Rolling op log stream %u to zone %d\n", stream->id,
+       (int)new_op_zone->GetZoneNr());
   // shift current write pointer to the new op log zone
-  op_log_.reset(new ZenMetaLog(zbd_, new_op_zone));
-  
+  stream->log.reset(new ZenMetaLog(zbd_, new_op_zone));
+
   // encode new super block
   std::string super_string;
   super_block_->EncodeTo(&super_string);
-  s = op_log_->AddRecord(super_string);
+  s = stream->log->AddRecord(super_string);
 
   if (!s.ok()) {
     Error(logger_,
@@ -381,23 +525,7 @@ IOStatus ZenFS::RollMetaZoneLocked(bool async) {
                              "new op log zone");
   }
 
-  auto RollMetaZoneBackground = [&, old_op_log, snapshot]() {
-    IOStatus s;
-
-    // process write snapshot
-    s = snapshot_log_->AddRecord(*snapshot);
-
-    // roll snapshot zone if no space left
-    if (s == IOStatus::NoSpace()) {
-      s = RollSnapshotZone(snapshot.get());
-    }
-
-    if (!s.ok()) {
-      Error(logger_,
-            "Could not write snapshot when rolling to a new snapshpt log zone");
-      assert(false);
-    }
-
+  auto RollMetaZoneBackground = [&, old_op_log]() {
     zbd_->ReportSpaceUtilization();
 
     // finish write and reset old op log zone
@@ -413,7 +541,7 @@ IOStatus ZenFS::RollMetaZoneLocked(bool async) {
 
 
   if (async) {
-    // Submit async job for : 1. Finish & reset old zone. 2. Write Snapshot.
+    // Submit async job to finish & reset the old zone.
     zbd_->meta_worker_->SubmitJob(RollMetaZoneBackground);
   } else {
     // Synchronized call for initailization.
@@ -423,38 +551,148 @@ IOStatus ZenFS::RollMetaZoneLocked(bool async) {
   return s;
 }
 
-IOStatus ZenFS::PersistRecord(ZenMetaLog* meta_writer, std::string* record) {
-  IOStatus s;
-  metadata_sync_mtx_.lock();
-  s = meta_writer->AddRecord(*record);
-  if (s == IOStatus::NoSpace()) {
-    Info(logger_, "Current meta zone full, rolling to next meta zone");
-    s = RollMetaZoneLocked(true);
-    /* After a successfull roll, a complete snapshot has been persisted
-     * - no need to write the record update */
-  }
-  metadata_sync_mtx_.unlock();
-  return s;
+/* Assumes that files_mtx_ is held, which orders the sequence numbers */
+void ZenFS::QueueRecordLocked(uint64_t file_id, PendingRecord* record) {
+  OpStream* stream = op_streams_[file_id % op_streams_.size()].get();
+  std::string data;
+
+  PutFixed32(&data, kSequence);
+  PutVarint64(&data, ++op_seq_);
+  data.append(record->data);
+  record->data.swap(data);
+  record->stream = stream;
+
+  records_since_checkpoint_++;
+  MaybeCheckpointLocked();
+
+  std::lock_guard<std::mutex> lock(stream->pending_mtx);
+  stream->pending.push_back(record);
+}
+
+/* Assumes that files_mtx_ is held */
+void ZenFS::MaybeCheckpointLocked() {
+  if (recovery_budget_ms_ == 0) return;
+  if (records_since_checkpoint_ * replay_ns_per_record_ <
+      recovery_budget_ms_ * 1000 * 1000)
+    return;
+
+  std::lock_guard<std::mutex> lock(checkpoint_mtx_);
+  if (checkpoint_pending_) return;
+  checkpoint_pending_ = true;
+
+  /* Runs on the same worker as the snapshot writes of op log rolls */
+  zbd_->meta_worker_->SubmitJob([this]() { Checkpoint(); });
+}
+
+/* Write a snapshot to the snapshot log. Recovery replays only the op log
+ * records sequenced after it, the op log zones are left as they are. */
+void ZenFS::Checkpoint() {
+  {
+    std::lock_guard<std::mutex> lock(files_mtx_);
+    Info(logger_, "Checkpointing after %lu op log records",
+         records_since_checkpoint_);
+    IOStatus s = PersistSnapshotLocked();
+    if (!s.ok()) {
+      Error(logger_, "Failed to write checkpoint: %s", s.ToString().c_str());
+    }
+  }
+
+  std::lock_guard<std::mutex> lock(checkpoint_mtx_);
+  checkpoint_pending_ = false;
+  checkpoint_cv_.notify_all();
+}
+
+/* Group commit: whoever gets the stream's sync_mtx first writes all queued
+ * records in one append, later callers find their record already written.
+ * Must be called without files_mtx_ held. */
+IOStatus ZenFS::CommitRecord(PendingRecord* record) {
+  OpStream* stream = record->stream;
+  std::unique_lock<std::mutex> lk(stream->sync_mtx);
+
+  while (!record->done) {
+    std::vector<PendingRecord*> batch;
+    std::vector<Slice> slices;
+    IOStatus s;
+
+    {
+      std::lock_guard<std::mutex> lock(stream->pending_mtx);
+      batch.assign(stream->pending.begin(), stream->pending.end());
+      stream->pending.clear();
+    }
+
+    for (const auto r : batch) slices.emplace_back(r->data);
+
+    ZenMetaLog* full_log = stream->log.get();
+    s = full_log->AddRecords(slices);
+
+    if (s == IOStatus::NoSpace()) {
+      {
+        std::lock_guard<std::mutex> lock(stream->pending_mtx);
+        stream->pending.insert(stream->pending.begin(), batch.begin(),
+                               batch.end());
+      }
+
+      /* Rolling needs files_mtx_, which is taken before sync_mtx */
+      lk.unlock();
+      std::lock_guard<std::mutex> files_lock(files_mtx_);
+      lk.lock();
+
+      if (stream->log.get() == full_log) {
+        Info(logger_, "Current meta zone full, rolling to next meta zone");
+        s = RollMetaZoneLocked(stream, true);
+
+        /* After a successfull roll, a complete snapshot has been persisted
+         * - no need to write the queued records */
+        std::lock_guard<std::mutex> lock(stream->pending_mtx);
+        for (auto r : stream->pending) {
+          r->status = s;
+          r->done = true;
+        }
+        stream->pending.clear();
+      }
+      continue;
+    }
+
+    for (auto r : batch) {
+      r->status = s;
+      r->done = true;
+    }
+  }
+
+  return record->status;
 }
 
 IOStatus ZenFS::SyncFileMetadata(ZoneFile* zoneFile) {
+  PendingRecord record;
+  ZoneFile::SyncState sync_state;
   std::string fileRecord;
-  std::string output;
-
+  std::string fname;
   IOStatus s;
 
   files_mtx_.lock();
 
   zoneFile->SetFileModificationTime(time(0));
-  PutFixed32(&output, kFileUpdate);
+  PutFixed32(&record.data, kCompactFileUpdate);
   zoneFile->EncodeUpdateTo(&fileRecord);
-  PutLengthPrefixedSlice(&output, Slice(fileRecord));
+  PutLengthPrefixedSlice(&record.data, Slice(fileRecord));
 
-  s = PersistRecord(op_log_.get(), &output);
-  if (s.ok()) zoneFile->MetadataSynced();
+  fname = zoneFile->GetFilename();
+  sync_state = zoneFile->GetSyncState();
+  zoneFile->MetadataSynced();
+  QueueRecordLocked(zoneFile->GetID(), &record);
 
   files_mtx_.unlock();
 
+  s = CommitRecord(&record);
+  if (!s.ok()) {
+    /* Have the next update carry the changes again, unless the file went
+     * away meanwhile */
+    files_mtx_.lock();
+    if (GetFileInternal(fname) == zoneFile)
+      zoneFile->RestoreSyncState(sync_state);
+    files_mtx_.unlock();
+  }
+
   return s;
 }
 
@@ -476,27 +714,49 @@ ZoneFile* ZenFS::GetFile(std::string fname) {
 }
 
 IOStatus ZenFS::DeleteFile(std::string fname) {
+  PendingRecord record;
   ZoneFile* zoneFile = nullptr;
   IOStatus s;
 
   files_mtx_.lock();
   zoneFile = GetFileInternal(fname);
-  if (zoneFile != nullptr) {
-    std::string record;
+  if (zoneFile == nullptr) {
+    files_mtx_.unlock();
+    return s;
+  }
 
-    zoneFile = files_[fname];
-    files_.erase(fname);
+  files_.erase(fname);
+  EncodeFileDeletionTo(zoneFile, &record.data);
+  QueueRecordLocked(zoneFile->GetID(), &record);
+  uint64_t seq = op_seq_;
+  files_mtx_.unlock();
 
-    EncodeFileDeletionTo(zoneFile, &record);
-    s = PersistRecord(op_log_.get(), &record);
-    if (!s.ok()) {
-      /* Failed to persist the delete, return to a consistent state */
-      files_.insert(std::make_pair(fname.c_str(), zoneFile));
-    } else {
-      delete (zoneFile);
+  s = CommitRecord(&record);
+
+  std::lock_guard<std::mutex> lock(files_mtx_);
+
+  /* A snapshot persisted while the record was pending has the file table
+   * without the file, which makes the deletion durable */
+  if (!s.ok() && snapshot_seq_ >= seq) s = IOStatus::OK();
+
+  if (!s.ok()) {
+    /* Failed to persist the delete, return to a consistent state */
+    if (files_.insert(std::make_pair(fname, zoneFile)).second) return s;
+
+    /* The name was reused meanwhile, so the file can not come back. Persist
+     * the file table without it instead. */
+    IOStatus ss = PersistSnapshotLocked();
+    if (!ss.ok()) {
+      Error(logger_, "Failed to persist the deletion of %s: %s", fname.c_str(),
+            ss.ToString().c_str());
+      unpersisted_deletes_.push_back(zoneFile);
+      return s;
     }
+    s = ss;
   }
-  files_mtx_.unlock();
+
+  zoneFile->MarkDeleted();
+  delete (zoneFile);
   return s;
 }
 
@@ -532,10 +792,47 @@ IOStatus ZenFS::NewRandomAccessFile(const std::string& fname,
                                          dbg);
   }
 
-  result->reset(new ZonedRandomAccessFile(files_[fname], file_opts));
+  /* Fall back to copying reads if the device cannot be mapped */
+  const char* mapping = nullptr;
+  if (file_opts.use_mmap_reads && !file_opts.use_direct_reads)
+    mapping = zbd_->Map();
+
+  result->reset(new ZonedRandomAccessFile(files_[fname], file_opts, mapping));
   return IOStatus::OK();
 }
 
+#if ROCKSDB_MAJOR >= 7
+IOStatus ZenFS::Poll(std::vector<void*>& io_handles, size_t min_completions) {
+  std::vector<ZoneAsyncRead*> reads;
+  IOStatus s;
+
+  for (auto h : io_handles)
+    reads.push_back(&static_cast<ZonedAsyncReadHandle*>(h)->read);
+
+  s = zbd_->PollAsyncReads(reads, min_completions);
+
+  for (auto h : io_handles)
+    static_cast<ZonedAsyncReadHandle*>(h)->Deliver(false);
+
+  return s;
+}
+
+IOStatus ZenFS::AbortIO(std::vector<void*>& io_handles) {
+  std::vector<ZoneAsyncRead*> reads;
+  IOStatus s;
+
+  for (auto h : io_handles)
+    reads.push_back(&static_cast<ZonedAsyncReadHandle*>(h)->read);
+
+  s = zbd_->AbortAsyncReads(reads);
+
+  for (auto h : io_handles)
+    static_cast<ZonedAsyncReadHandle*>(h)->Deliver(true);
+
+  return s;
+}
+#endif
+
 IOStatus ZenFS::NewWritableFile(const std::string& fname,
                                 const FileOptions& file_opts,
                                 std::unique_ptr<FSWritableFile>* result,
@@ -546,6 +843,9 @@ IOStatus ZenFS::NewWritableFile(const std::string& fname,
   Debug(logger_, "New writable file: %s direct: %d\n", fname.c_str(),
         file_opts.use_direct_writes);
 
+  if (IsSnapshotFile(fname))
+    return IOStatus::InvalidArgument("Snapshot files are read-only: ", fname);
+
   if (GetFile(fname) != nullptr) {
     s = DeleteFile(fname);
     if (!s.ok()) return s;
@@ -553,18 +853,24 @@ IOStatus ZenFS::NewWritableFile(const std::string& fname,
 
   zoneFile = new ZoneFile(zbd_, fname, next_file_id_++, logger_);
   zoneFile->SetFileModificationTime(time(0));
+  zoneFile->SetSparse(sparse_wal_sync_ && zoneFile->is_wal_ &&
+                      !file_opts.use_direct_writes);
+
+  /* Add the file before persisting its creation, so that a snapshot taken
+   * by a concurrent op log roll includes it */
+  files_mtx_.lock();
+  files_.insert(std::make_pair(fname.c_str(), zoneFile));
+  files_mtx_.unlock();
 
-  /* Persist the creation of the file */
   s = SyncFileMetadata(zoneFile);
   if (!s.ok()) {
+    files_mtx_.lock();
+    files_.erase(fname);
+    files_mtx_.unlock();
     delete zoneFile;
     return s;
   }
 
-  files_mtx_.lock();
-  files_.insert(std::make_pair(fname.c_str(), zoneFile));
-  files_mtx_.unlock();
-
   result->reset(new ZonedWritableFile(zbd_, !file_opts.use_direct_writes,
                                       zoneFile, &metadata_writer_));
 
@@ -611,7 +917,6 @@ IOStatus ZenFS::ReopenWritableFile(const std::string& fname,
 IOStatus ZenFS::GetChildren(const std::string& dir, const IOOptions& options,
                             std::vector<std::string>* result,
                             IODebugContext* dbg) {
-  std::map<std::string, ZoneFile*>::iterator it;
   std::vector<std::string> auxfiles;
   IOStatus s;
 
@@ -626,6 +931,15 @@ IOStatus ZenFS::GetChildren(const std::string& dir, const IOOptions& options,
     if (f != "." && f != "..") result->push_back(f);
   }
 
+  GetZenFSChildren(dir, result);
+
+  return s;
+}
+
+void ZenFS::GetZenFSChildren(const std::string& dir,
+                             std::vector<std::string>* result) {
+  std::map<std::string, ZoneFile*>::iterator it;
+
   files_mtx_.lock();
   for (it = files_.begin(); it != files_.end(); it++) {
     std::string fname = it->first;
@@ -642,8 +956,6 @@ IOStatus ZenFS::GetChildren(const std::string& dir, const IOOptions& options,
     }
   }
   files_mtx_.unlock();
-
-  return s;
 }
 
 IOStatus ZenFS::DeleteFile(const std::string& fname, const IOOptions& options,
@@ -653,6 +965,9 @@ IOStatus ZenFS::DeleteFile(const std::string& fname, const IOOptions& options,
 
   Debug(logger_, "Delete file: %s \n", fname.c_str());
 
+  if (IsSnapshotFile(fname))
+    return IOStatus::InvalidArgument("Snapshot files are read-only: ", fname);
+
   if (zoneFile == nullptr) {
     return target()->DeleteFile(ToAuxPath(fname), options, dbg);
   }
@@ -711,6 +1026,9 @@ IOStatus ZenFS::RenameFile(const std::string& f, const std::string& t,
 
   Debug(logger_, "Rename file: %s to : %s\n", f.c_str(), t.c_str());
 
+  if (IsSnapshotFile(f) || IsSnapshotFile(t))
+    return IOStatus::InvalidArgument("Snapshot files are read-only");
+
   zoneFile = GetFile(f);
   if (zoneFile != nullptr) {
     s = DeleteFile(t);
@@ -738,18 +1056,272 @@ IOStatus ZenFS::RenameFile(const std::string& f, const std::string& t,
   return s;
 }
 
-void ZenFS::EncodeSnapshotTo(std::string* output) {
-  std::map<std::string, ZoneFile*>::iterator it;
-  std::string files_string;
-  PutFixed32(output, kCompleteFilesSnapshot);
-  for (it = files_.begin(); it != files_.end(); it++) {
-    std::string file_string;
-    ZoneFile* zFile = it->second;
+IOStatus ZenFS::LinkFile(const std::string& src, const std::string& target,
+                         const IOOptions& options, IODebugContext* dbg) {
+  ZoneFile* srcFile;
+  ZoneFile* link;
+  IOStatus s;
+
+  Debug(logger_, "Link file: %s to : %s\n", src.c_str(), target.c_str());
+
+  if (IsSnapshotFile(target))
+    return IOStatus::InvalidArgument("Snapshot files are read-only: ", target);
 
-    zFile->EncodeSnapshotTo(&file_string);
-    PutLengthPrefixedSlice(&files_string, Slice(file_string));
+  srcFile = GetFile(src);
+  if (srcFile == nullptr)
+    return this->target()->LinkFile(ToAuxPath(src), ToAuxPath(target),
+                                    options, dbg);
+
+  if (srcFile->IsOpenForWR())
+    return IOStatus::Busy("Cannot link, file open for writing: ", src);
+
+  /* Extents of sparse files may only be recorded in sync trailers, log
+   * them before they are shared */
+  if (srcFile->IsSparse()) {
+    s = SyncFileMetadata(srcFile);
+    if (!s.ok()) return s;
+  }
+
+  link = new ZoneFile(zbd_, target, next_file_id_++, logger_);
+
+  files_mtx_.lock();
+  if (GetFileInternal(target) != nullptr) {
+    files_mtx_.unlock();
+    delete link;
+    return IOStatus::IOError("Link target exists: ", target);
   }
-  PutLengthPrefixedSlice(output, Slice(files_string));
+  /* The source may have been deleted meanwhile */
+  if (GetFileInternal(src) != srcFile) {
+    files_mtx_.unlock();
+    delete link;
+    return IOStatus::NotFound("Link source deleted: ", src);
+  }
+  link->ShareExtentsOf(srcFile);
+  files_.insert(std::make_pair(target, link));
+  files_mtx_.unlock();
+
+  s = SyncFileMetadata(link);
+  if (!s.ok()) {
+    files_mtx_.lock();
+    files_.erase(target);
+    files_mtx_.unlock();
+    delete link;
+  }
+
+  return s;
+}
+
+IOStatus ZenFS::NumFileLinks(const std::string& fname,
+                             const IOOptions& options, uint64_t* count,
+                             IODebugContext* dbg) {
+  ZoneFile* zoneFile;
+  IOStatus s;
+
+  files_mtx_.lock();
+  zoneFile = GetFileInternal(fname);
+  if (zoneFile != nullptr) {
+    /* All links share all extents, so any extent tells */
+    const std::vector<ZoneExtent>& extents = zoneFile->GetExtents();
+    *count = 1;
+    if (!extents.empty()) {
+      const ZoneExtent& extent = extents.front();
+      *count = zoneFile->GetExtentZone(extent)->GetExtentRefs(extent.start_,
+                                                              extent.length_);
+    }
+  } else {
+    s = target()->NumFileLinks(ToAuxPath(fname), options, count, dbg);
+  }
+  files_mtx_.unlock();
+
+  return s;
+}
+
+IOStatus ZenFS::AreFilesSame(const std::string& first,
+                             const std::string& second,
+                             const IOOptions& options, bool* res,
+                             IODebugContext* dbg) {
+  ZoneFile* firstFile;
+  ZoneFile* secondFile;
+  IOStatus s;
+
+  files_mtx_.lock();
+  firstFile = GetFileInternal(first);
+  secondFile = GetFileInternal(second);
+  if (firstFile == nullptr && secondFile == nullptr) {
+    s = target()->AreFilesSame(ToAuxPath(first), ToAuxPath(second), options,
+                               res, dbg);
+  } else if (firstFile == nullptr || secondFile == nullptr) {
+    *res = false;
+  } else if (firstFile == secondFile) {
+    *res = true;
+  } else {
+    /* Links have the same extents, other files never share data */
+    const std::vector<ZoneExtent>& a = firstFile->GetExtents();
+    const std::vector<ZoneExtent>& b = secondFile->GetExtents();
+    *res = !a.empty() && a.size() == b.size() &&
+           std::equal(a.begin(), a.end(), b.begin(),
+                      [](const ZoneExtent& x, const ZoneExtent& y) {
+                        return x.start_ == y.start_ && x.length_ == y.length_;
+                      });
+  }
+  files_mtx_.unlock();
+
+  return s;
+}
+
+std::string ZenFS::SnapshotRoot(uint64_t id) {
+  return ZENFS_FS_SNAPSHOT_DIR + std::to_string(id) + "/";
+}
+
+bool ZenFS::IsSnapshotFile(const std::string& fname) {
+  return fname.rfind(ZENFS_FS_SNAPSHOT_DIR, 0) == 0;
+}
+
+/* Must hold files_mtx_ */
+std::vector<uint64_t> ZenFS::ListSnapshotsLocked() {
+  const std::string dir(ZENFS_FS_SNAPSHOT_DIR);
+  std::vector<uint64_t> ids;
+
+  for (auto it = files_.lower_bound(dir);
+       it != files_.end() && IsSnapshotFile(it->first); it++) {
+    std::string name = it->first.substr(dir.length());
+    if (name.find('/') != std::string::npos) continue;
+    ids.push_back(std::stoull(name));
+  }
+
+  std::sort(ids.begin(), ids.end());
+  return ids;
+}
+
+std::vector<uint64_t> ZenFS::ListSnapshots() {
+  std::lock_guard<std::mutex> lock(files_mtx_);
+  return ListSnapshotsLocked();
+}
+
+IOStatus ZenFS::CreateSnapshot(uint64_t* id) {
+  std::vector<ZoneFile*> links;
+  IOStatus s;
+
+  std::lock_guard<std::mutex> lock(files_mtx_);
+
+  std::vector<uint64_t> ids = ListSnapshotsLocked();
+  uint64_t snapshot_id = ids.empty() ? 1 : ids.back() + 1;
+  std::string root = SnapshotRoot(snapshot_id);
+
+  ZoneFile* marker = new ZoneFile(zbd_, root.substr(0, root.length() - 1),
+                                  next_file_id_++, logger_);
+  marker->SetFileModificationTime(time(0));
+  links.push_back(marker);
+
+  for (auto& f : files_) {
+    if (IsSnapshotFile(f.first)) continue;
+    ZoneFile* link = new ZoneFile(zbd_, root + f.first, next_file_id_++,
+                                  logger_);
+    link->ShareExtentsOf(f.second);
+    links.push_back(link);
+  }
+
+  for (ZoneFile* link : links)
+    files_.insert(std::make_pair(link->GetFilename(), link));
+
+  /* One metadata snapshot persists all links at once */
+  s = PersistSnapshotLocked();
+  if (!s.ok()) {
+    for (ZoneFile* link : links) {
+      files_.erase(link->GetFilename());
+      delete link;
+    }
+    return s;
+  }
+
+  Info(logger_, "Created snapshot %lu of %lu files", snapshot_id,
+       links.size() - 1);
+  *id = snapshot_id;
+  return s;
+}
+
+IOStatus ZenFS::DeleteSnapshot(uint64_t id) {
+  std::vector<ZoneFile*> deleted;
+  std::string root = SnapshotRoot(id);
+  std::string marker = root.substr(0, root.length() - 1);
+  IOStatus s;
+
+  std::lock_guard<std::mutex> lock(files_mtx_);
+
+  if (GetFileInternal(marker) == nullptr)
+    return IOStatus::NotFound("No such snapshot: ", std::to_string(id));
+
+  deleted.push_back(files_[marker]);
+  files_.erase(marker);
+  for (auto it = files_.lower_bound(root);
+       it != files_.end() && it->first.rfind(root, 0) == 0;) {
+    deleted.push_back(it->second);
+    it = files_.erase(it);
+  }
+
+  s = PersistSnapshotLocked();
+  if (!s.ok()) {
+    for (ZoneFile* f : deleted)
+      files_.insert(std::make_pair(f->GetFilename(), f));
+    return s;
+  }
+
+  for (ZoneFile* f : deleted) {
+    f->MarkDeleted();
+    delete f;
+  }
+
+  Info(logger_, "Deleted snapshot %lu", id);
+  return s;
+}
+
+IOStatus ZenFS::OpenSnapshot(uint64_t id,
+                             std::unique_ptr<FileSystem>* result) {
+  std::string root = SnapshotRoot(id);
+
+  if (GetFile(root.substr(0, root.length() - 1)) == nullptr)
+    return IOStatus::NotFound("No such snapshot: ", std::to_string(id));
+
+  result->reset(new ZenFSSnapshot(this, root));
+  return IOStatus::OK();
+}
+
+/* The view does not own the file system */
+ZenFSSnapshot::ZenFSSnapshot(ZenFS* zenFS, const std::string& root)
+    : FileSystemWrapper(std::shared_ptr<FileSystem>(zenFS, [](FileSystem*) {})),
+      zenFS_(zenFS),
+      root_(root) {}
+
+IOStatus ZenFSSnapshot::GetChildren(const std::string& dir,
+                                    const IOOptions& /*options*/,
+                                    std::vector<std::string>* result,
+                                    IODebugContext* /*dbg*/) {
+  size_t nr_children = result->size();
+
+  zenFS_->GetZenFSChildren(ToSnapshotPath(dir), result);
+  if (result->size() == nr_children)
+    return IOStatus::NotFound("No such directory in snapshot: ", dir);
+
+  return IOStatus::OK();
+}
+
+IOStatus ZenFSSnapshot::IsDirectory(const std::string& path,
+                                    const IOOptions& options, bool* is_dir,
+                                    IODebugContext* dbg) {
+  std::vector<std::string> children;
+
+  if (FileExists(path, options, dbg).ok()) {
+    *is_dir = false;
+    return IOStatus::OK();
+  }
+
+  /* Directories are not part of snapshots, only those with files show */
+  zenFS_->GetZenFSChildren(ToSnapshotPath(path), &children);
+  if (children.empty())
+    return IOStatus::NotFound("No such directory in snapshot: ", path);
+
+  *is_dir = true;
+  return IOStatus::OK();
 }
 
 void ZenFS::EncodeJson(std::ostream& json_stream) {
@@ -766,12 +1338,18 @@ void ZenFS::EncodeJson(std::ostream& json_stream) {
   json_stream << "]";
 }
 
-Status ZenFS::DecodeFileUpdateFrom(Slice* slice) {
+Status ZenFS::DecodeFileFrom(ZoneFile* zoneFile, Slice* input, bool compact,
+                             const std::string& ref_name) {
+  if (compact) return zoneFile->DecodeCompactFrom(input, ref_name);
+  return zoneFile->DecodeFrom(input);
+}
+
+Status ZenFS::DecodeFileUpdateFrom(Slice* slice, bool compact) {
   ZoneFile* update = new ZoneFile(zbd_, "not_set", 0, logger_);
   uint64_t id;
   Status s;
 
-  s = update->DecodeFrom(slice);
+  s = DecodeFileFrom(update, slice, compact, "");
   if (!s.ok()) return s;
 
   id = update->GetID();
@@ -798,21 +1376,30 @@ Status ZenFS::DecodeFileUpdateFrom(Slice* slice) {
   }
 
   /* The update is a new file */
+  if (update->GetFilename().empty()) {
+    delete update;
+    return Status::Corruption("ZenFS", "Update of unknown file");
+  }
   assert(GetFile(update->GetFilename()) == nullptr);
   files_.insert(std::make_pair(update->GetFilename(), update));
 
   return Status::OK();
 }
 
-Status ZenFS::DecodeSnapshotFrom(Slice* input) {
+Status ZenFS::DecodeSnapshotFrom(Slice* input, bool compact) {
+  std::string prev_name;
   Slice slice;
 
   assert(files_.size() == 0);
 
   while (GetLengthPrefixedSlice(input, &slice)) {
     ZoneFile* zoneFile = new ZoneFile(zbd_, "not_set", 0, logger_);
-    Status s = zoneFile->DecodeFrom(&slice);
-    if (!s.ok()) return s;
+    Status s = DecodeFileFrom(zoneFile, &slice, compact, prev_name);
+    if (!s.ok()) {
+      delete zoneFile;
+      return s;
+    }
+    prev_name = zoneFile->GetFilename();
 
     files_.insert(std::make_pair(zoneFile->GetFilename(), zoneFile));
     if (zoneFile->GetID() >= next_file_id_)
@@ -822,23 +1409,6 @@ Status ZenFS::DecodeSnapshotFrom(Slice* input) {
   return Status::OK();
 }
 
-/* This function only read through slices in a snapshot record and
- * DO NOT add valid slices to files_ to avoid duplicating files
- * appeared in different snapshots*/
-Status ZenFS::TestSnapshotCorrectness(Slice* input) {
-  Slice slice;
-
-  assert(files_.size() == 0);
-
-  while (GetLengthPrefixedSlice(input, &slice)) {
-    ZoneFile* zoneFile = new ZoneFile(zbd_, "not_set", 0, logger_);
-    Status s = zoneFile->DecodeFrom(&slice);
-    if (!s.ok()) return s;
-  }
-
-  return Status::OK();
-}
-
 void ZenFS::EncodeFileDeletionTo(ZoneFile* zoneFile, std::string* output) {
   std::string file_string;
 
@@ -874,20 +1444,54 @@ Status ZenFS::DecodeFileDeletionFrom(Slice* input) {
   return Status::OK();
 }
 
-Status ZenFS::RecoverFrom(ZenMetaLog* log) {
+Status ZenFS::ReplayRecord(uint32_t tag, Slice* data) {
+  Status s;
+
+  switch (tag) {
+    case kFileUpdate:
+    case kCompactFileUpdate:
+      s = DecodeFileUpdateFrom(data, tag == kCompactFileUpdate);
+      if (!s.ok()) {
+        Warn(logger_, "Could not decode file snapshot: %s",
+             s.ToString().c_str());
+      }
+      return s;
+
+    case kFileDeletion:
+      s = DecodeFileDeletionFrom(data);
+      if (!s.ok()) {
+        Warn(logger_, "Could not decode file deletion: %s",
+             s.ToString().c_str());
+      }
+      return s;
+
+    default:
+      Warn(logger_, "Unexpected metadata record tag: %u", tag);
+      return Status::Corruption("ZenFS", "Unexpected tag");
+  }
+}
+
+/* Collect the records of a meta log, nothing is applied to files_ until
+ * ReplayRecoveredOps has seen all logs */
+Status ZenFS::RecoverFrom(ZenMetaLog* log, RecoveredOps* ops) {
+  std::string chunks;
+  uint64_t chunks_seq = 0;
+  uint32_t next_chunk = 0;
+  bool chunks_valid = false;
   std::string scratch;
   uint32_t tag = 0;
   Slice record;
   Slice data;
-  Slice last_snapshot;
   Status s;
-  bool done = false;
 
-  if (!log->ReadRecord(&record, &scratch).ok()) 
+  if (!log->ReadRecord(&record, &scratch).ok())
     return Status::Corruption("ZenFS", "Corrupt super recode.");
 
-  while (!done) {
+  while (true) {
     IOStatus rs = log->ReadRecord(&record, &scratch);
+    bool sequenced = false;
+    uint64_t seq = 0;
+
     if (!rs.ok()) {
       Error(logger_, "Read recovery record failed with error: %s",
             rs.ToString().c_str());
@@ -895,6 +1499,13 @@ Status ZenFS::RecoverFrom(ZenMetaLog* log) {
     }
 
     if (!GetFixed32(&record, &tag)) break;
+    ops->nr_read++;
+
+    if (tag == kSequence) {
+      if (!GetVarint64(&record, &seq) || !GetFixed32(&record, &tag))
+        return Status::Corruption("ZenFS", "Bad sequence number record");
+      sequenced = true;
+    }
 
     if (tag == kEndRecord) break;
 
@@ -902,45 +1513,74 @@ Status ZenFS::RecoverFrom(ZenMetaLog* log) {
       return Status::Corruption("ZenFS", "No recovery record data");
     }
 
-    switch (tag) {
-      case kCompleteFilesSnapshot:
-        s = TestSnapshotCorrectness(&data);
-        if (!s.ok()) {
-          Warn(logger_, "Could not decode complete snapshot: %s",
-               s.ToString().c_str());
-          return s;
-        }
-        last_snapshot = data;
-        break;
+    if (seq > ops->max_seq) ops->max_seq = seq;
 
-      case kFileUpdate:
-        s = DecodeFileUpdateFrom(&data);
-        if (!s.ok()) {
-          Warn(logger_, "Could not decode file snapshot: %s",
-               s.ToString().c_str());
-          return s;
-        }
-        break;
+    /* Only the snapshot that is used gets decoded, see ReplayRecoveredOps */
+    if (tag == kSnapshotChunk) {
+      uint32_t index, flags;
 
-      case kFileDeletion:
-        s = DecodeFileDeletionFrom(&data);
-        if (!s.ok()) {
-          Warn(logger_, "Could not decode file deletion: %s",
-               s.ToString().c_str());
-          return s;
-        }
-        break;
+      if (!GetVarint32(&data, &index) || !GetVarint32(&data, &flags))
+        return Status::Corruption("ZenFS", "Bad snapshot chunk");
+
+      /* Chunks of an interrupted snapshot are skipped */
+      if (index == 0) {
+        chunks.clear();
+        chunks_seq = seq;
+        chunks_valid = true;
+      } else if (!chunks_valid || index != next_chunk || seq != chunks_seq) {
+        chunks_valid = false;
+        continue;
+      }
 
-      default:
-        Warn(logger_, "Unexpected metadata record tag: %u", tag);
-        return Status::Corruption("ZenFS", "Unexpected tag");
+      chunks.append(data.data(), data.size());
+      next_chunk = index + 1;
+
+      if (flags & kLastSnapshotChunk) {
+        chunks_valid = false;
+        ops->AddSnapshot(seq, true, &chunks);
+      }
+    } else if (tag == kCompleteFilesSnapshot || tag == kCompactFilesSnapshot) {
+      std::string snapshot = data.ToString();
+      ops->AddSnapshot(seq, tag == kCompactFilesSnapshot, &snapshot);
+    } else if (sequenced) {
+      /* Records covered by the snapshot are not kept */
+      if (!ops->has_snapshot || seq > ops->snapshot_seq)
+        ops->sequenced[seq] = std::make_pair(tag, data.ToString());
+    } else {
+      ops->unsequenced.emplace_back(tag, data.ToString());
     }
   }
 
-  if (!last_snapshot.empty()) {
+  return Status::OK();
+}
+
+Status ZenFS::ReplayRecoveredOps(RecoveredOps* ops) {
+  Status s;
+
+  if (ops->has_snapshot) {
+    Slice snapshot(ops->snapshot);
     ClearFiles();
-    DecodeSnapshotFrom(&last_snapshot);
+    s = DecodeSnapshotFrom(&snapshot, ops->snapshot_compact);
+    if (!s.ok()) {
+      Warn(logger_, "Could not decode complete snapshot: %s",
+           s.ToString().c_str());
+      return s;
+    }
   }
+
+  for (auto& r : ops->unsequenced) {
+    Slice data(r.second);
+    s = ReplayRecord(r.first, &data);
+    if (!s.ok()) return s;
+  }
+
+  for (auto it = ops->sequenced.upper_bound(ops->snapshot_seq);
+       it != ops->sequenced.end(); it++) {
+    Slice data(it->second.second);
+    s = ReplayRecord(it->second.first, &data);
+    if (!s.ok()) return s;
+  }
+
   return Status::OK();
 }
 
@@ -953,7 +1593,8 @@ Status ZenFS::Mount(bool readonly, bool formating) {
   Slice super_record;
   std::unique_ptr<ZenMetaLog> log;
   std::unique_ptr<Superblock> super_block;
-  uint32_t max_snapshot_seq = 0, max_op_seq = 0;
+  uint32_t max_snapshot_seq = 0;
+  Zone* snapshot_zone = nullptr;
   Status s;
 
   // Get snapshot zones
@@ -965,6 +1606,7 @@ Status ZenFS::Mount(bool readonly, bool formating) {
   }
 
   // Iterating snapshot zones to get last one.
+  std::map<uint32_t, Zone*> older_snapshot_zones;
   for (const auto& z : snapshot_zones) {
     log.reset(new ZenMetaLog(zbd_, z));
     if (!log->ReadRecord(&super_record, &scratch).ok()) continue;
@@ -972,8 +1614,10 @@ Status ZenFS::Mount(bool readonly, bool formating) {
     super_block.reset(new Superblock());
     s = super_block->DecodeFrom(&super_record);
     if (s.ok()) s = super_block->CompatibleWith(zbd_);
+    if (s.ok()) older_snapshot_zones[super_block->GetSeq()] = z;
     if (s.ok() && super_block->GetSeq() > max_snapshot_seq) {
       max_snapshot_seq = super_block->GetSeq();
+      snapshot_zone = z;
       snapshot_log_.reset(log.release());
       super_block_.reset(super_block.release());
     }
@@ -985,56 +1629,116 @@ Status ZenFS::Mount(bool readonly, bool formating) {
     return Status::Corruption("Mount", "Error: No valid snaphot.");
   }
 
-  // Get operation log zones
-  std::vector<Zone*> op_zones = zbd_->GetOpZones();
-  if (op_zones.size() < 2) {
-    Error(logger_,
-          "Need at least two non-offline meta zones to open for write");
-    return Status::NotSupported();
+  zbd_->SetFinishTreshold(super_block_->GetFinishTreshold());
+  zbd_->SetMaxActiveZones(super_block_->GetMaxActiveZoneLimit());
+  zbd_->SetMaxOpenZones(super_block_->GetMaxOpenZoneLimit());
+
+  IOStatus ios = zbd_->ReserveOpStreamZones(super_block_->GetNrOpStreams());
+  if (!ios.ok()) {
+    Error(logger_, "Failed to reserve op log stream zones: %s",
+          ios.ToString().c_str());
+    return ios;
   }
+  InitOpStreams(super_block_->GetNrOpStreams());
 
-  // Iterating operation log zones to get last one.
-  for (const auto& z : op_zones) {
-    log.reset(new ZenMetaLog(zbd_, z));
-    if (!log->ReadRecord(&super_record, &scratch).ok()) continue;
-    if (super_record.size() == 0) continue;
-    super_block.reset(new Superblock());
-    s = super_block->DecodeFrom(&super_record);
-    if (s.ok()) s = super_block->CompatibleWith(zbd_);
-    if (s.ok() && super_block->GetSeq() > max_op_seq) {
-      max_op_seq = super_block->GetSeq();
-      op_log_.reset(log.release());
-      if (max_op_seq > max_snapshot_seq) super_block_.reset(super_block.release());
+  /* The newest superblock of all logs is the current one */
+  uint32_t max_super_seq = max_snapshot_seq;
+  for (auto& stream : op_streams_) {
+    // Get operation log zones
+    std::vector<Zone*> op_zones = zbd_->GetOpZones(stream->id);
+    uint32_t max_op_seq = 0;
+
+    if (op_zones.size() < 2) {
+      Error(logger_,
+            "Need at least two non-offline meta zones to open for write");
+      return Status::NotSupported();
     }
-  }
 
-  if (max_op_seq == 0) {
-    // No avaliable snapshot zone, report error.
-    Error(logger_, "!!!Error : No valid opreation log!!!");
-    return Status::Corruption("Mount", "Error: No valid opreation log.");
+    // Iterating operation log zones to get last one.
+    for (const auto& z : op_zones) {
+      log.reset(new ZenMetaLog(zbd_, z));
+      if (!log->ReadRecord(&super_record, &scratch).ok()) continue;
+      if (super_record.size() == 0) continue;
+      super_block.reset(new Superblock());
+      s = super_block->DecodeFrom(&super_record);
+      if (s.ok()) s = super_block->CompatibleWith(zbd_);
+      if (s.ok() && super_block->GetSeq() > max_op_seq) {
+        max_op_seq = super_block->GetSeq();
+        stream->log.reset(log.release());
+        if (max_op_seq > max_super_seq) {
+          max_super_seq = max_op_seq;
+          super_block_.reset(super_block.release());
+        }
+      }
+    }
+
+    if (max_op_seq == 0) {
+      // No avaliable snapshot zone, report error.
+      Error(logger_, "!!!Error : No valid opreation log for stream %u!!!",
+            stream->id);
+      return Status::Corruption("Mount", "Error: No valid opreation log.");
+    }
+
+    assert(stream->log.get() != nullptr);
   }
 
-  assert(op_log_.get() != nullptr);
   assert(snapshot_log_.get() != nullptr);
   assert(super_block_.get() != nullptr);
 
-  zbd_->SetFinishTreshold(super_block_->GetFinishTreshold());
-  zbd_->SetMaxActiveZones(super_block_->GetMaxActiveZoneLimit());
-  zbd_->SetMaxOpenZones(super_block_->GetMaxOpenZoneLimit());
-
   // Recovery could be skipped if one's intend was formating the disk.
   if (!formating) {
     // Normal path, just mount, not format.
-    // Recover snapshot fisrt, then opreation log.
-    s = RecoverFrom(snapshot_log_.get());
+    // Gather the snapshot first, then all opreation logs, and replay the
+    // records newer than the latest snapshot in sequence order.
+    RecoveredOps ops;
+    /* A snapshot zone is only reset once the snapshot in the next one is
+     * complete, use the older zones in case that one was interrupted */
+    for (const auto& z : older_snapshot_zones) {
+      if (z.second == snapshot_zone) continue;
+      log.reset(new ZenMetaLog(zbd_, z.second));
+      s = RecoverFrom(log.get(), &ops);
+      if (!s.ok()) {
+        Warn(logger_, "Ignoring old snapshot zone %lu: %s",
+             z.second->GetZoneNr(), s.ToString().c_str());
+      }
+    }
+    s = RecoverFrom(snapshot_log_.get(), &ops);
     if (!s.ok() && !readonly) {
       Error(logger_, "!!!Error : Recover snapshot failed!!!\n%s", s.ToString().c_str());
       return Status::Corruption("Mount", "Error: Recover snapshot failed.\n");
     }
-    s = RecoverFrom(op_log_.get());
+    for (auto& stream : op_streams_) {
+      s = RecoverFrom(stream->log.get(), &ops);
+      if (!s.ok() && !readonly) {
+        Error(logger_, "!!!Error : Recover opreation log failed!!!\n%s",
+              s.ToString().c_str());
+        return Status::Corruption("Mount",
+                                  "Error: Recover opreation log failed.");
+      }
+    }
+    recovered_records_ = ops.nr_read;
+    uint64_t nr_records = ops.sequenced.size() + ops.unsequenced.size();
+    uint64_t replay_start = Env::Default()->NowNanos();
+    s = ReplayRecoveredOps(&ops);
     if (!s.ok() && !readonly) {
-      Error(logger_, "!!!Error : Recover opreation log failed!!!\n%s", s.ToString().c_str());
-      return Status::Corruption("Mount", "Error: Recover opreation log failed.");
+      Error(logger_, "!!!Error : Replay opreation log failed!!!\n%s",
+            s.ToString().c_str());
+      return Status::Corruption("Mount", "Error: Replay opreation log failed.");
+    }
+    uint64_t replay_ns = Env::Default()->NowNanos() - replay_start;
+    Info(logger_, "Replayed %lu op log records in %lu us", nr_records,
+         replay_ns / 1000);
+    if (nr_records >= ZENFS_MIN_REPLAY_SAMPLE && replay_ns > nr_records)
+      replay_ns_per_record_ = replay_ns / nr_records;
+    op_seq_ = std::max(ops.snapshot_seq, ops.max_seq);
+
+    for (auto& f : files_) {
+      s = f.second->RecoverSparseTail();
+      if (!s.ok()) {
+        Error(logger_, "Failed to recover synced data of %s: %s",
+              f.first.c_str(), s.ToString().c_str());
+        return s;
+      }
     }
 
     IOOptions foo;
@@ -1049,13 +1753,15 @@ Status ZenFS::Mount(bool readonly, bool formating) {
     if (readonly) {
       Info(logger_, "Mounting READ ONLY");
     } else {
-      files_mtx_.lock();
-      // Synchronized call.
-      s = RollMetaZoneLocked(false);
-      files_mtx_.unlock();
-      if (!s.ok()) {
-        Error(logger_, "Failed to roll metadata zone.");
-        return s;
+      std::lock_guard<std::mutex> files_lock(files_mtx_);
+      for (auto& stream : op_streams_) {
+        std::lock_guard<std::mutex> lock(stream->sync_mtx);
+        // Synchronized call.
+        s = RollMetaZoneLocked(stream.get(), false);
+        if (!s.ok()) {
+          Error(logger_, "Failed to roll metadata zone.");
+          return s;
+        }
       }
     }
   }
@@ -1076,12 +1782,14 @@ Status ZenFS::Mount(bool readonly, bool formating) {
 }
 
 Status ZenFS::MkFS(std::string aux_fs_path, uint32_t finish_threshold,
-                   uint32_t max_open_limit, uint32_t max_active_limit) {
+                   uint32_t max_open_limit, uint32_t max_active_limit,
+                   uint32_t nr_op_streams) {
   Status s;
   Zone* reset_zone;
   std::string super_string;
-  Superblock* super_block_ = new Superblock(zbd_, aux_fs_path, finish_threshold,
-                                            max_open_limit, max_active_limit);
+  Superblock* super_block_ =
+      new Superblock(zbd_, aux_fs_path, finish_threshold, max_open_limit,
+                     max_active_limit, nr_op_streams);
   /* TODO: check practical limits */
 
   if (max_open_limit > zbd_->GetMaxOpenZones()) {
@@ -1104,6 +1812,14 @@ Status ZenFS::MkFS(std::string aux_fs_path, uint32_t finish_threshold,
         "Aux filesystem path must be less than 256 bytes\n");
   }
 
+  IOStatus ios = zbd_->ReserveOpStreamZones(nr_op_streams);
+  if (!ios.ok()) {
+    Error(logger_, "Failed to reserve op log stream zones: %s",
+          ios.ToString().c_str());
+    return ios;
+  }
+  InitOpStreams(nr_op_streams);
+
   ClearFiles();
   zbd_->ResetUnusedIOZones();
 
@@ -1131,10 +1847,8 @@ Status ZenFS::MkFS(std::string aux_fs_path, uint32_t finish_threshold,
   }
 
   // Write an empty snapshot
-  std::string snapshot;
-  WriteSnapshotLocked(&snapshot);
-  snapshot_log_->AddRecord(snapshot);
-  WriteEndRecord(snapshot_log_.get());
+  s = WriteSnapshotLocked(snapshot_log_.get());
+  if (s.ok()) s = WriteEndRecord(snapshot_log_.get());
 
   if (!s.ok()) {
     Error(logger_, "Failed to reset snapshot: %s", s.ToString().c_str());
@@ -1143,30 +1857,34 @@ Status ZenFS::MkFS(std::string aux_fs_path, uint32_t finish_threshold,
 
   zbd_->ReportSpaceUtilization();
 
-  // Reset all used opreation log zones and get one for writing a new super block.
-  reset_zone = nullptr;
+  for (auto& stream : op_streams_) {
+    // Reset all used opreation log zones of the stream and get one for
+    // writing a new super block.
+    reset_zone = nullptr;
 
-  for (const auto& z : zbd_->GetOpZones()) {
-    if (z->Reset().ok()) {
-      if (!reset_zone) reset_zone = z;
-    } else {
-      Warn(logger_, "Failed to reset the zone\n");
-    } 
-  }
+    for (const auto& z : zbd_->GetOpZones(stream->id)) {
+      if (z->Reset().ok()) {
+        if (!reset_zone) reset_zone = z;
+      } else {
+        Warn(logger_, "Failed to reset the zone\n");
+      }
+    }
 
-  if (!reset_zone) {
-    return Status::IOError("No available zones for opreation log.\n");
-  }
+    if (!reset_zone) {
+      return Status::IOError("No available zones for opreation log.\n");
+    }
 
-  // Write super block for meta zone
-  op_log_.reset(new ZenMetaLog(zbd_, reset_zone));
-  super_block_->EncodeTo(&super_string);
-  s = op_log_->AddRecord(super_string);
-  WriteEndRecord(op_log_.get());
+    // Write super block for meta zone
+    stream->log.reset(new ZenMetaLog(zbd_, reset_zone));
+    super_string.clear();
+    super_block_->EncodeTo(&super_string);
+    s = stream->log->AddRecord(super_string);
+    if (s.ok()) s = WriteEndRecord(stream->log.get());
 
-  if (!s.ok()) {
-    Error(logger_, "Failed to reset op log: %s", s.ToString().c_str());
-    return Status::IOError("Failed to reset op log");
+    if (!s.ok()) {
+      Error(logger_, "Failed to reset op log: %s", s.ToString().c_str());
+      return Status::IOError("Failed to reset op log");
+    }
   }
 
   Info(logger_, "Empty filesystem created");
@@ -1185,9 +1903,38 @@ std::map<std::string, Env::WriteLifeTimeHint> ZenFS::GetWriteLifeTimeHints() {
   return hint_map;
 }
 
+IOStatus ZenFS::AdviseFileSizes(uint32_t files_per_zone,
+                                ZoneFileSizeAdvice* advice) {
+  if (files_per_zone == 0)
+    return IOStatus::InvalidArgument("files_per_zone must be at least 1");
+
+  ZoneGeometry geo = zbd_->GetGeometry();
+  uint64_t slice = geo.zone_capacity / files_per_zone;
+  uint64_t target = slice - slice * ZENFS_FILE_SIZE_SLACK_PCT / 100;
+  target -= target % geo.block_size;
+  if (target == 0)
+    return IOStatus::InvalidArgument("Too many files per zone");
+
+  advice->files_per_zone = files_per_zone;
+  advice->target_file_size = target;
+  /* Flushed files are at most about the size of the memtable */
+  advice->write_buffer_size = target;
+  return IOStatus::OK();
+}
+
+void ApplyZoneFileSizeAdvice(const ZoneFileSizeAdvice& advice,
+                             ColumnFamilyOptions* options) {
+  options->target_file_size_base = advice.target_file_size;
+  /* Every level has to use the same size to tile the zones */
+  options->target_file_size_multiplier = 1;
+  options->write_buffer_size = advice.write_buffer_size;
+}
+
 std::vector<ZoneStat> ZenFS::GetStat() {
   // Store size of each file_id in each zone
   std::map<uint64_t, std::map<uint64_t, uint64_t>> sizes;
+  // Store number of extents of each file_id in each zone
+  std::map<uint64_t, std::map<uint64_t, uint32_t>> nr_extents;
   // Store file_id to filename map
   std::map<uint64_t, std::string> filenames;
 
@@ -1197,9 +1944,10 @@ std::vector<ZoneStat> ZenFS::GetStat() {
     ZoneFile* file = file_it.second;
     uint64_t file_id = file->GetID();
     filenames[file_id] = file->GetFilename();
-    for (ZoneExtent* extent : file->GetExtents()) {
-      uint64_t zone_fake_id = extent->zone_->start_;
-      sizes[zone_fake_id][file_id] += extent->length_;
+    for (const ZoneExtent& extent : file->GetExtents()) {
+      uint64_t zone_fake_id = extent.zone_nr_ * zbd_->GetZoneSize();
+      sizes[zone_fake_id][file_id] += extent.length_;
+      nr_extents[zone_fake_id][file_id]++;
     }
   }
 
@@ -1216,6 +1964,7 @@ std::vector<ZoneStat> ZenFS::GetStat() {
       ZoneFileStat file_stat;
       file_stat.file_id = file_id;
       file_stat.size_in_zone = file_length;
+      file_stat.extents_in_zone = nr_extents[zone.start_position][file_id];
       file_stat.filename = filenames[file_id];
       zone.files.emplace_back(std::move(file_stat));
     }
@@ -1315,6 +2064,30 @@ std::map<std::string, std::string> ListZenFileSystems() {
   return zenFileSystems;
 }
 
+/* Options appended to a zenfs:// URI as ?name=value&name=value */
+static Status ApplyZenFSUriOptions(ZenFS* zenFS, const std::string& options) {
+  std::stringstream ss(options);
+  std::string option;
+
+  while (std::getline(ss, option, '&')) {
+    size_t eq = option.find('=');
+    std::string name = option.substr(0, eq);
+    std::string value = eq == std::string::npos ? "" : option.substr(eq + 1);
+    char* end = nullptr;
+
+    if (name == "read_cache_size") {
+      uint64_t size = strtoull(value.c_str(), &end, 10);
+      if (value.empty() || *end != '\0')
+        return Status::InvalidArgument("Bad read_cache_size: ", value);
+      zenFS->GetZonedBlockDevice()->SetReadCacheSize(size);
+    } else {
+      return Status::InvalidArgument("Unknown ZenFS option: ", name);
+    }
+  }
+
+  return Status::OK();
+}
+
 extern "C" FactoryFunc<FileSystem> zenfs_filesystem_reg;
 
 FactoryFunc<FileSystem> zenfs_filesystem_reg =
@@ -1322,10 +2095,16 @@ FactoryFunc<FileSystem> zenfs_filesystem_reg =
         "zenfs://.*", [](const std::string& uri, std::unique_ptr<FileSystem>* f,
                          std::string* errmsg) {
           std::string devID = uri;
+          std::string options;
           FileSystem* fs = nullptr;
           Status s;
 
           devID.replace(0, strlen("zenfs://"), "");
+          size_t query = devID.find('?');
+          if (query != std::string::npos) {
+            options = devID.substr(query + 1);
+            devID.resize(query);
+          }
           if (devID.rfind("dev:") == 0) {
             devID.replace(0, strlen("dev:"), "");
             s = NewZenFS(&fs, devID, "zenfs-testing",
@@ -1354,6 +2133,14 @@ FactoryFunc<FileSystem> zenfs_filesystem_reg =
           } else {
             *errmsg = "Malformed URI";
           }
+          if (fs != nullptr) {
+            s = ApplyZenFSUriOptions(static_cast<ZenFS*>(fs), options);
+            if (!s.ok()) {
+              *errmsg = s.ToString();
+              delete fs;
+              fs = nullptr;
+            }
+          }
           f->reset(fs);
           return f->get();
         });
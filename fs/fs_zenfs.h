@@ -6,10 +6,17 @@
 
 #pragma once
 
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
 #include <string>
+#include <utility>
+
 #include "io_zenfs.h"
 #include "rocksdb/env.h"
 #include "rocksdb/file_system.h"
+#include "rocksdb/options.h"
 #include "rocksdb/status.h"
 #include "zbd_stat.h"
 #include "zbd_zenfs.h"
@@ -31,13 +38,18 @@ class Superblock {
   char aux_fs_path_[256] = {0};
   uint32_t max_active_limit_ = 0;
   uint32_t max_open_limit_ = 0;
-  char reserved_[179] = {0};
+  uint32_t nr_op_streams_ = 0; /* 0 for file systems predating streams */
+  uint32_t nr_devices_ = 0;    /* 0 for file systems predating spanning */
+  uint32_t range_first_ = 0;   /* First zone of the claimed zone range */
+  uint32_t range_nr_ = 0;      /* 0 for file systems predating ranges */
+  char reserved_[163] = {0};
 
  public:
   const uint32_t MAGIC = 0x5a454e46; /* ZENF */
   const uint32_t ENCODED_SIZE = 512;
   const uint32_t CURRENT_VERSION = 1;
   const uint32_t DEFAULT_FLAGS = 0;
+  const uint32_t FLAG_MIRRORED = 1; /* See ZonedBlockDevice::IsMirrored */
 
   Superblock() {}
 
@@ -45,7 +57,7 @@ class Superblock {
    */
   Superblock(ZonedBlockDevice* zbd, std::string aux_fs_path,
              uint32_t finish_threshold, uint32_t max_open_limit,
-             uint32_t max_active_limit) {
+             uint32_t max_active_limit, uint32_t nr_op_streams = 1) {
     std::string uuid = Env::Default()->GenerateUniqueId();
     int uuid_len =
         std::min(uuid.length(),
@@ -55,10 +67,15 @@ class Superblock {
     version_ = CURRENT_VERSION;
     flags_ = DEFAULT_FLAGS;
     finish_treshold_ = finish_threshold;
+    nr_op_streams_ = nr_op_streams;
 
     block_size_ = zbd->GetBlockSize();
     zone_size_ = zbd->GetZoneSize() / block_size_;
     nr_zones_ = zbd->GetNrZones();
+    nr_devices_ = zbd->GetNrDevices();
+    range_first_ = zbd->GetRangeFirstZone();
+    range_nr_ = zbd->GetRangeNrZones();
+    if (zbd->IsMirrored()) flags_ |= FLAG_MIRRORED;
 
     if (max_open_limit == 0) {
       max_open_limit_ = zbd->GetMaxOpenZones();
@@ -84,6 +101,8 @@ class Superblock {
   uint32_t GetFinishTreshold() { return finish_treshold_; }
   uint32_t GetMaxOpenZoneLimit() { return max_open_limit_; }
   uint32_t GetMaxActiveZoneLimit() { return max_active_limit_; }
+  uint32_t GetNrOpStreams() { return nr_op_streams_ ? nr_op_streams_ : 1; }
+  uint32_t GetNrDevices() { return nr_devices_ ? nr_devices_ : 1; }
   std::string GetUUID() { return std::string(uuid_); }
 };
 
@@ -109,12 +128,16 @@ class ZenMetaLog {
   virtual ~ZenMetaLog() { zone_->open_for_write_ = false; }
 
   IOStatus AddRecord(const Slice& slice);
+  /* Pack the records back to back into one append, padding only the last
+   * block */
+  IOStatus AddRecords(const std::vector<Slice>& records);
   IOStatus ReadRecord(Slice* record, std::string* scratch);
 
   Zone* GetZone() { return zone_; };
 
  private:
   IOStatus Read(Slice* slice);
+  size_t AlignForHeader(size_t pos);
 };
 
 class ZenFS : public FileSystemWrapper {
@@ -126,11 +149,73 @@ class ZenFS : public FileSystemWrapper {
   std::atomic<uint64_t> next_file_id_;
 
   Zone* cur_meta_zone_ = nullptr;
-  std::unique_ptr<ZenMetaLog> op_log_;
   std::unique_ptr<ZenMetaLog> snapshot_log_;
-  std::mutex metadata_sync_mtx_;
   std::unique_ptr<Superblock> super_block_;
 
+  struct OpStream;
+
+  /* An op log record waiting to be written, see CommitRecord */
+  struct PendingRecord {
+    std::string data;
+    OpStream* stream = nullptr;
+    bool done = false;
+    IOStatus status;
+  };
+
+  /* Files are spread over the op log streams by file id. Every record
+   * carries a global sequence number, recovery merges the streams in
+   * sequence order. */
+  struct OpStream {
+    uint32_t id;
+    std::unique_ptr<ZenMetaLog> log;
+    std::mutex sync_mtx; /* Serializes appends to log */
+    std::deque<PendingRecord*> pending;
+    std::mutex pending_mtx;
+  };
+  std::vector<std::unique_ptr<OpStream>> op_streams_;
+  uint64_t op_seq_ = 0; /* Last sequence number handed out, see files_mtx_ */
+  uint64_t snapshot_seq_ = 0; /* op_seq_ of the last persisted snapshot */
+  /* Files whose deletion failed to persist after their name was reused, kept
+   * until shutdown as the persisted metadata still refers to their data */
+  std::vector<ZoneFile*> unpersisted_deletes_;
+
+  /* Background checkpoints keep the op log replay after the latest snapshot
+   * within recovery_budget_ms_, see MaybeCheckpointLocked */
+  uint64_t recovery_budget_ms_;
+  uint64_t replay_ns_per_record_; /* Estimate, measured on mount */
+  uint64_t recovered_records_ = 0;
+  uint64_t records_since_checkpoint_ = 0; /* Protected by files_mtx_ */
+  bool checkpoint_pending_ = false;       /* Protected by checkpoint_mtx_ */
+  std::mutex checkpoint_mtx_;
+  std::condition_variable checkpoint_cv_;
+
+  bool sparse_wal_sync_ = false;
+
+  /* Meta log contents gathered during recovery. Records without a sequence
+   * number were written before op log streams existed and are replayed in
+   * log order. */
+  struct RecoveredOps {
+    bool has_snapshot = false;
+    bool snapshot_compact = false;
+    uint64_t snapshot_seq = 0;
+    std::string snapshot;
+    std::map<uint64_t, std::pair<uint32_t, std::string>> sequenced;
+    std::vector<std::pair<uint32_t, std::string>> unsequenced;
+    uint64_t max_seq = 0;
+    uint64_t nr_read = 0; /* Records read, superblocks not counted */
+
+    /* Unsequenced snapshots order as zero, later logs win ties */
+    void AddSnapshot(uint64_t seq, bool compact, std::string* data) {
+      if (has_snapshot && seq < snapshot_seq) return;
+      has_snapshot = true;
+      snapshot_compact = compact;
+      snapshot_seq = seq;
+      snapshot.swap(*data);
+      unsequenced.clear();
+      sequenced.erase(sequenced.begin(), sequenced.upper_bound(seq));
+    }
+  };
+
   std::shared_ptr<Logger> GetLogger() { return logger_; }
 
   struct MetadataWriter : public ZonedWritableFile::MetadataWriter {
@@ -149,28 +234,48 @@ class ZenFS : public FileSystemWrapper {
     kFileUpdate = 2,
     kFileDeletion = 3,
     kEndRecord = 4,
+    /* Snapshots and updates using the compact file encoding, the original
+     * records above are still decoded */
+    kCompactFilesSnapshot = 5,
+    kCompactFileUpdate = 6,
+    /* Prefix carrying the global sequence number of the record following it
+     * in the same meta log record */
+    kSequence = 7,
+    /* Part of a snapshot written in chunks, see WriteSnapshotLocked */
+    kSnapshotChunk = 8,
   };
 
+  /* Flags of a kSnapshotChunk record */
+  enum SnapshotChunkFlags : uint32_t { kLastSnapshotChunk = 1 };
+
   void LogFiles();
   void ClearFiles();
-  void WriteSnapshotLocked(std::string* snapshot);
+  IOStatus WriteSnapshotLocked(ZenMetaLog* meta_log);
+  IOStatus WriteSnapshotChunk(ZenMetaLog* meta_log, uint32_t index,
+                              bool last, const std::string& entries);
+  IOStatus PersistSnapshotLocked();
   IOStatus WriteEndRecord(ZenMetaLog* meta_log);
-  IOStatus RollMetaZoneLocked(bool async);
-  IOStatus RollSnapshotZone(std::string* snapshot);
-  /* experimental function only! */
-  IOStatus PersistRecord(ZenMetaLog* meta_writer, std::string* record);
+  void InitOpStreams(uint32_t nr_streams);
+  IOStatus RollMetaZoneLocked(OpStream* stream, bool async);
+  IOStatus RollSnapshotZoneLocked();
+  void QueueRecordLocked(uint64_t file_id, PendingRecord* record);
+  void MaybeCheckpointLocked();
+  void Checkpoint();
+  IOStatus CommitRecord(PendingRecord* record);
   IOStatus SyncFileMetadata(ZoneFile* zoneFile);
 
-  void EncodeSnapshotTo(std::string* output);
   void EncodeFileDeletionTo(ZoneFile* zoneFile, std::string* output);
 
-  Status TestSnapshotCorrectness(Slice* input);
-  
-  Status DecodeSnapshotFrom(Slice* input);
-  Status DecodeFileUpdateFrom(Slice* slice);
+  Status DecodeFileFrom(ZoneFile* zoneFile, Slice* input, bool compact,
+                        const std::string& ref_name);
+
+  Status DecodeSnapshotFrom(Slice* input, bool compact);
+  Status DecodeFileUpdateFrom(Slice* slice, bool compact);
   Status DecodeFileDeletionFrom(Slice* slice);
 
-  Status RecoverFrom(ZenMetaLog* log);
+  Status ReplayRecord(uint32_t tag, Slice* data);
+  Status RecoverFrom(ZenMetaLog* log, RecoveredOps* ops);
+  Status ReplayRecoveredOps(RecoveredOps* ops);
 
   std::string ToAuxPath(std::string path) {
     return super_block_->GetAuxFsPath() + path;
@@ -186,6 +291,12 @@ class ZenFS : public FileSystemWrapper {
   ZoneFile* GetFile(std::string fname);
   IOStatus DeleteFile(std::string fname);
 
+  /* Snapshot files are named <ZENFS_FS_SNAPSHOT_DIR><id>/<live name>, an
+   * empty file named <ZENFS_FS_SNAPSHOT_DIR><id> marks the snapshot */
+  static std::string SnapshotRoot(uint64_t id);
+  static bool IsSnapshotFile(const std::string& fname);
+  std::vector<uint64_t> ListSnapshotsLocked();
+
  public:
   explicit ZenFS(ZonedBlockDevice* zbd, std::shared_ptr<FileSystem> aux_fs,
                  std::shared_ptr<Logger> logger);
@@ -193,9 +304,45 @@ class ZenFS : public FileSystemWrapper {
 
   Status Mount(bool readonly, bool formating = false);
   Status MkFS(std::string aux_fs_path, uint32_t finish_threshold,
-              uint32_t max_open_limit, uint32_t max_active_limit);
+              uint32_t max_open_limit, uint32_t max_active_limit,
+              uint32_t nr_op_streams = 1);
   std::map<std::string, Env::WriteLifeTimeHint> GetWriteLifeTimeHints();
 
+  /* Write a snapshot in the background whenever replaying the op log records
+   * written since the last one is estimated to take longer than budget_ms.
+   * Zero disables checkpoints, snapshots are then only written when an op
+   * log zone is full. */
+  void SetRecoveryBudget(uint64_t budget_ms) {
+    recovery_budget_ms_ = budget_ms;
+  }
+  /* Metadata records read from the snapshot and op logs by the last mount,
+   * superblocks not counted */
+  uint64_t GetRecoveredRecords() { return recovered_records_; }
+
+  /* Create buffered WAL files as sparse files: syncs that stay in an already
+   * logged zone only write the data and a trailer, the file size is
+   * recovered from the trailers on mount. Files keep the mode they were
+   * created with. */
+  void SetSparseWALSync(bool enable) { sparse_wal_sync_ = enable; }
+
+  /* File system snapshots, not to be confused with the metadata snapshots
+   * in the snapshot zones. A snapshot links every file, so it shares all
+   * data with the live files and keeps it allocated until the snapshot is
+   * deleted. Files open for writing are included with the data written so
+   * far. Creating or deleting a snapshot writes a single metadata
+   * snapshot, no data is copied. */
+  IOStatus CreateSnapshot(uint64_t* id);
+  IOStatus DeleteSnapshot(uint64_t id);
+  std::vector<uint64_t> ListSnapshots();
+  /* Read-only file system showing the files of snapshot id as they were
+   * when it was created. The snapshot must not be deleted while the result
+   * is in use. */
+  IOStatus OpenSnapshot(uint64_t id, std::unique_ptr<FileSystem>* result);
+
+  /* The ZenFS files in dir, without the contents of the aux directory */
+  void GetZenFSChildren(const std::string& dir,
+                        std::vector<std::string>* result);
+
   const char* Name() const override {
     return "ZenFS - The Zoned-enabled File System";
   }
@@ -210,6 +357,13 @@ class ZenFS : public FileSystemWrapper {
       const std::string& fname, const FileOptions& file_opts,
       std::unique_ptr<FSRandomAccessFile>* result,
       IODebugContext* dbg) override;
+#if ROCKSDB_MAJOR >= 7
+  /* Async reads are only issued by ZonedRandomAccessFile, so all handles
+   * are ZonedAsyncReadHandles */
+  IOStatus Poll(std::vector<void*>& io_handles,
+                size_t min_completions) override;
+  IOStatus AbortIO(std::vector<void*>& io_handles) override;
+#endif
   virtual IOStatus NewWritableFile(const std::string& fname,
                                    const FileOptions& file_opts,
                                    std::unique_ptr<FSWritableFile>* result,
@@ -348,31 +502,182 @@ class ZenFS : public FileSystemWrapper {
         "MemoryMappedFileBuffer is not implemented in ZenFS");
   }
 
-  virtual IOStatus LinkFile(const std::string& /*src*/,
-                            const std::string& /*target*/,
-                            const IOOptions& /*options*/,
-                            IODebugContext* /*dbg*/) override {
-    return IOStatus::NotSupported("LinkFile is not supported in ZenFS");
+  /* Links are separate files sharing the extents of the source file, so
+   * linking only writes metadata. Files open for writing cannot be
+   * linked. */
+  IOStatus LinkFile(const std::string& src, const std::string& target,
+                    const IOOptions& options, IODebugContext* dbg) override;
+  IOStatus NumFileLinks(const std::string& fname, const IOOptions& options,
+                        uint64_t* count, IODebugContext* dbg) override;
+  IOStatus AreFilesSame(const std::string& first, const std::string& second,
+                        const IOOptions& options, bool* res,
+                        IODebugContext* dbg) override;
+
+  std::vector<ZoneStat> GetStat();
+  /* Zone statistics without the per-file breakdown of GetStat. This does
+   * not walk the files, so it is cheap enough to call periodically. */
+  void ForEachZoneStat(const std::function<void(const ZoneStat&)>& fn) {
+    zbd_->ForEachZoneStat(fn);
   }
 
-  virtual IOStatus NumFileLinks(const std::string& /*fname*/,
-                                const IOOptions& /*options*/,
-                                uint64_t* /*count*/,
-                                IODebugContext* /*dbg*/) override {
-    return IOStatus::NotSupported(
-        "Getting number of file links is not supported in ZenFS");
+  /* Zone capacity and the zones used by each write lifetime. Files of a
+   * lifetime are appended to the zones opened for it, so table files sized
+   * to tile the zone capacity free whole zones when they are deleted. */
+  ZoneGeometry GetZoneGeometry() { return zbd_->GetGeometry(); }
+  /* File sizes with which files_per_zone table files fill an io zone, see
+   * ApplyZoneFileSizeAdvice */
+  IOStatus AdviseFileSizes(uint32_t files_per_zone,
+                           ZoneFileSizeAdvice* advice);
+
+  ZonedBlockDevice* GetZonedBlockDevice() { return zbd_; }
+};
+
+/* Set the file size options of a column family from AdviseFileSizes: the
+ * target file size of all levels and the memtable size. */
+void ApplyZoneFileSizeAdvice(const ZoneFileSizeAdvice& advice,
+                             ColumnFamilyOptions* options);
+
+/* Read-only view of a file system snapshot, see ZenFS::OpenSnapshot. Names
+ * are mapped to the snapshot's files, everything that would modify the file
+ * system fails with NotSupported. */
+class ZenFSSnapshot : public FileSystemWrapper {
+  ZenFS* zenFS_;
+  std::string root_;
+
+  std::string ToSnapshotPath(const std::string& fname) {
+    return root_ + fname;
   }
 
-  virtual IOStatus AreFilesSame(const std::string& /*first*/,
-                                const std::string& /*second*/,
-                                const IOOptions& /*options*/, bool* /*res*/,
-                                IODebugContext* /*dbg*/) override {
-    return IOStatus::NotSupported("AreFilesSame is not supported in ZenFS");
+  IOStatus ReadOnly() {
+    return IOStatus::NotSupported("ZenFS snapshots are read-only");
   }
 
-  std::vector<ZoneStat> GetStat();
+ public:
+  ZenFSSnapshot(ZenFS* zenFS, const std::string& root);
 
-  ZonedBlockDevice* GetZonedBlockDevice() { return zbd_; }
+  const char* Name() const override { return "ZenFSSnapshot"; }
+
+  IOStatus NewSequentialFile(const std::string& fname,
+                             const FileOptions& file_opts,
+                             std::unique_ptr<FSSequentialFile>* result,
+                             IODebugContext* dbg) override {
+    return zenFS_->NewSequentialFile(ToSnapshotPath(fname), file_opts, result,
+                                     dbg);
+  }
+  IOStatus NewRandomAccessFile(const std::string& fname,
+                               const FileOptions& file_opts,
+                               std::unique_ptr<FSRandomAccessFile>* result,
+                               IODebugContext* dbg) override {
+    return zenFS_->NewRandomAccessFile(ToSnapshotPath(fname), file_opts,
+                                       result, dbg);
+  }
+  IOStatus FileExists(const std::string& fname, const IOOptions& options,
+                      IODebugContext* dbg) override {
+    return zenFS_->FileExists(ToSnapshotPath(fname), options, dbg);
+  }
+  IOStatus GetFileSize(const std::string& fname, const IOOptions& options,
+                       uint64_t* size, IODebugContext* dbg) override {
+    return zenFS_->GetFileSize(ToSnapshotPath(fname), options, size, dbg);
+  }
+  IOStatus GetFileModificationTime(const std::string& fname,
+                                   const IOOptions& options, uint64_t* mtime,
+                                   IODebugContext* dbg) override {
+    return zenFS_->GetFileModificationTime(ToSnapshotPath(fname), options,
+                                           mtime, dbg);
+  }
+  IOStatus NumFileLinks(const std::string& fname, const IOOptions& options,
+                        uint64_t* count, IODebugContext* dbg) override {
+    return zenFS_->NumFileLinks(ToSnapshotPath(fname), options, count, dbg);
+  }
+  IOStatus AreFilesSame(const std::string& first, const std::string& second,
+                        const IOOptions& options, bool* res,
+                        IODebugContext* dbg) override {
+    return zenFS_->AreFilesSame(ToSnapshotPath(first), ToSnapshotPath(second),
+                                options, res, dbg);
+  }
+  IOStatus GetChildren(const std::string& dir, const IOOptions& options,
+                       std::vector<std::string>* result,
+                       IODebugContext* dbg) override;
+  IOStatus IsDirectory(const std::string& path, const IOOptions& options,
+                       bool* is_dir, IODebugContext* dbg) override;
+
+  IOStatus NewWritableFile(const std::string& /*fname*/,
+                           const FileOptions& /*file_opts*/,
+                           std::unique_ptr<FSWritableFile>* /*result*/,
+                           IODebugContext* /*dbg*/) override {
+    return ReadOnly();
+  }
+  IOStatus ReopenWritableFile(const std::string& /*fname*/,
+                              const FileOptions& /*file_opts*/,
+                              std::unique_ptr<FSWritableFile>* /*result*/,
+                              IODebugContext* /*dbg*/) override {
+    return ReadOnly();
+  }
+  IOStatus ReuseWritableFile(const std::string& /*fname*/,
+                             const std::string& /*old_fname*/,
+                             const FileOptions& /*file_opts*/,
+                             std::unique_ptr<FSWritableFile>* /*result*/,
+                             IODebugContext* /*dbg*/) override {
+    return ReadOnly();
+  }
+  IOStatus NewRandomRWFile(const std::string& /*fname*/,
+                           const FileOptions& /*file_opts*/,
+                           std::unique_ptr<FSRandomRWFile>* /*result*/,
+                           IODebugContext* /*dbg*/) override {
+    return ReadOnly();
+  }
+  IOStatus NewDirectory(const std::string& /*name*/,
+                        const IOOptions& /*io_opts*/,
+                        std::unique_ptr<FSDirectory>* /*result*/,
+                        IODebugContext* /*dbg*/) override {
+    return ReadOnly();
+  }
+  IOStatus DeleteFile(const std::string& /*fname*/,
+                      const IOOptions& /*options*/,
+                      IODebugContext* /*dbg*/) override {
+    return ReadOnly();
+  }
+  IOStatus Truncate(const std::string& /*fname*/, size_t /*size*/,
+                    const IOOptions& /*options*/,
+                    IODebugContext* /*dbg*/) override {
+    return ReadOnly();
+  }
+  IOStatus RenameFile(const std::string& /*src*/, const std::string& /*target*/,
+                      const IOOptions& /*options*/,
+                      IODebugContext* /*dbg*/) override {
+    return ReadOnly();
+  }
+  IOStatus LinkFile(const std::string& /*src*/, const std::string& /*target*/,
+                    const IOOptions& /*options*/,
+                    IODebugContext* /*dbg*/) override {
+    return ReadOnly();
+  }
+  IOStatus CreateDir(const std::string& /*dirname*/,
+                     const IOOptions& /*options*/,
+                     IODebugContext* /*dbg*/) override {
+    return ReadOnly();
+  }
+  IOStatus CreateDirIfMissing(const std::string& /*dirname*/,
+                              const IOOptions& /*options*/,
+                              IODebugContext* /*dbg*/) override {
+    return ReadOnly();
+  }
+  IOStatus DeleteDir(const std::string& /*dirname*/,
+                     const IOOptions& /*options*/,
+                     IODebugContext* /*dbg*/) override {
+    return ReadOnly();
+  }
+  IOStatus LockFile(const std::string& /*fname*/, const IOOptions& /*options*/,
+                    FileLock** /*lock*/, IODebugContext* /*dbg*/) override {
+    return ReadOnly();
+  }
+  /* Read-only DB opens do without an info log */
+  IOStatus NewLogger(const std::string& /*fname*/,
+                     const IOOptions& /*options*/,
+                     std::shared_ptr<Logger>* /*result*/,
+                     IODebugContext* /*dbg*/) override {
+    return ReadOnly();
+  }
 };
 #endif  // !defined(ROCKSDB_LITE) && defined(OS_LINUX)
 
@@ -19,8 +19,9 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <iostream>
-
+#include <memory>
 #include <string>
 #include <utility>
 #include <vector>
@@ -28,10 +29,16 @@
 #include "rocksdb/env.h"
 #include "rocksdb/metrics_reporter.h"
 #include "util/coding.h"
+#include "util/crc32c.h"
 #include "zbd_zenfs.h"
 
+/* Amount of data read at a time when scanning for sync trailers */
+#define ZENFS_SYNC_TRAILER_SCAN_SIZE (1024 * 1024)
+
 namespace ROCKSDB_NAMESPACE {
 
+static const uint32_t kSyncTrailerMagic = 0x5a53594e; /* "ZSYN" */
+
 Status ZoneExtent::DecodeFrom(Slice* input) {
   if (input->size() != (sizeof(start_) + sizeof(length_)))
     return Status::Corruption("ZoneExtent", "Error: length missmatch");
@@ -41,11 +48,6 @@ Status ZoneExtent::DecodeFrom(Slice* input) {
   return Status::OK();
 }
 
-void ZoneExtent::EncodeTo(std::string* output) {
-  PutFixed64(output, start_);
-  PutFixed32(output, length_);
-}
-
 void ZoneExtent::EncodeJson(std::ostream& json_stream) {
   json_stream << "{";
   json_stream << "\"start\":" << start_ << ",";
@@ -62,31 +64,61 @@ enum ZoneFileTag : uint32_t {
   kModificationTime = 6,
 };
 
-void ZoneFile::EncodeTo(std::string* output, uint32_t extent_start) {
-  PutFixed32(output, kFileID);
-  PutFixed64(output, file_id_);
+enum ZoneFileCompactFlag : uint32_t {
+  kCompactHasName = 1,
+  kCompactExtendsLast = 2,
+  kCompactSparse = 4,
+};
 
-  PutFixed32(output, kFileName);
-  PutLengthPrefixedSlice(output, Slice(filename_));
+void ZoneFile::EncodeCompactTo(std::string* output, uint32_t extent_start,
+                               const std::string* ref_name) {
+  bool has_name = (ref_name != nullptr) || (filename_ != synced_name_);
+  bool extends_last = extent_start > 0 &&
+                      extents_[extent_start - 1].length_ != synced_last_length_;
+  const ZoneExtent* prev = nullptr;
+  uint32_t flags = 0;
+
+  if (has_name) flags |= kCompactHasName;
+  if (extends_last) flags |= kCompactExtendsLast;
+  if (sparse_) flags |= kCompactSparse;
+
+  PutVarint64(output, file_id_);
+  PutVarint32(output, flags);
+
+  if (has_name) {
+    size_t shared = 0;
+    if (ref_name) {
+      size_t max = std::min(ref_name->size(), filename_.size());
+      while (shared < max && (*ref_name)[shared] == filename_[shared])
+        shared++;
+    }
+    PutVarint32(output, shared);
+    PutLengthPrefixedSlice(
+        output, Slice(filename_.data() + shared, filename_.size() - shared));
+  }
 
-  PutFixed32(output, kFileSize);
-  PutFixed64(output, fileSize);
+  PutVarint64(output, fileSize);
+  PutVarint32(output, (uint32_t)lifetime_);
+  PutVarint64(output, (uint64_t)m_time_);
 
-  PutFixed32(output, kWriteLifeTimeHint);
-  PutFixed32(output, (uint32_t)lifetime_);
+  if (extends_last) PutVarint32(output, extents_[extent_start - 1].length_);
 
+  PutVarint32(output, extents_.size() - extent_start);
   for (uint32_t i = extent_start; i < extents_.size(); i++) {
-    std::string extent_str;
-
-    PutFixed32(output, kExtent);
-    extents_[i]->EncodeTo(&extent_str);
-    PutLengthPrefixedSlice(output, Slice(extent_str));
+    const ZoneExtent* extent = &extents_[i];
+
+    /* The low bit tells a delta from the end of the previous extent from an
+     * absolute device offset */
+    if (prev && prev->zone_nr_ == extent->zone_nr_ &&
+        extent->start_ >= (prev->start_ + prev->length_)) {
+      uint64_t delta = extent->start_ - (prev->start_ + prev->length_);
+      PutVarint64(output, (delta << 1) | 1);
+    } else {
+      PutVarint64(output, extent->start_ << 1);
+    }
+    PutVarint32(output, extent->length_);
+    prev = extent;
   }
-
-  PutFixed32(output, kModificationTime);
-  PutFixed64(output, (uint64_t)m_time_);
-  /* We're not encoding active zone and extent start
-   * as files will always be read-only after mount */
 }
 
 void ZoneFile::EncodeJson(std::ostream& json_stream) {
@@ -98,18 +130,21 @@ void ZoneFile::EncodeJson(std::ostream& json_stream) {
   json_stream << "\"extents\":[";
 
   bool first_element = true;
-  for (ZoneExtent* extent : extents_) {
+  for (ZoneExtent& extent : extents_) {
     if (first_element) {
       first_element = false;
     } else {
       json_stream << ",";
     }
-    extent->EncodeJson(json_stream);
+    extent.EncodeJson(json_stream);
   }
   json_stream << "]}";
 }
 
 Status ZoneFile::DecodeFrom(Slice* input) {
+  /* Extents are accounted to their zones once the modification time, which
+   * is encoded after them, is known */
+  std::vector<ZoneExtent> decoded;
   uint32_t tag = 0;
 
   GetFixed32(input, &tag);
@@ -118,7 +153,7 @@ Status ZoneFile::DecodeFrom(Slice* input) {
 
   while (true) {
     Slice slice;
-    ZoneExtent* extent;
+    ZoneExtent extent;
     Status s;
 
     if (!GetFixed32(input, &tag)) break;
@@ -142,18 +177,13 @@ Status ZoneFile::DecodeFrom(Slice* input) {
         lifetime_ = (Env::WriteLifeTimeHint)lt;
         break;
       case kExtent:
-        extent = new ZoneExtent(0, 0, nullptr);
         GetLengthPrefixedSlice(input, &slice);
-        s = extent->DecodeFrom(&slice);
-        if (!s.ok()) {
-          delete extent;
-          return s;
-        }
-        extent->zone_ = zbd_->GetIOZone(extent->start_);
-        if (!extent->zone_)
+        s = extent.DecodeFrom(&slice);
+        if (!s.ok()) return s;
+        if (!zbd_->GetIOZone(extent.start_))
           return Status::Corruption("ZoneFile", "Invalid zone extent");
-        extent->zone_->used_capacity_ += extent->length_;
-        extents_.push_back(extent);
+        extent.zone_nr_ = extent.start_ / zbd_->GetZoneSize();
+        decoded.push_back(extent);
         break;
       case kModificationTime:
         uint64_t ct;
@@ -166,6 +196,87 @@ Status ZoneFile::DecodeFrom(Slice* input) {
     }
   }
 
+  for (auto& e : decoded)
+    GetExtentZone(e)->AddExtent(e.start_, e.length_, lifetime_, m_time_);
+  extents_.insert(extents_.end(), decoded.begin(), decoded.end());
+
+  MetadataSynced();
+  return Status::OK();
+}
+
+Status ZoneFile::DecodeCompactFrom(Slice* input, const std::string& ref_name) {
+  std::vector<ZoneExtent> decoded;
+  uint64_t prev_end = 0;
+  uint32_t nr_extents;
+  uint32_t flags;
+  uint32_t lt;
+  uint64_t mt;
+
+  if (!GetVarint64(input, &file_id_))
+    return Status::Corruption("ZoneFile", "File ID missing");
+
+  if (!GetVarint32(input, &flags))
+    return Status::Corruption("ZoneFile", "Flags missing");
+
+  sparse_ = (flags & kCompactSparse) != 0;
+
+  filename_.clear();
+  if (flags & kCompactHasName) {
+    uint32_t shared;
+    Slice suffix;
+
+    if (!GetVarint32(input, &shared) || shared > ref_name.size() ||
+        !GetLengthPrefixedSlice(input, &suffix))
+      return Status::Corruption("ZoneFile", "Filename missing");
+    filename_ = ref_name.substr(0, shared) + suffix.ToString();
+    if (filename_.length() == 0)
+      return Status::Corruption("ZoneFile", "Zero length filename");
+  }
+
+  if (!GetVarint64(input, &fileSize))
+    return Status::Corruption("ZoneFile", "Missing file size");
+  if (!GetVarint32(input, &lt))
+    return Status::Corruption("ZoneFile", "Missing life time hint");
+  lifetime_ = (Env::WriteLifeTimeHint)lt;
+  if (!GetVarint64(input, &mt))
+    return Status::Corruption("ZoneFile", "Missing modification time");
+  m_time_ = (time_t)mt;
+
+  update_last_length_ = 0;
+  if ((flags & kCompactExtendsLast) &&
+      (!GetVarint32(input, &update_last_length_) || update_last_length_ == 0))
+    return Status::Corruption("ZoneFile", "Missing extent length update");
+
+  if (!GetVarint32(input, &nr_extents))
+    return Status::Corruption("ZoneFile", "Missing extent count");
+
+  for (uint32_t i = 0; i < nr_extents; i++) {
+    uint64_t start;
+    uint32_t length;
+    Zone* zone;
+
+    if (!GetVarint64(input, &start) || !GetVarint32(input, &length))
+      return Status::Corruption("ZoneFile", "Missing extent");
+
+    if (start & 1) {
+      if (decoded.empty())
+        return Status::Corruption("ZoneFile", "Invalid extent delta");
+      start = prev_end + (start >> 1);
+    } else {
+      start = start >> 1;
+    }
+
+    zone = zbd_->GetIOZone(start);
+    if (!zone) return Status::Corruption("ZoneFile", "Invalid zone extent");
+
+    decoded.emplace_back(start, length, zone);
+    prev_end = start + length;
+  }
+
+  for (auto& e : decoded)
+    GetExtentZone(e)->AddExtent(e.start_, e.length_, lifetime_, m_time_);
+  extents_.insert(extents_.end(), decoded.begin(), decoded.end());
+
   MetadataSynced();
   return Status::OK();
 }
@@ -174,17 +285,26 @@ Status ZoneFile::MergeUpdate(ZoneFile* update) {
   if (file_id_ != update->GetID())
     return Status::Corruption("ZoneFile update", "ID missmatch");
 
-  Rename(update->GetFilename());
+  /* Compact updates only carry the name if it changed */
+  if (!update->GetFilename().empty()) Rename(update->GetFilename());
   SetFileSize(update->GetFileSize());
   SetWriteLifeTimeHint(update->GetWriteLifeTimeHint());
   SetFileModificationTime(update->GetFileModificationTime());
+  SetSparse(update->IsSparse());
+
+  uint32_t last_length = update->update_last_length_;
+  if (last_length) {
+    if (extents_.empty() || last_length < extents_.back().length_)
+      return Status::Corruption("ZoneFile update", "Invalid extent extension");
+    ZoneExtent& last = extents_.back();
+    GetExtentZone(last)->ExtendExtent(last.start_, last.length_, last_length);
+    last.length_ = last_length;
+  }
 
-  std::vector<ZoneExtent*> update_extents = update->GetExtents();
-  for (long unsigned int i = 0; i < update_extents.size(); i++) {
-    ZoneExtent* extent = update_extents[i];
-    Zone* zone = extent->zone_;
-    zone->used_capacity_ += extent->length_;
-    extents_.push_back(new ZoneExtent(extent->start_, extent->length_, zone));
+  for (const ZoneExtent& extent : update->GetExtents()) {
+    GetExtentZone(extent)->AddExtent(extent.start_, extent.length_, lifetime_,
+                                     m_time_);
+    extents_.push_back(extent);
   }
 
   MetadataSynced();
@@ -207,6 +327,7 @@ ZoneFile::ZoneFile(ZonedBlockDevice* zbd, std::string filename,
       fileSize(0),
       file_id_(file_id),
       nr_synced_extents_(0),
+      synced_last_length_(0),
       m_time_(0),
       logger_(logger),
       filename_(filename),
@@ -229,16 +350,48 @@ void ZoneFile::SetFileSize(uint64_t sz) { fileSize = sz; }
 void ZoneFile::SetFileModificationTime(time_t mt) { m_time_ = mt; }
 
 ZoneFile::~ZoneFile() {
-  for (auto e = std::begin(extents_); e != std::end(extents_); ++e) {
-    Zone* zone = (*e)->zone_;
+  for (const ZoneExtent& extent : extents_) {
+    Zone* zone = GetExtentZone(extent);
 
-    assert(zone && zone->used_capacity_ >= (*e)->length_);
-    zone->used_capacity_ -= (*e)->length_;
-    delete *e;
+    assert(zone);
+    zone->RemoveExtent(extent.start_, extent.length_);
   }
   CloseWR();
 }
 
+void ZoneFile::MarkDeleted() {
+  time_t now = time(0);
+
+  for (const ZoneExtent& extent : extents_) {
+    Zone* zone = GetExtentZone(extent);
+    if (zone->GetExtentRefs(extent.start_, extent.length_) > 1) continue;
+    zone->bytes_invalidated_ += extent.length_;
+    zone->last_delete_time_ = now;
+  }
+}
+
+void ZoneFile::ShareExtentsOf(ZoneFile* src) {
+  uint64_t extents_size = 0;
+
+  assert(extents_.empty());
+
+  lifetime_ = src->GetWriteLifeTimeHint();
+  m_time_ = src->GetFileModificationTime();
+
+  for (const ZoneExtent& extent : src->GetExtents()) {
+    GetExtentZone(extent)->AddExtent(extent.start_, extent.length_, lifetime_,
+                                     m_time_);
+    extents_.push_back(extent);
+    extents_size += extent.length_;
+  }
+
+  /* The last extent of a file written with direct writes ends in padding
+   * that was truncated away. Data written to a file that is still open may
+   * not be in an extent yet. */
+  fileSize = src->GetFileSize();
+  if (src->IsOpenForWR()) fileSize = std::min(fileSize, extents_size);
+}
+
 void ZoneFile::CloseWR() {
   if (active_zone_) {
     active_zone_->CloseWR();
@@ -251,16 +404,28 @@ void ZoneFile::OpenWR() { open_for_wr_ = true; }
 
 bool ZoneFile::IsOpenForWR() { return open_for_wr_; }
 
-ZoneExtent* ZoneFile::GetExtent(uint64_t file_offset, uint64_t* dev_offset) {
-  for (unsigned int i = 0; i < extents_.size(); i++) {
-    if (file_offset < extents_[i]->length_) {
-      *dev_offset = extents_[i]->start_ + file_offset;
-      return extents_[i];
-    } else {
-      file_offset -= extents_[i]->length_;
+size_t ZoneFile::PlanRead(uint64_t offset, size_t n, char* scratch,
+                          std::vector<ZoneReadFragment>* fragments) {
+  uint64_t extent_filepos = 0;
+  size_t planned = 0;
+
+  for (const ZoneExtent& extent : extents_) {
+    if (planned == n) break;
+
+    uint64_t pos = offset + planned;
+    if (pos < extent_filepos + extent.length_) {
+      uint64_t in_extent = pos - extent_filepos;
+      size_t len = std::min((uint64_t)(n - planned),
+                            extent.length_ - in_extent);
+
+      fragments->push_back(
+          ZoneReadFragment{extent.start_ + in_extent, len, scratch + planned});
+      planned += len;
     }
+    extent_filepos += extent.length_;
   }
-  return NULL;
+
+  return planned;
 }
 
 IOStatus ZoneFile::PositionedRead(uint64_t offset, size_t n, Slice* result,
@@ -268,15 +433,9 @@ IOStatus ZoneFile::PositionedRead(uint64_t offset, size_t n, Slice* result,
   LatencyHistGuard guard(&zbd_->read_latency_reporter_);
   zbd_->read_qps_reporter_.AddCount(1);
 
-  int f = zbd_->GetReadFD();
-  int f_direct = zbd_->GetReadDirectFD();
-  char* ptr;
-  uint64_t r_off;
+  std::vector<ZoneReadFragment> fragments;
   size_t r_sz;
-  ssize_t r = 0;
-  size_t read = 0;
-  ZoneExtent* extent;
-  uint64_t extent_end;
+  size_t read;
   IOStatus s;
 
   if (offset >= fileSize) {
@@ -284,70 +443,68 @@ IOStatus ZoneFile::PositionedRead(uint64_t offset, size_t n, Slice* result,
     return IOStatus::OK();
   }
 
-  r_off = 0;
-  extent = GetExtent(offset, &r_off);
-  if (!extent) {
-    /* read start beyond end of (synced) file data*/
-    *result = Slice(scratch, 0);
-    return s;
-  }
-  extent_end = extent->start_ + extent->length_;
-
   /* Limit read size to end of file */
   if ((offset + n) > fileSize)
     r_sz = fileSize - offset;
   else
     r_sz = n;
 
-  ptr = scratch;
+  /* Reads beyond the end of the synced file data are cut short */
+  read = PlanRead(offset, r_sz, scratch, &fragments);
+
+  s = zbd_->Read(fragments, direct);
+  if (!s.ok()) read = 0;
 
-  while (read != r_sz) {
-    size_t pread_sz = r_sz - read;
+  *result = Slice((char*)scratch, read);
+  return s;
+}
 
-    if ((pread_sz + r_off) > extent_end) pread_sz = extent_end - r_off;
+IOStatus ZoneFile::MappedRead(uint64_t offset, size_t n, Slice* result,
+                              char* scratch, const char* mapping) {
+  LatencyHistGuard guard(&zbd_->read_latency_reporter_);
+  zbd_->read_qps_reporter_.AddCount(1);
 
-    /* We may get some unaligned direct reads due to non-aligned extent lengths,
-     * so fall back on non-direct-io in that case.
-     */
-    bool aligned = (pread_sz % zbd_->GetBlockSize() == 0);
-    if (direct && aligned) {
-      r = pread(f_direct, ptr, pread_sz, r_off);
-    } else {
-      r = pread(f, ptr, pread_sz, r_off);
-    }
+  std::vector<ZoneReadFragment> fragments;
+  size_t r_sz;
+  size_t read;
 
-    if (r <= 0) {
-      if (r == -1 && errno == EINTR) {
-        continue;
-      }
-      break;
-    }
+  if (offset >= fileSize) {
+    *result = Slice(scratch, 0);
+    return IOStatus::OK();
+  }
 
-    pread_sz = (size_t)r;
+  /* Limit read size to end of file */
+  if ((offset + n) > fileSize)
+    r_sz = fileSize - offset;
+  else
+    r_sz = n;
 
-    ptr += pread_sz;
-    read += pread_sz;
-    r_off += pread_sz;
+  /* Reads beyond the end of the synced file data are cut short */
+  read = PlanRead(offset, r_sz, scratch, &fragments);
 
-    if (read != r_sz && r_off == extent_end) {
-      extent = GetExtent(offset + read, &r_off);
-      if (!extent) {
-        /* read beyond end of (synced) file data */
-        break;
-      }
-      r_off = extent->start_;
-      extent_end = extent->start_ + extent->length_;
-      assert(((size_t)r_off % zbd_->GetBlockSize()) == 0);
-    }
+  if (fragments.size() == 1) {
+    *result = Slice(mapping + fragments[0].dev_off, read);
+    return IOStatus::OK();
   }
 
-  if (r < 0) {
-    s = IOStatus::IOError("pread error\n");
-    read = 0;
+  for (const auto& f : fragments) memcpy(f.dst, mapping + f.dev_off, f.len);
+
+  *result = Slice(scratch, read);
+  return IOStatus::OK();
+}
+
+IOStatus ZoneFile::ReadAsync(uint64_t offset, size_t n, char* scratch,
+                             bool direct, ZoneAsyncRead* req, size_t* read) {
+  zbd_->read_qps_reporter_.AddCount(1);
+
+  *read = 0;
+  if (offset < fileSize) {
+    size_t r_sz = n;
+    if ((offset + n) > fileSize) r_sz = fileSize - offset;
+    *read = PlanRead(offset, r_sz, scratch, &req->fragments);
   }
 
-  *result = Slice((char*)scratch, read);
-  return s;
+  return zbd_->SubmitAsyncRead(req, direct);
 }
 
 void ZoneFile::PushExtent() {
@@ -361,13 +518,113 @@ void ZoneFile::PushExtent() {
   if (length == 0) return;
 
   assert(length <= (active_zone_->wp_ - extent_start_));
-  extents_.push_back(new ZoneExtent(extent_start_, length, active_zone_));
 
-  active_zone_->used_capacity_ += length;
+  time_t now = time(0);
+
+  /* Data continuing the last extent in the same zone grows it in place, so
+   * frequent syncs do not fragment the extent list. Buffered syncs pad the
+   * data to the next block, so only block aligned syncs continue it. */
+  ZoneExtent* last = extents_.empty() ? nullptr : &extents_.back();
+  if (last && last->zone_nr_ == active_zone_->GetZoneNr() &&
+      last->start_ + last->length_ == extent_start_ &&
+      last->length_ + length <= UINT32_MAX) {
+    active_zone_->ExtendExtent(last->start_, last->length_,
+                               last->length_ + length);
+    last->length_ += length;
+  } else {
+    extents_.emplace_back(extent_start_, length, active_zone_);
+    active_zone_->AddExtent(extent_start_, length, lifetime_, now);
+  }
+  active_zone_->bytes_written_ += length;
+  active_zone_->last_write_time_ = now;
   extent_start_ = active_zone_->wp_;
   extent_filepos_ = fileSize;
 }
 
+void ZoneFile::EncodeSyncTrailer(char* dst, uint32_t data_size,
+                                 uint32_t pad) {
+  /* The data written since the last sync starts at extent_filepos_, unless
+   * no zone is allocated yet */
+  uint64_t run_start = active_zone_ ? extent_filepos_ : fileSize;
+
+  EncodeFixed32(dst, kSyncTrailerMagic);
+  EncodeFixed64(dst + 8, file_id_);
+  EncodeFixed64(dst + 16, run_start);
+  EncodeFixed64(dst + 24, fileSize + data_size - run_start);
+  EncodeFixed64(dst + 32, pad);
+  EncodeFixed32(dst + 4, crc32c::Mask(crc32c::Value(
+                             dst + 8, ZENFS_SYNC_TRAILER_SIZE - 8)));
+}
+
+bool ZoneFile::CanSkipMetadataSync() {
+  if (!sparse_ || nr_synced_extents_ == 0 || filename_ != synced_name_)
+    return false;
+
+  uint32_t zone_nr = extents_[nr_synced_extents_ - 1].zone_nr_;
+  for (size_t i = nr_synced_extents_; i < extents_.size(); i++) {
+    if (extents_[i].zone_nr_ != zone_nr) return false;
+  }
+
+  return true;
+}
+
+IOStatus ZoneFile::RecoverSparseTail() {
+  if (!sparse_ || extents_.empty()) return IOStatus::OK();
+
+  ZoneExtent last = extents_.back();
+  Zone* zone = GetExtentZone(last);
+  uint32_t block_sz = zbd_->GetBlockSize();
+  uint64_t data_end = last.start_ + last.length_;
+  uint64_t pos = data_end;
+  uint32_t recovered = 0;
+
+  if (pos % block_sz) pos += block_sz - (pos % block_sz);
+  if (zone == nullptr || pos >= zone->wp_) return IOStatus::OK();
+
+  std::unique_ptr<char[]> buf(new char[ZENFS_SYNC_TRAILER_SCAN_SIZE]);
+  while (pos < zone->wp_) {
+    size_t len = std::min(zone->wp_ - pos,
+                          (uint64_t)ZENFS_SYNC_TRAILER_SCAN_SIZE);
+    IOStatus s = zbd_->Read({{pos, len, buf.get()}}, false);
+    if (!s.ok()) return s;
+
+    for (size_t end = block_sz; end <= len; end += block_sz) {
+      const char* t = buf.get() + end - ZENFS_SYNC_TRAILER_SIZE;
+      uint64_t trailer_pos = pos + end - ZENFS_SYNC_TRAILER_SIZE;
+
+      if (DecodeFixed32(t) != kSyncTrailerMagic ||
+          crc32c::Unmask(DecodeFixed32(t + 4)) !=
+              crc32c::Value(t + 8, ZENFS_SYNC_TRAILER_SIZE - 8))
+        continue;
+
+      uint64_t id = DecodeFixed64(t + 8);
+      uint64_t file_offset = DecodeFixed64(t + 16);
+      uint64_t length = DecodeFixed64(t + 24);
+      uint64_t pad = DecodeFixed64(t + 32);
+
+      /* Only accept the sync continuing the file where the last one ended */
+      if (id != file_id_ || file_offset != fileSize || length == 0 ||
+          length > UINT32_MAX || (length + pad) > (trailer_pos - data_end))
+        continue;
+
+      uint64_t start = trailer_pos - pad - length;
+      extents_.emplace_back(start, (uint32_t)length, zone);
+      zone->AddExtent(start, length, lifetime_, m_time_);
+      fileSize += length;
+      data_end = start + length;
+      recovered++;
+    }
+
+    pos += len;
+  }
+
+  if (recovered)
+    Info(logger_, "Recovered %u synced extents of %s from sync trailers",
+         recovered, filename_.c_str());
+
+  return IOStatus::OK();
+}
+
 /* Assumes that data and size are block aligned */
 IOStatus ZoneFile::Append(void* data, int data_size, int valid_size,
                           bool async) {
@@ -376,7 +633,7 @@ IOStatus ZoneFile::Append(void* data, int data_size, int valid_size,
   IOStatus s;
 
   if (active_zone_ == NULL) {
-    active_zone_ = zbd_->AllocateZone(lifetime_, is_wal_);
+    active_zone_ = zbd_->AllocateZone(lifetime_, is_wal_, RemainingSize());
     if (!active_zone_) {
       Warn(logger_,
            "Zone allocation failure upon append starting, filename=%s, "
@@ -393,7 +650,7 @@ IOStatus ZoneFile::Append(void* data, int data_size, int valid_size,
       PushExtent();
 
       active_zone_->CloseWR();
-      active_zone_ = zbd_->AllocateZone(lifetime_, is_wal_);
+      active_zone_ = zbd_->AllocateZone(lifetime_, is_wal_, RemainingSize());
       if (!active_zone_) {
         Warn(logger_,
              "Zone allocation failure when appending, filename=%s, left=%d\n",
@@ -407,13 +664,21 @@ IOStatus ZoneFile::Append(void* data, int data_size, int valid_size,
     wr_size = left;
     if (wr_size > active_zone_->capacity_) wr_size = active_zone_->capacity_;
 
+    zbd_->ThrottleWrite(wr_size, is_wal_);
+
+    uint64_t wr_pos = active_zone_->wp_;
     if (async) {
       s = active_zone_->Append_async((char*)data + offset, wr_size);
     } else {
-      s = active_zone_->Append((char*)data + offset, wr_size);
+      s = active_zone_->Append((char*)data + offset, wr_size,
+                               is_wal_ && zbd_->IsPolledWAL());
     }
     if (!s.ok()) return s;
 
+    /* WAL data is only read back on recovery, don't cache it */
+    ZoneReadCache* cache = zbd_->GetReadCache();
+    if (cache && !is_wal_) cache->Insert(wr_pos, (char*)data + offset, wr_size);
+
     fileSize += wr_size;
     left -= wr_size;
     offset += wr_size;
@@ -436,6 +701,7 @@ ZonedWritableFile::ZonedWritableFile(ZonedBlockDevice* zbd, bool _buffered,
   assert(wp == 0);
 
   buffered = _buffered;
+  sparse_ = buffered && zoneFile->IsSparse();
   block_sz = zbd->GetBlockSize();
   buffer_sz = block_sz * 32;
   buffer_pos = 0;
@@ -449,11 +715,13 @@ ZonedWritableFile::ZonedWritableFile(ZonedBlockDevice* zbd, bool _buffered,
 
   // TODO: add an Open() method so we can handle out of memory gracefully
   if (buffered) {
+    /* Room for the block holding the sync trailer */
+    size_t alloc_sz = buffer_sz + (sparse_ ? block_sz : 0);
     int ret;
 
-    ret = posix_memalign((void**)&b1, block_sz, buffer_sz);
+    ret = posix_memalign((void**)&b1, block_sz, alloc_sz);
     assert(ret == 0);
-    ret = posix_memalign((void**)&b2, block_sz, buffer_sz);
+    ret = posix_memalign((void**)&b2, block_sz, alloc_sz);
     assert(ret == 0);
     (void)ret;
     assert(b1 != nullptr && b2 != nullptr);
@@ -491,15 +759,21 @@ IOStatus ZonedWritableFile::Truncate(uint64_t size,
 
 IOStatus ZonedWritableFile::Fsync(const IOOptions& /*options*/,
                                   IODebugContext* /*dbg*/) {
+  ZonedBlockDevice* zbd = zoneFile_->GetZbd();
+  HistReporterHandle* sync_reporter = &zbd->bg_sync_latency_reporter_;
   IOStatus s;
-  LatencyHistGuard guard(zoneFile_->is_wal_
-                             ? &zoneFile_->GetZbd()->fg_sync_latency_reporter_
-                             : &zoneFile_->GetZbd()->bg_sync_latency_reporter_);
-  zoneFile_->GetZbd()->sync_qps_reporter_.AddCount(1);
+
+  /* WAL syncs are reported per write mode */
+  if (zoneFile_->is_wal_) {
+    sync_reporter = zbd->IsPolledWAL() ? &zbd->polled_sync_latency_reporter_
+                                       : &zbd->fg_sync_latency_reporter_;
+  }
+  LatencyHistGuard guard(sync_reporter);
+  zbd->sync_qps_reporter_.AddCount(1);
 
   buffer_mtx_.lock();
   uint64_t wp0 = wp;
-  s = FlushBuffer();
+  s = FlushBuffer(sparse_);
   if (s.ok()) {
     s = zoneFile_->Sync();
   }
@@ -510,6 +784,7 @@ IOStatus ZonedWritableFile::Fsync(const IOOptions& /*options*/,
   // RocksDB sync an alread synced file (empty buffer)
   if (wp0 != wp) {
     zoneFile_->PushExtent();
+    if (sparse_ && zoneFile_->CanSkipMetadataSync()) return s;
     s = metadata_writer_->Persist(zoneFile_);
   }
   return s;
@@ -537,22 +812,35 @@ IOStatus ZonedWritableFile::Close(const IOOptions& options,
                                   IODebugContext* dbg) {
   if (closed_) return IOStatus::OK();
   Fsync(options, dbg);
+  /* Log the extents of syncs that skipped the metadata sync, so recovery of
+   * a closed file does not depend on its sync trailers */
+  if (sparse_) metadata_writer_->Persist(zoneFile_);
   zoneFile_->CloseWR();
 
   closed_ = true;
   return IOStatus::OK();
 }
 
-IOStatus ZonedWritableFile::FlushBuffer() {
+IOStatus ZonedWritableFile::FlushBuffer(bool trailer) {
   uint32_t align, pad_sz = 0, wr_sz;
   IOStatus s;
 
   if (!buffer_pos) return IOStatus::OK();
 
-  align = buffer_pos % block_sz;
-  if (align) pad_sz = block_sz - align;
+  if (trailer) {
+    align = (buffer_pos + ZENFS_SYNC_TRAILER_SIZE) % block_sz;
+    pad_sz = ZENFS_SYNC_TRAILER_SIZE;
+  } else {
+    align = buffer_pos % block_sz;
+  }
+  if (align) pad_sz += block_sz - align;
 
   if (pad_sz) memset((char*)buffer + buffer_pos, 0x0, pad_sz);
+  if (trailer) {
+    uint32_t pad = pad_sz - ZENFS_SYNC_TRAILER_SIZE;
+    zoneFile_->EncodeSyncTrailer((char*)buffer + buffer_pos + pad,
+                                 buffer_pos, pad);
+  }
 
   wr_sz = buffer_pos + pad_sz;
   s = zoneFile_->Append((char*)buffer, wr_sz, buffer_pos);
@@ -680,6 +968,18 @@ void ZonedWritableFile::SetWriteLifeTimeHint(Env::WriteLifeTimeHint hint) {
   zoneFile_->SetWriteLifeTimeHint(hint);
 }
 
+void ZonedWritableFile::SetPreallocationBlockSize(size_t size) {
+  FSWritableFile::SetPreallocationBlockSize(size);
+  zoneFile_->SetExpectedSize(size);
+}
+
+IOStatus ZonedWritableFile::Allocate(uint64_t offset, uint64_t len,
+                                     const IOOptions& /*options*/,
+                                     IODebugContext* /*dbg*/) {
+  zoneFile_->SetExpectedSize(offset + len);
+  return IOStatus::OK();
+}
+
 IOStatus ZonedSequentialFile::Read(size_t n, const IOOptions& /*options*/,
                                    Slice* result, char* scratch,
                                    IODebugContext* /*dbg*/) {
@@ -709,9 +1009,56 @@ IOStatus ZonedRandomAccessFile::Read(uint64_t offset, size_t n,
                                      const IOOptions& /*options*/,
                                      Slice* result, char* scratch,
                                      IODebugContext* /*dbg*/) const {
+  if (mapping_)
+    return zoneFile_->MappedRead(offset, n, result, scratch, mapping_);
   return zoneFile_->PositionedRead(offset, n, result, scratch, direct_);
 }
 
+void ZonedAsyncReadHandle::Deliver(bool aborted) {
+  if (cb_delivered || !read.done) return;
+
+  if (aborted && !read.status.ok())
+    req.status = IOStatus::Aborted("Read aborted");
+  else
+    req.status = read.status;
+  req.result = Slice(req.scratch, req.status.ok() ? read_len : 0);
+
+  cb_delivered = true;
+  if (cb) cb(req, cb_arg);
+}
+
+#if ROCKSDB_MAJOR >= 7
+IOStatus ZonedRandomAccessFile::ReadAsync(
+    FSReadRequest& req, const IOOptions& /*opts*/,
+    std::function<void(const FSReadRequest&, void*)> cb, void* cb_arg,
+    void** io_handle, IOHandleDeleter* del_fn, IODebugContext* /*dbg*/) {
+  ZonedAsyncReadHandle* handle = new ZonedAsyncReadHandle();
+  IOStatus s;
+
+  handle->zbd = zoneFile_->GetZbd();
+  handle->req = req;
+  handle->cb = cb;
+  handle->cb_arg = cb_arg;
+
+  s = zoneFile_->ReadAsync(req.offset, req.len, req.scratch, direct_,
+                           &handle->read, &handle->read_len);
+  if (!s.ok()) {
+    delete handle;
+    return s;
+  }
+
+  *io_handle = handle;
+  *del_fn = [](void* h) {
+    ZonedAsyncReadHandle* handle = static_cast<ZonedAsyncReadHandle*>(h);
+    /* The device must be done with the buffers before they go away */
+    if (!handle->read.done) handle->zbd->AbortAsyncReads({&handle->read});
+    delete handle;
+  };
+
+  return IOStatus::OK();
+}
+#endif
+
 size_t ZoneFile::GetUniqueId(char* id, size_t max_size) {
   /* Based on the posix fs implementation */
   if (max_size < kMaxVarint64Length * 3) {
@@ -22,40 +22,58 @@
 #include <vector>
 
 #include "rocksdb/file_system.h"
+#include "rocksdb/version.h"
 #include "zbd_zenfs.h"
 
 namespace ROCKSDB_NAMESPACE {
 
+/* Size of the trailer ending the last block of every sync of a sparse file,
+ * see ZoneFile::EncodeSyncTrailer */
+#define ZENFS_SYNC_TRAILER_SIZE (40)
+
+/* Extents are stored by value in ZoneFile, so the zone is referenced by
+ * number, see ZonedBlockDevice::GetIOZoneByNr */
 class ZoneExtent {
  public:
   uint64_t start_;
   uint32_t length_;
-  Zone* zone_;
+  uint32_t zone_nr_;
 
+  ZoneExtent() : start_(0), length_(0), zone_nr_(0) {}
   explicit ZoneExtent(uint64_t start, uint32_t length, Zone* zone);
   Status DecodeFrom(Slice* input);
-  void EncodeTo(std::string* output);
   void EncodeJson(std::ostream& json_stream);
 };
 
 class ZoneFile {
  protected:
   ZonedBlockDevice* zbd_;
-  std::vector<ZoneExtent*> extents_;
+  std::vector<ZoneExtent> extents_;
   Zone* active_zone_;
   uint64_t extent_start_;
   uint64_t extent_filepos_;
 
   Env::WriteLifeTimeHint lifetime_;
   uint64_t fileSize;
+  uint64_t expected_size_ = 0;
   uint64_t file_id_;
 
   uint32_t nr_synced_extents_;
+  uint32_t synced_last_length_; /* Length of the last synced extent */
+  /* New length of the last known extent, set by decoding an update */
+  uint32_t update_last_length_ = 0;
+  std::string synced_name_; /* File name as of the last metadata sync */
   bool open_for_wr_ = false;
+  bool sparse_ = false;
   time_t m_time_;
 
   std::shared_ptr<Logger> logger_;
 
+  /* Bytes still expected to be appended, 0 if unknown */
+  uint64_t RemainingSize() {
+    return expected_size_ > fileSize ? expected_size_ - fileSize : 0;
+  }
+
  public:
   std::string filename_;
   bool is_wal_;
@@ -73,6 +91,11 @@ class ZoneFile {
   IOStatus Append(void* data, int data_size, int valid_size,
                   bool async = false);
   IOStatus SetWriteLifeTimeHint(Env::WriteLifeTimeHint lifetime);
+  /* The file is expected to grow to at least size bytes. Zones are picked
+   * to hold the rest of the file if possible, see AllocateZone. */
+  void SetExpectedSize(uint64_t size) {
+    if (size > expected_size_) expected_size_ = size;
+  }
   IOStatus Sync();
 
   std::string GetFilename();
@@ -83,23 +106,93 @@ class ZoneFile {
   void SetFileSize(uint64_t sz);
 
   uint32_t GetBlockSize() { return zbd_->GetBlockSize(); }
-  std::vector<ZoneExtent*> GetExtents() { return extents_; }
+  const std::vector<ZoneExtent>& GetExtents() { return extents_; }
+  Zone* GetExtentZone(const ZoneExtent& extent) {
+    return zbd_->GetIOZoneByNr(extent.zone_nr_);
+  }
   Env::WriteLifeTimeHint GetWriteLifeTimeHint() { return lifetime_; }
 
   IOStatus PositionedRead(uint64_t offset, size_t n, Slice* result,
                           char* scratch, bool direct);
-  ZoneExtent* GetExtent(uint64_t file_offset, uint64_t* dev_offset);
+  /* Read from the device mapping, see ZonedBlockDevice::Map. Reads within
+   * a single extent point into the mapping, reads spanning extents are
+   * copied into scratch. */
+  IOStatus MappedRead(uint64_t offset, size_t n, Slice* result, char* scratch,
+                      const char* mapping);
+  /* Map [offset, offset + n) of the file onto device ranges backed by the
+   * file's extents. Returns the number of bytes mapped, which is less than
+   * n if the range extends beyond the synced extents. */
+  size_t PlanRead(uint64_t offset, size_t n, char* scratch,
+                  std::vector<ZoneReadFragment>* fragments);
+  /* Start reading [offset, offset + n) into scratch, *read is set to the
+   * number of bytes that will be available when the request is done */
+  IOStatus ReadAsync(uint64_t offset, size_t n, char* scratch, bool direct,
+                     ZoneAsyncRead* req, size_t* read);
   void PushExtent();
 
-  void EncodeTo(std::string* output, uint32_t extent_start);
+  /* Sparse files do not persist metadata on syncs that stay in the zone of
+   * the last synced extent. Every sync ends with a trailer describing the
+   * data written since the previous sync, recovery rebuilds the extents that
+   * were not logged from the trailers. */
+  void SetSparse(bool sparse) { sparse_ = sparse; }
+  bool IsSparse() { return sparse_; }
+  /* Encode the trailer for a sync appending data_size bytes followed by pad
+   * bytes of padding into dst */
+  void EncodeSyncTrailer(char* dst, uint32_t data_size, uint32_t pad);
+  /* True if the extents added since the last metadata sync can be recovered
+   * from sync trailers */
+  bool CanSkipMetadataSync();
+  /* Add the extents synced after the last logged one, found by scanning the
+   * zone of the last extent for sync trailers up to its write pointer */
+  IOStatus RecoverSparseTail();
+
+  /* Account the file's data as invalidated in the zone statistics. Extents
+   * still shared with a linked file stay valid. */
+  void MarkDeleted();
+
+  /* Make this file a link to src: the extents are shared, not copied, see
+   * ZenFS::LinkFile. The link has the size of src, or if src is open for
+   * writing, the size of the data written to its extents so far. */
+  void ShareExtentsOf(ZoneFile* src);
+
+  /* Compact encoding: varints, extent starts delta coded against the end of
+   * the previous extent in the same zone. The name is included if ref_name
+   * is given, prefix compressed against it, or if it changed since the last
+   * sync. Updates carry the new length of the last synced extent if it was
+   * extended since. */
+  void EncodeCompactTo(std::string* output, uint32_t extent_start,
+                       const std::string* ref_name);
   void EncodeUpdateTo(std::string* output) {
-    EncodeTo(output, nr_synced_extents_);
+    EncodeCompactTo(output, nr_synced_extents_, nullptr);
+  };
+  void EncodeSnapshotTo(std::string* output, const std::string& ref_name) {
+    EncodeCompactTo(output, 0, &ref_name);
   };
-  void EncodeSnapshotTo(std::string* output) { EncodeTo(output, 0); };
   void EncodeJson(std::ostream& json_stream);
-  void MetadataSynced() { nr_synced_extents_ = extents_.size(); };
+  void MetadataSynced() {
+    nr_synced_extents_ = extents_.size();
+    synced_last_length_ = extents_.empty() ? 0 : extents_.back().length_;
+    synced_name_ = filename_;
+  };
+
+  /* Metadata sync state, restored if persisting an update fails */
+  struct SyncState {
+    uint32_t nr_synced_extents = 0;
+    uint32_t synced_last_length = 0;
+    std::string synced_name;
+  };
+  SyncState GetSyncState() {
+    return {nr_synced_extents_, synced_last_length_, synced_name_};
+  }
+  void RestoreSyncState(const SyncState& state) {
+    nr_synced_extents_ = state.nr_synced_extents;
+    synced_last_length_ = state.synced_last_length;
+    synced_name_ = state.synced_name;
+  }
 
   Status DecodeFrom(Slice* input);
+  /* An update without a name leaves the file name empty */
+  Status DecodeCompactFrom(Slice* input, const std::string& ref_name);
   Status MergeUpdate(ZoneFile* update);
 
   uint64_t GetID() { return file_id_; }
@@ -155,15 +248,20 @@ class ZonedWritableFile : public FSWritableFile {
     return zoneFile_->GetBlockSize();
   }
   void SetWriteLifeTimeHint(Env::WriteLifeTimeHint hint) override;
+  /* Nothing is preallocated, the sizes only steer zone allocation */
+  void SetPreallocationBlockSize(size_t size) override;
+  IOStatus Allocate(uint64_t offset, uint64_t len, const IOOptions& options,
+                    IODebugContext* dbg) override;
   virtual Env::WriteLifeTimeHint GetWriteLifeTimeHint() override {
     return zoneFile_->GetWriteLifeTimeHint();
   }
 
  private:
   IOStatus BufferedWrite(const Slice& data);
-  IOStatus FlushBuffer();
+  IOStatus FlushBuffer(bool trailer = false);
 
   bool buffered;
+  bool sparse_;
   char* buffer;
   char* b1;
   char* b2;
@@ -211,15 +309,34 @@ class ZonedSequentialFile : public FSSequentialFile {
   }
 };
 
+/* The io handle of a ZonedRandomAccessFile::ReadAsync request, the callback
+ * is delivered by ZenFS::Poll or ZenFS::AbortIO */
+struct ZonedAsyncReadHandle {
+  ZonedBlockDevice* zbd;
+  ZoneAsyncRead read;
+  size_t read_len = 0;
+  FSReadRequest req;
+  std::function<void(const FSReadRequest&, void*)> cb;
+  void* cb_arg;
+  bool cb_delivered = false;
+
+  /* Invoke the callback once the read is done */
+  void Deliver(bool aborted);
+};
+
 class ZonedRandomAccessFile : public FSRandomAccessFile {
  private:
   ZoneFile* zoneFile_;
   bool direct_;
+  const char* mapping_; /* Device mapping for mmap reads, or null */
 
  public:
   explicit ZonedRandomAccessFile(ZoneFile* zoneFile,
-                                 const FileOptions& file_opts)
-      : zoneFile_(zoneFile), direct_(file_opts.use_direct_reads) {}
+                                 const FileOptions& file_opts,
+                                 const char* mapping = nullptr)
+      : zoneFile_(zoneFile),
+        direct_(file_opts.use_direct_reads),
+        mapping_(mapping) {}
 
   IOStatus Read(uint64_t offset, size_t n, const IOOptions& options,
                 Slice* result, char* scratch,
@@ -231,6 +348,13 @@ class ZonedRandomAccessFile : public FSRandomAccessFile {
     return IOStatus::OK();
   }
 
+#if ROCKSDB_MAJOR >= 7
+  IOStatus ReadAsync(FSReadRequest& req, const IOOptions& opts,
+                     std::function<void(const FSReadRequest&, void*)> cb,
+                     void* cb_arg, void** io_handle, IOHandleDeleter* del_fn,
+                     IODebugContext* dbg) override;
+#endif
+
   bool use_direct_io() const override { return direct_; }
 
   size_t GetRequiredBufferAlignment() const override {
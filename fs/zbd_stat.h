@@ -8,6 +8,8 @@
 
 #if !defined(ROCKSDB_LITE) && defined(OS_LINUX)
 
+#include <stdint.h>
+
 #include <string>
 #include <vector>
 
@@ -17,6 +19,7 @@ class ZoneFileStat {
  public:
   uint64_t file_id;
   uint64_t size_in_zone;
+  uint32_t extents_in_zone;
   std::string filename;
 };
 
@@ -25,9 +28,70 @@ class ZoneStat {
   uint64_t total_capacity;
   uint64_t write_position;
   uint64_t start_position;
+  uint64_t used_capacity;     /* bytes referenced by live extents */
+  uint64_t bytes_written;     /* extent bytes written since mount */
+  uint64_t bytes_invalidated; /* extent bytes deleted since mount */
+  uint64_t last_write_time;   /* seconds since the epoch, 0 if none */
+  uint64_t last_delete_time;  /* seconds since the epoch, 0 if none */
+  uint64_t oldest_extent_age; /* in seconds, 0 if no live extents */
+  /* live bytes per write lifetime hint, indexed by Env::WriteLifeTimeHint */
+  std::vector<uint64_t> lifetime_bytes;
   std::vector<ZoneFileStat> files;
 };
 
+/* Graded space pressure, see ZonedBlockDevice::SetSpacePressureListener */
+enum class ZoneSpacePressure : int { kNone = 0, kLow, kHigh, kCritical };
+
+class ZoneSpaceInfo {
+ public:
+  ZoneSpacePressure pressure = ZoneSpacePressure::kNone;
+  uint64_t total_space = 0;
+  uint64_t free_space = 0;        /* writable without resetting a zone */
+  uint64_t reclaimable_space = 0; /* unused capacity of full zones */
+  uint32_t empty_zones = 0;
+};
+
+/* Zones finished by AllocateZone to free active zones, since mount */
+class ZoneFinishStats {
+ public:
+  uint32_t threshold = 0; /* current finish threshold, in percent */
+  uint64_t finishes = 0;
+  uint64_t wasted_bytes = 0; /* capacity left unwritten by finishes */
+  uint64_t stalls = 0;       /* allocations that waited for an active zone */
+};
+
+/* Zones holding the data of one write lifetime hint. Files are placed in
+ * zones by lifetime, so this is the stream the files of that lifetime are
+ * appended to. */
+class ZoneStreamInfo {
+ public:
+  uint32_t zones = 0;         /* non-empty zones opened for this lifetime */
+  uint32_t partial_zones = 0; /* of which not full yet */
+  uint64_t live_bytes = 0;    /* bytes of live extents with this lifetime */
+  uint64_t tail_bytes = 0;    /* capacity left in the partial zones */
+};
+
+class ZoneGeometry {
+ public:
+  uint64_t zone_size = 0;
+  /* writable bytes per io zone, the smallest if capacities differ */
+  uint64_t zone_capacity = 0;
+  uint32_t block_size = 0;
+  uint32_t io_zones = 0;
+  uint32_t max_active_zones = 0;
+  /* indexed by Env::WriteLifeTimeHint */
+  std::vector<ZoneStreamInfo> streams;
+};
+
+/* File sizes that tile a zone with files_per_zone files, see
+ * ZenFS::AdviseFileSizes */
+class ZoneFileSizeAdvice {
+ public:
+  uint32_t files_per_zone = 0;
+  uint64_t target_file_size = 0;
+  uint64_t write_buffer_size = 0;
+};
+
 }  // namespace ROCKSDB_NAMESPACE
 
 #endif  // !defined(ROCKSDB_LITE) && defined(OS_LINUX)
\ No newline at end of file
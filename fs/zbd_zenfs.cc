@@ -16,7 +16,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 #include <unistd.h>
+#include <algorithm>
+#include <chrono>
 #include <ctime>
 #include <iostream>
 #include <map>
@@ -53,25 +57,59 @@
 /* Minimum of number of zones that makes sense */
 #define ZENFS_MIN_ZONES (32)
 
+/* Upper bound of the active io zones summed over all devices */
+#define ZENFS_MAX_ACTIVE_IO_ZONES (0xFFFFFFFD)
+
+/* Device list prefix selecting mirror mode, see ZonedBlockDevice */
+#define ZENFS_MIRROR_PREFIX "mirror:"
+
+/* Maximum number of op log streams, every stream beyond the first one takes
+ * ZENFS_OP_LOG_ZONES zones and one active zone from the io zones */
+#define ZENFS_MAX_OP_STREAMS (16)
+
 namespace ROCKSDB_NAMESPACE {
 
-Zone::Zone(ZonedBlockDevice *zbd, struct zbd_zone *z)
+Zone::Zone(ZonedBlockDevice *zbd, ZoneDevice *dev, struct zbd_zone *z,
+           ZoneDevice *mirror_dev, struct zbd_zone *mz)
     : zbd_(zbd),
-      start_(zbd_zone_start(z)),
+      dev_(dev),
+      mirror_dev_(mirror_dev),
+      start_(dev->base + zbd_zone_start(z)),
       max_capacity_(zbd_zone_capacity(z)),
-      wp_(zbd_zone_wp(z)),
+      wp_(dev->base + zbd_zone_wp(z)),
       open_for_write_(false) {
   lifetime_ = Env::WLTH_NOT_SET;
   used_capacity_ = 0;
   capacity_ = 0;
   bg_processing_ = false;
+  bytes_written_ = 0;
+  bytes_invalidated_ = 0;
+  last_write_time_ = 0;
+  last_delete_time_ = 0;
+  memset(lifetime_bytes_, 0, sizeof(lifetime_bytes_));
   if (!(zbd_zone_full(z) || zbd_zone_offline(z) || zbd_zone_rdonly(z)))
     capacity_ = zbd_zone_capacity(z) - (zbd_zone_wp(z) - zbd_zone_start(z));
 
+  if (mirror_dev_) {
+    /* Only data below both write pointers made it to both copies. Copies
+     * that diverged are not written again and never report empty, so they
+     * are reset before reuse, see ZonedBlockDevice::Open */
+    max_capacity_ = std::min(max_capacity_, zbd_zone_capacity(mz));
+    if (zbd_zone_wp(mz) != zbd_zone_wp(z) || zbd_zone_full(mz) ||
+        zbd_zone_offline(mz) || zbd_zone_rdonly(mz))
+      capacity_ = 0;
+    else
+      capacity_ = std::min(capacity_, zbd_zone_capacity(mz) -
+                                          (zbd_zone_wp(z) - zbd_zone_start(z)));
+    wp_ = std::max(wp_, dev->base + zbd_zone_wp(mz));
+  }
+
   memset(&wr_ctx.io_ctx, 0, sizeof(wr_ctx.io_ctx));
-  wr_ctx.fd = zbd_->GetWriteFD();
+  wr_ctx.fd = dev_->write_f;
   wr_ctx.iocbs[0] = &wr_ctx.iocb;
   wr_ctx.inflight = 0;
+  wr_ctx.buf = nullptr;
+  wr_ctx.offset = 0;
 
   if (io_setup(1, &wr_ctx.io_ctx) < 0) {
     fprintf(stderr, "Failed to allocate io context\n");
@@ -97,6 +135,108 @@ void Zone::CloseWR() {
   if (capacity_ == 0) zbd_->NotifyIOZoneFull();
 }
 
+void Zone::AddExtent(uint64_t start, uint64_t length,
+                     Env::WriteLifeTimeHint lifetime, time_t ctime) {
+  std::lock_guard<std::mutex> lock(live_extents_mtx_);
+
+  auto range = live_extents_.equal_range(start);
+  for (auto it = range.first; it != range.second; ++it) {
+    if (it->second.length == length) {
+      it->second.refs++;
+      return;
+    }
+  }
+
+  if (lifetime < Env::WLTH_NOT_SET || lifetime > Env::WLTH_EXTREME)
+    lifetime = Env::WLTH_NOT_SET;
+
+  used_capacity_ += length;
+  lifetime_bytes_[lifetime] += length;
+  live_extents_.insert(
+      std::make_pair(start, LiveExtent{length, lifetime, ctime, 1}));
+}
+
+void Zone::RemoveExtent(uint64_t start, uint64_t length) {
+  std::lock_guard<std::mutex> lock(live_extents_mtx_);
+
+  auto range = live_extents_.equal_range(start);
+  for (auto it = range.first; it != range.second; ++it) {
+    if (it->second.length == length) {
+      if (--it->second.refs > 0) return;
+
+      assert(used_capacity_ >= (long)length);
+      used_capacity_ -= length;
+      lifetime_bytes_[it->second.lifetime] -= length;
+      live_extents_.erase(it);
+      return;
+    }
+  }
+}
+
+void Zone::ExtendExtent(uint64_t start, uint64_t length,
+                        uint64_t new_length) {
+  std::lock_guard<std::mutex> lock(live_extents_mtx_);
+
+  assert(new_length >= length);
+
+  auto range = live_extents_.equal_range(start);
+  for (auto it = range.first; it != range.second; ++it) {
+    if (it->second.length == length) {
+      if (it->second.refs > 1) {
+        /* Snapshots link files open for writing, the overlap is counted
+         * twice until either extent goes away */
+        LiveExtent grown = it->second;
+        it->second.refs--;
+        grown.length = new_length;
+        grown.refs = 1;
+        used_capacity_ += new_length;
+        lifetime_bytes_[grown.lifetime] += new_length;
+        live_extents_.insert(std::make_pair(start, grown));
+        break;
+      }
+      used_capacity_ += new_length - length;
+      lifetime_bytes_[it->second.lifetime] += new_length - length;
+      it->second.length = new_length;
+      break;
+    }
+  }
+}
+
+uint32_t Zone::GetExtentRefs(uint64_t start, uint64_t length) {
+  std::lock_guard<std::mutex> lock(live_extents_mtx_);
+
+  auto range = live_extents_.equal_range(start);
+  for (auto it = range.first; it != range.second; ++it) {
+    if (it->second.length == length) return it->second.refs;
+  }
+  return 0;
+}
+
+void Zone::GetStat(ZoneStat *stat) {
+  std::lock_guard<std::mutex> lock(live_extents_mtx_);
+  time_t now = time(0);
+
+  stat->total_capacity = max_capacity_;
+  stat->write_position = wp_;
+  stat->start_position = start_;
+  stat->used_capacity = used_capacity_;
+  stat->bytes_written = bytes_written_;
+  stat->bytes_invalidated = bytes_invalidated_;
+  stat->last_write_time = last_write_time_;
+  stat->last_delete_time = last_delete_time_;
+
+  /* Zones are written sequentially, so the live extent with the lowest start
+   * is the oldest one */
+  stat->oldest_extent_age = 0;
+  if (!live_extents_.empty()) {
+    time_t ctime = live_extents_.begin()->second.ctime;
+    if (now > ctime) stat->oldest_extent_age = now - ctime;
+  }
+
+  stat->lifetime_bytes.assign(lifetime_bytes_,
+                              lifetime_bytes_ + Env::WLTH_EXTREME + 1);
+}
+
 void Zone::EncodeJson(std::ostream &json_stream) {
   json_stream << "{";
   json_stream << "\"start\":" << start_ << ",";
@@ -116,10 +256,21 @@ IOStatus Zone::Reset() {
 
   // assert(!IsUsed());
 
-  ret = zbd_reset_zones(zbd_->GetWriteFD(), start_, zone_sz);
+  if (zbd_->GetReadCache()) zbd_->GetReadCache()->Invalidate(start_, zone_sz);
+
+  ZoneFaultInjector *injector = zbd_->GetFaultInjector();
+  if (injector && injector->PowerLost()) {
+    capacity_ = max_capacity_;
+    wp_ = start_;
+    lifetime_ = Env::WLTH_NOT_SET;
+    return IOStatus::OK();
+  }
+
+  ret = zbd_reset_zones(dev_->write_f, start_ - dev_->base, zone_sz);
   if (ret) return IOStatus::IOError("Zone reset failed\n");
 
-  ret = zbd_report_zones(zbd_->GetReadFD(), start_, zone_sz, ZBD_RO_ALL, &z, &report);
+  ret = zbd_report_zones(dev_->read_f, start_ - dev_->base, zone_sz,
+                         ZBD_RO_ALL, &z, &report);
 
   if (ret || (report != 1)) {
     return IOStatus::IOError("Zone report failed\n");
@@ -130,6 +281,24 @@ IOStatus Zone::Reset() {
   else
     max_capacity_ = capacity_ = zbd_zone_capacity(&z);
 
+  if (mirror_dev_) {
+    ret = zbd_reset_zones(mirror_dev_->write_f, start_ - dev_->base, zone_sz);
+    if (ret) return IOStatus::IOError("Mirror zone reset failed\n");
+
+    ret = zbd_report_zones(mirror_dev_->read_f, start_ - dev_->base, zone_sz,
+                           ZBD_RO_ALL, &z, &report);
+    if (ret || (report != 1)) {
+      return IOStatus::IOError("Mirror zone report failed\n");
+    }
+
+    if (zbd_zone_offline(&z))
+      capacity_ = 0;
+    else if (capacity_) {
+      max_capacity_ = std::min(max_capacity_, zbd_zone_capacity(&z));
+      capacity_ = max_capacity_;
+    }
+  }
+
   wp_ = start_;
   lifetime_ = Env::WLTH_NOT_SET;
 
@@ -138,13 +307,21 @@ IOStatus Zone::Reset() {
 
 IOStatus Zone::Finish() {
   size_t zone_sz = zbd_->GetZoneSize();
-  int fd = zbd_->GetWriteFD();
+  int fd = dev_->write_f;
   int ret;
 
   // assert(!open_for_write_);
 
-  ret = zbd_finish_zones(fd, start_, zone_sz);
-  if (ret) return IOStatus::IOError("Zone finish failed\n");
+  ZoneFaultInjector *injector = zbd_->GetFaultInjector();
+  if (!(injector && injector->PowerLost())) {
+    ret = zbd_finish_zones(fd, start_ - dev_->base, zone_sz);
+    if (ret) return IOStatus::IOError("Zone finish failed\n");
+    if (mirror_dev_) {
+      ret = zbd_finish_zones(mirror_dev_->write_f, start_ - dev_->base,
+                             zone_sz);
+      if (ret) return IOStatus::IOError("Mirror zone finish failed\n");
+    }
+  }
 
   capacity_ = 0;
   wp_ = start_ + zone_sz;
@@ -154,14 +331,20 @@ IOStatus Zone::Finish() {
 
 IOStatus Zone::Close() {
   size_t zone_sz = zbd_->GetZoneSize();
-  int fd = zbd_->GetWriteFD();
+  int fd = dev_->write_f;
   int ret;
 
   // assert(open_for_write_);
 
-  if (!(IsEmpty() || IsFull())) {
-    ret = zbd_close_zones(fd, start_, zone_sz);
+  ZoneFaultInjector *injector = zbd_->GetFaultInjector();
+  if (!(IsEmpty() || IsFull()) && !(injector && injector->PowerLost())) {
+    ret = zbd_close_zones(fd, start_ - dev_->base, zone_sz);
     if (ret) return IOStatus::IOError("Zone close failed\n");
+    if (mirror_dev_) {
+      ret = zbd_close_zones(mirror_dev_->write_f, start_ - dev_->base,
+                            zone_sz);
+      if (ret) return IOStatus::IOError("Mirror zone close failed\n");
+    }
   }
 
   open_for_write_ = false;
@@ -169,10 +352,10 @@ IOStatus Zone::Close() {
   return IOStatus::OK();
 }
 
-IOStatus Zone::Append(char *data, uint32_t size) {
+IOStatus Zone::Append(char *data, uint32_t size, bool polled) {
   char *ptr = data;
   uint32_t left = size;
-  int fd = zbd_->GetWriteFD();
+  int fd = dev_->write_f;
   int ret;
   IOStatus s;
 
@@ -185,9 +368,33 @@ IOStatus Zone::Append(char *data, uint32_t size) {
   if (!s.ok())
     return s;
 
+  ZoneFaultInjector *injector = zbd_->GetFaultInjector();
   while (left) {
-    ret = pwrite(fd, ptr, size, wp_);
-    if (ret < 0) return IOStatus::IOError("Write failed");
+    uint32_t len = left;
+
+    if (injector) {
+      s = injector->BeforeWrite(left, zbd_->GetBlockSize(), &len);
+      if (!s.ok()) return s;
+    }
+
+    if (len == 0) {
+      /* Lost to an injected power loss */
+      ret = left;
+    } else if (polled && dev_->polled_queue) {
+      uint32_t written;
+      s = dev_->polled_queue->Write(ptr, len, wp_ - dev_->base, &written);
+      if (!s.ok()) return s;
+      ret = written;
+    } else {
+      ret = pwrite(fd, ptr, len, wp_ - dev_->base);
+      if (ret < 0) return IOStatus::IOError("Write failed");
+    }
+
+    /* The mirror gets exactly what made it to the primary */
+    if (mirror_dev_ && len) {
+      s = WriteMirror(ptr, ret, wp_ - dev_->base, polled);
+      if (!s.ok()) return s;
+    }
 
     ptr += ret;
     wp_ += ret;
@@ -198,44 +405,106 @@ IOStatus Zone::Append(char *data, uint32_t size) {
   return IOStatus::OK();
 }
 
+IOStatus Zone::WriteMirror(const char *data, uint32_t size, uint64_t offset,
+                           bool polled) {
+  while (size) {
+    uint32_t written;
+
+    if (polled && mirror_dev_->polled_queue) {
+      IOStatus s =
+          mirror_dev_->polled_queue->Write(data, size, offset, &written);
+      if (!s.ok()) return s;
+    } else {
+      ssize_t ret = pwrite(mirror_dev_->write_f, data, size, offset);
+      if (ret < 0) {
+        if (errno == EINTR) continue;
+        return IOStatus::IOError("Mirror write failed");
+      }
+      written = ret;
+    }
+
+    data += written;
+    offset += written;
+    size -= written;
+  }
+
+  return IOStatus::OK();
+}
+
+/* Submit the remainder of the current asynchronous write */
+IOStatus Zone::SubmitWrite() {
+  ZoneFaultInjector *injector = zbd_->GetFaultInjector();
+  uint32_t len = wr_ctx.inflight;
+  int ret;
+
+  if (injector) {
+    IOStatus s =
+        injector->BeforeWrite(wr_ctx.inflight, zbd_->GetBlockSize(), &len);
+    if (!s.ok()) {
+      wr_ctx.inflight = 0;
+      return s;
+    }
+    if (len == 0) {
+      /* Lost to an injected power loss */
+      wr_ctx.inflight = 0;
+      return IOStatus::OK();
+    }
+  }
+
+  io_prep_pwrite(&wr_ctx.iocb, wr_ctx.fd, wr_ctx.buf, len,
+                 wr_ctx.offset - dev_->base);
+
+  ret = io_submit(wr_ctx.io_ctx, 1, wr_ctx.iocbs);
+  if (ret < 0) {
+    fprintf(stderr, "Failed to submit io\n");
+    wr_ctx.inflight = 0;
+    return IOStatus::IOError("Failed to submit io");
+  }
+
+  return IOStatus::OK();
+}
+
 IOStatus Zone::Sync() {
   struct io_event events[1];
   struct timespec timeout;
+  IOStatus s;
   int ret;
   timeout.tv_sec = 1;
   timeout.tv_nsec = 0;
 
-  if (wr_ctx.inflight == 0)
-    return IOStatus::OK();
+  /* Short writes are resubmitted until the complete write is done */
+  while (wr_ctx.inflight > 0) {
+    ret = io_getevents(wr_ctx.io_ctx, 1, 1, events, &timeout);
+    if (ret != 1) {
+      fprintf(stderr, "Failed to complete io - timeout ret: %d\n", ret);
+      return IOStatus::IOError("Failed to complete io - timeout?");
+    }
 
-  ret = io_getevents(wr_ctx.io_ctx, 1, 1, events, &timeout);
-  if (ret != 1) {
-    fprintf(stderr, "Failed to complete io - timeout ret: %d\n", ret);
-    return IOStatus::IOError("Failed to complete io - timeout?");
-  }
+    ret = events[0].res;
+    if (ret <= 0) {
+      wr_ctx.inflight = 0;
+      return IOStatus::IOError("Failed to complete io - io error");
+    }
 
-  ret = events[0].res;
-  if (ret != (int)(wr_ctx.iocb.u.c.nbytes)) {
-    if (ret >= 0) {
-        /* TODO: we need to handle this case and keep on submittin' until we're done*/
-        fprintf(stderr, "failed to complete io - short write\n");
-        return IOStatus::IOError("Failed to complete io - short write");
-    } else {
-        return IOStatus::IOError("Failed to complete io - io error");
+    wr_ctx.buf += ret;
+    wr_ctx.offset += ret;
+    wr_ctx.inflight -= ret;
+
+    if (wr_ctx.inflight > 0) {
+      s = SubmitWrite();
+      if (!s.ok()) return s;
     }
   }
 
-  wr_ctx.inflight = 0;
-
   return IOStatus::OK();
 }
 
 IOStatus Zone::Append_async(char *data, uint32_t size) {
-  char *ptr = data;
-  uint32_t left = size;
-  int ret;
   IOStatus s;
 
+  /* The completion only covers the primary copy */
+  if (mirror_dev_) return Append(data, size);
+
   assert((size % zbd_->GetBlockSize()) == 0);
 
   /* Make sure we don't have any outstanding writes */
@@ -246,44 +515,488 @@ IOStatus Zone::Append_async(char *data, uint32_t size) {
   if (capacity_ < size)
     return IOStatus::NoSpace("Not enough capacity for append");
 
-  io_prep_pwrite(&wr_ctx.iocb, wr_ctx.fd, data, size, wp_);
+  wr_ctx.buf = data;
+  wr_ctx.offset = wp_;
+  wr_ctx.inflight = size;
 
-  ret = io_submit(wr_ctx.io_ctx, 1, wr_ctx.iocbs);
-  if (ret < 0) {
-    fprintf(stderr, "Failed to submit io\n");
-    return IOStatus::IOError("Failed to submit io");
-  }
+  s = SubmitWrite();
+  if (!s.ok()) return s;
 
-  wr_ctx.inflight = size;
-  ptr += size;
   wp_ += size;
   capacity_ -= size;
-  left -= size;
 
   return IOStatus::OK();
 }
 
 ZoneExtent::ZoneExtent(uint64_t start, uint32_t length, Zone *zone)
-    : start_(start), length_(length), zone_(zone) {}
+    : start_(start), length_(length), zone_nr_(zone->GetZoneNr()) {}
 
-Zone *ZonedBlockDevice::GetIOZone(uint64_t offset) {
-  for (const auto z : io_zones_)
-    if (z->start_ <= offset && offset < (z->start_ + zone_sz_)) return z;
-  return nullptr;
+/* Limits for coalescing fragments into a single vectored read */
+#define ZENFS_MAX_READ_RUN_FRAGMENTS (256)
+#define ZENFS_MAX_READ_RUN_SIZE (4 * MB)
+#define ZENFS_READ_AIO_DEPTH (128)
+
+static IOStatus PreadvFull(int fd, struct iovec *iov, int iovcnt,
+                           uint64_t offset) {
+  while (iovcnt > 0) {
+    ssize_t r = preadv(fd, iov, iovcnt, offset);
+
+    if (r < 0) {
+      if (errno == EINTR) continue;
+      return IOStatus::IOError("pread error\n");
+    }
+    if (r == 0) return IOStatus::IOError("Unexpected end of device\n");
+
+    offset += r;
+    while (r > 0) {
+      if ((size_t)r >= iov->iov_len) {
+        r -= iov->iov_len;
+        iov++;
+        iovcnt--;
+      } else {
+        iov->iov_base = (char *)iov->iov_base + r;
+        iov->iov_len -= r;
+        r = 0;
+      }
+    }
+  }
+
+  return IOStatus::OK();
+}
+
+/* Read a run of fragments where each fragment starts less than a block after
+ * the end of the previous one, i.e. only padding separates them. */
+IOStatus ZonedBlockDevice::ReadRun(const ZoneReadFragment *run,
+                                   size_t nr_fragments, bool direct,
+                                   ZoneDevice *dev) {
+  const ZoneReadFragment &first = run[0];
+  const ZoneReadFragment &last = run[nr_fragments - 1];
+  uint64_t run_start = first.dev_off;
+  uint64_t run_end = last.dev_off + last.len;
+  std::vector<struct iovec> iov;
+  char *bounce = nullptr;
+  IOStatus s;
+
+  if (!direct) {
+    std::unique_ptr<char[]> gap(new char[block_sz_]);
+    uint64_t pos = run_start;
+
+    for (size_t i = 0; i < nr_fragments; i++) {
+      if (run[i].dev_off > pos)
+        iov.push_back({gap.get(), (size_t)(run[i].dev_off - pos)});
+      iov.push_back({run[i].dst, run[i].len});
+      pos = run[i].dev_off + run[i].len;
+    }
+
+    return PreadvFull(dev->read_f, iov.data(), iov.size(),
+                      run_start - dev->base);
+  }
+
+  uint64_t aligned_start = run_start - (run_start % block_sz_);
+  uint64_t aligned_end = run_end;
+  if (aligned_end % block_sz_)
+    aligned_end += block_sz_ - aligned_end % block_sz_;
+
+  if (nr_fragments == 1 && aligned_start == run_start &&
+      ((uintptr_t)first.dst % block_sz_) == 0) {
+    /* Read straight into the caller's buffer, only the unaligned tail goes
+     * through a bounce buffer */
+    size_t body = first.len - (first.len % block_sz_);
+    size_t tail = first.len - body;
+
+    if (tail && posix_memalign((void **)&bounce, block_sz_, block_sz_))
+      return IOStatus::IOError("Failed to allocate read buffer\n");
+
+    if (body) iov.push_back({first.dst, body});
+    if (tail) iov.push_back({bounce, block_sz_});
+
+    s = PreadvFull(dev->read_direct_f, iov.data(), iov.size(),
+                   run_start - dev->base);
+    if (s.ok() && tail) memcpy(first.dst + body, bounce, tail);
+    free(bounce);
+    return s;
+  }
+
+  /* Unaligned fragments: read the whole aligned range once and copy out */
+  size_t bounce_sz = aligned_end - aligned_start;
+  if (posix_memalign((void **)&bounce, block_sz_, bounce_sz))
+    return IOStatus::IOError("Failed to allocate read buffer\n");
+
+  iov.push_back({bounce, bounce_sz});
+  s = PreadvFull(dev->read_direct_f, iov.data(), iov.size(),
+                 aligned_start - dev->base);
+  if (s.ok()) {
+    for (size_t i = 0; i < nr_fragments; i++)
+      memcpy(run[i].dst, bounce + (run[i].dev_off - aligned_start),
+             run[i].len);
+  }
+  free(bounce);
+  return s;
+}
+
+IOStatus ZonedBlockDevice::Read(const std::vector<ZoneReadFragment> &fragments,
+                                bool direct) {
+  std::vector<ZoneReadFragment> pending;
+  IOStatus s;
+
+  for (const auto &f : fragments) {
+    if (read_cache_ && read_cache_->Lookup(f.dev_off, f.len, f.dst)) {
+      read_cache_hit_qps_reporter_.AddCount(1);
+      continue;
+    }
+    pending.push_back(f);
+  }
+
+  size_t i = 0;
+  while (i < pending.size()) {
+    uint64_t run_start = pending[i].dev_off;
+    uint64_t run_end = run_start + pending[i].len;
+    size_t j = i + 1;
+
+    while (j < pending.size() && (j - i) < ZENFS_MAX_READ_RUN_FRAGMENTS) {
+      const ZoneReadFragment &next = pending[j];
+      if (next.dev_off < run_end || (next.dev_off - run_end) >= block_sz_)
+        break;
+      if (GetDevice(next.dev_off) != GetDevice(run_start)) break;
+      if ((next.dev_off + next.len - run_start) > ZENFS_MAX_READ_RUN_SIZE)
+        break;
+      run_end = next.dev_off + next.len;
+      j++;
+    }
+
+    if (direct && hedge_latency_ && read_aio_ctx_) {
+      s = HedgedReadRun(&pending[i], j - i);
+    } else {
+      ZoneDevice *dev = PickReadDevice(GetDevice(run_start));
+      dev->inflight_reads++;
+      s = ReadRun(&pending[i], j - i, direct, dev);
+      dev->inflight_reads--;
+      if (!s.ok() && mirror_) {
+        /* Fall back to the other copy */
+        dev = dev == mirror_.get() ? GetDevice(run_start) : mirror_.get();
+        s = ReadRun(&pending[i], j - i, direct, dev);
+      }
+    }
+    if (!s.ok()) return s;
+    i = j;
+  }
+
+  return s;
+}
+
+void ZonedBlockDevice::ThrottleWrite(uint64_t size, bool is_wal) {
+  if (!rate_limiter_) return;
+
+  Env::IOPriority pri = is_wal ? Env::IO_HIGH : Env::IO_LOW;
+  uint64_t burst = rate_limiter_->GetSingleBurstBytes();
+  while (size) {
+    uint64_t n = burst ? std::min(size, burst) : size;
+    rate_limiter_->Request(n, pri, nullptr, RateLimiter::OpType::kWrite);
+    size -= n;
+  }
+}
+
+ZoneDevice *ZonedBlockDevice::PickReadDevice(ZoneDevice *dev) {
+  if (!mirror_) return dev;
+  if (mirror_->inflight_reads.load() < dev->inflight_reads.load())
+    return mirror_.get();
+  return dev;
+}
+
+/* Read a run from the least loaded copy. If that takes longer than the
+ * hedging percentile, read it from the other copy as well and take the data
+ * of whichever read completes first. Both reads go to buffers owned by the
+ * requests, as the slower one may still be in flight when this returns. */
+IOStatus ZonedBlockDevice::HedgedReadRun(const ZoneReadFragment *run,
+                                         size_t nr_fragments) {
+  ZoneDevice *first_dev = PickReadDevice(devices_.front().get());
+  ZoneDevice *second_dev =
+      first_dev == mirror_.get() ? devices_.front().get() : mirror_.get();
+  uint64_t threshold = hedge_latency_->GetPercentile();
+  uint64_t start = Env::Default()->NowMicros();
+  std::unique_ptr<ZoneAsyncRead> reqs[2];
+  IOStatus s;
+
+  auto new_req = [&]() {
+    std::unique_ptr<ZoneAsyncRead> req(new ZoneAsyncRead());
+    size_t size = 0;
+    for (size_t i = 0; i < nr_fragments; i++) size += run[i].len;
+    req->buffer.reset(new char[size]);
+    size = 0;
+    for (size_t i = 0; i < nr_fragments; i++) {
+      req->fragments.push_back(
+          {run[i].dev_off, run[i].len, req->buffer.get() + size});
+      size += run[i].len;
+    }
+    return req;
+  };
+
+  reqs[0] = new_req();
+  s = SubmitAsyncRead(reqs[0].get(), true, first_dev);
+  if (s.ok()) s = PollAsyncReads({reqs[0].get()}, 1, threshold);
+
+  /* Read the other copy if the first read is slow or failed */
+  bool failed = s.ok() && !reqs[0]->status.ok();
+  if (s.IsTimedOut() || failed) {
+    if (!failed) hedged_read_qps_reporter_.AddCount(1);
+    reqs[1] = new_req();
+    s = SubmitAsyncRead(reqs[1].get(), true, second_dev);
+    if (s.ok()) s = PollAsyncReads({reqs[0].get(), reqs[1].get()}, 1);
+  }
+
+  ZoneAsyncRead *winner = nullptr;
+  if (s.ok()) {
+    std::unique_lock<std::mutex> lk(read_aio_mtx_);
+    for (const auto &req : reqs) {
+      if (req && req->done && req->status.ok()) winner = req.get();
+    }
+    /* The first read to complete failed, wait for the other one */
+    if (winner == nullptr && reqs[1]) {
+      lk.unlock();
+      s = PollAsyncReads({reqs[0].get(), reqs[1].get()}, 2);
+      lk.lock();
+      for (const auto &req : reqs) {
+        if (req->status.ok()) winner = req.get();
+      }
+    }
+    if (s.ok() && winner == nullptr) s = reqs[0]->status;
+  }
+
+  if (winner) {
+    for (size_t i = 0; i < nr_fragments; i++)
+      memcpy(run[i].dst, winner->fragments[i].dst, run[i].len);
+    hedge_latency_->Record(Env::Default()->NowMicros() - start);
+  }
+
+  std::lock_guard<std::mutex> lock(read_aio_mtx_);
+  for (auto &req : reqs) {
+    if (req && !req->done && req->inflight)
+      abandoned_reads_.push_back(std::move(req));
+  }
+  return s;
+}
+
+void ZonedBlockDevice::ReapAbandonedReadsLocked() {
+  auto it = abandoned_reads_.begin();
+  while (it != abandoned_reads_.end()) {
+    if ((*it)->done)
+      it = abandoned_reads_.erase(it);
+    else
+      ++it;
+  }
+}
+
+IOStatus ZonedBlockDevice::EnableHedgedReads(double percentile) {
+  if (!mirror_)
+    return IOStatus::InvalidArgument("Hedged reads need a mirrored device");
+  if (percentile <= 0 || percentile >= 100)
+    return IOStatus::InvalidArgument("Invalid hedging percentile");
+  if (!read_aio_ctx_)
+    return IOStatus::NotSupported("No read completion queue");
+
+  hedge_latency_.reset(new ZoneLatencyTracker(percentile));
+  Info(logger_, "Hedged reads enabled at p%.1f", percentile);
+  return IOStatus::OK();
+}
+
+void ZonedBlockDevice::CompleteAsyncReadLocked(ZoneAsyncRead *req,
+                                               struct iocb *iocb, long res) {
+  size_t idx = iocb - req->iocbs.data();
+
+  if (res < 0 || (unsigned long)res != iocb->u.c.nbytes) {
+    if (req->status.ok()) {
+      if (res == -ECANCELED)
+        req->status = IOStatus::IOError("Read cancelled\n");
+      else
+        req->status = IOStatus::IOError("Async read error\n");
+    }
+  } else if (req->bounce[idx]) {
+    const ZoneReadFragment &f = req->fragments[req->frag_idx[idx]];
+    uint64_t dev_off = f.dev_off - GetDevice(f.dev_off)->base;
+    memcpy(f.dst, req->bounce[idx] + (dev_off - iocb->u.c.offset), f.len);
+  }
+
+  req->devs[idx]->inflight_reads--;
+  if (--req->inflight == 0) req->done = true;
+}
+
+IOStatus ZonedBlockDevice::SubmitAsyncRead(ZoneAsyncRead *req, bool direct,
+                                           ZoneDevice *dev) {
+  std::vector<struct iocb *> iocb_ptrs;
+
+  for (size_t i = 0; i < req->fragments.size(); i++) {
+    const ZoneReadFragment &f = req->fragments[i];
+    uint64_t off = f.dev_off;
+    size_t len = f.len;
+    char *buf = f.dst;
+    char *bounce = nullptr;
+    struct iocb iocb;
+
+    if (read_cache_ && read_cache_->Lookup(f.dev_off, f.len, f.dst)) {
+      read_cache_hit_qps_reporter_.AddCount(1);
+      continue;
+    }
+
+    if (direct && ((off % block_sz_) || (len % block_sz_) ||
+                   ((uintptr_t)buf % block_sz_))) {
+      uint64_t end = f.dev_off + f.len;
+
+      off -= off % block_sz_;
+      if (end % block_sz_) end += block_sz_ - end % block_sz_;
+      len = end - off;
+      if (posix_memalign((void **)&bounce, block_sz_, len))
+        return IOStatus::IOError("Failed to allocate read buffer\n");
+      buf = bounce;
+    }
+
+    ZoneDevice *d = dev ? dev : PickReadDevice(GetDevice(f.dev_off));
+    io_prep_pread(&iocb, direct ? d->read_direct_f : d->read_f, buf, len,
+                  off - d->base);
+    iocb.data = req;
+    req->iocbs.push_back(iocb);
+    req->bounce.push_back(bounce);
+    req->frag_idx.push_back(i);
+    req->devs.push_back(d);
+  }
+
+  for (const auto d : req->devs) d->inflight_reads++;
+
+  size_t n = req->iocbs.size();
+  {
+    std::lock_guard<std::mutex> lock(read_aio_mtx_);
+    req->inflight = n;
+    req->done = (n == 0);
+  }
+  if (n == 0) return IOStatus::OK();
+
+  for (auto &iocb : req->iocbs) iocb_ptrs.push_back(&iocb);
+
+  size_t submitted = 0;
+  while (read_aio_ctx_ && submitted < n) {
+    int ret = io_submit(read_aio_ctx_, n - submitted, &iocb_ptrs[submitted]);
+    if (ret == -EINTR) continue;
+    if (ret <= 0) break;
+    submitted += ret;
+  }
+
+  /* The completion queue is full (or unavailable), read the rest now */
+  for (size_t i = submitted; i < n; i++) {
+    struct iocb *iocb = iocb_ptrs[i];
+    struct iovec iov = {iocb->u.c.buf, (size_t)iocb->u.c.nbytes};
+    IOStatus s = PreadvFull(iocb->aio_fildes, &iov, 1, iocb->u.c.offset);
+
+    std::lock_guard<std::mutex> lock(read_aio_mtx_);
+    CompleteAsyncReadLocked(req, iocb, s.ok() ? (long)iocb->u.c.nbytes : -EIO);
+    read_aio_cv_.notify_all();
+  }
+
+  return IOStatus::OK();
+}
+
+/* Any poller may reap completions of any request. One thread at a time waits
+ * on the completion queue while the others wait for it to hand over. */
+IOStatus ZonedBlockDevice::PollAsyncReads(
+    const std::vector<ZoneAsyncRead *> &reqs, size_t min_completions,
+    uint64_t timeout_us) {
+  struct io_event events[ZENFS_READ_AIO_DEPTH];
+  auto deadline = std::chrono::steady_clock::now() +
+                  std::chrono::microseconds(timeout_us);
+  std::unique_lock<std::mutex> lk(read_aio_mtx_);
+
+  min_completions = std::min(min_completions, reqs.size());
+  auto completed = [&reqs]() {
+    size_t n = 0;
+    for (const auto req : reqs)
+      if (req->done) n++;
+    return n;
+  };
+
+  while (completed() < min_completions) {
+    struct timespec timeout;
+    struct timespec *timeout_p = nullptr;
+
+    if (timeout_us) {
+      auto now = std::chrono::steady_clock::now();
+      if (now >= deadline) return IOStatus::TimedOut("Async read timed out");
+      uint64_t left_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                             deadline - now)
+                             .count();
+      timeout.tv_sec = left_ns / 1000000000;
+      timeout.tv_nsec = left_ns % 1000000000;
+      timeout_p = &timeout;
+    }
+
+    if (read_aio_reaping_) {
+      if (timeout_us)
+        read_aio_cv_.wait_until(lk, deadline);
+      else
+        read_aio_cv_.wait(lk);
+      continue;
+    }
+
+    read_aio_reaping_ = true;
+    lk.unlock();
+    int ret = io_getevents(read_aio_ctx_, 1, ZENFS_READ_AIO_DEPTH, events,
+                           timeout_p);
+    lk.lock();
+    read_aio_reaping_ = false;
+
+    if (ret < 0 && ret != -EINTR) {
+      read_aio_cv_.notify_all();
+      return IOStatus::IOError("Failed to reap async reads: " +
+                               ErrorToString(-ret));
+    }
+
+    for (int i = 0; i < ret; i++)
+      CompleteAsyncReadLocked((ZoneAsyncRead *)events[i].data, events[i].obj,
+                              (long)events[i].res);
+    if (ret > 0) ReapAbandonedReadsLocked();
+    read_aio_cv_.notify_all();
+  }
+
+  return IOStatus::OK();
+}
+
+IOStatus ZonedBlockDevice::AbortAsyncReads(
+    const std::vector<ZoneAsyncRead *> &reqs) {
+  struct io_event event;
+
+  {
+    std::lock_guard<std::mutex> lock(read_aio_mtx_);
+    for (const auto req : reqs) {
+      if (req->done) continue;
+      /* Block devices rarely support cancellation and newer kernels deliver
+       * the cancelled event through the completion queue, only complete
+       * the read here if the kernel handed the event back directly */
+      for (auto &iocb : req->iocbs) {
+        if (io_cancel(read_aio_ctx_, &iocb, &event) == 0)
+          CompleteAsyncReadLocked(req, &iocb, -ECANCELED);
+      }
+    }
+  }
+
+  return PollAsyncReads(reqs, reqs.size());
 }
 
 std::vector<ZoneStat> ZonedBlockDevice::GetStat() {
   std::vector<ZoneStat> stat;
   for (const auto z : io_zones_) {
     ZoneStat zone_stat;
-    zone_stat.total_capacity = z->max_capacity_;
-    zone_stat.write_position = z->wp_;
-    zone_stat.start_position = z->start_;
+    z->GetStat(&zone_stat);
     stat.emplace_back(std::move(zone_stat));
   }
   return stat;
 }
 
+void ZonedBlockDevice::ForEachZoneStat(
+    const std::function<void(const ZoneStat &)> &fn) {
+  ZoneStat zone_stat;
+  for (const auto z : io_zones_) {
+    z->GetStat(&zone_stat);
+    fn(zone_stat);
+  }
+}
+
 BackgroundWorker::BackgroundWorker(bool run_at_beginning) {
   {
     std::unique_lock<std::mutex> lk(job_mtx_);
@@ -354,6 +1067,8 @@ static std::string write_latency_metric_name = "zenfs_write_latency";
 static std::string read_latency_metric_name = "zenfs_read_latency";
 static std::string fg_sync_latency_metric_name = "fg_zenfs_sync_latency";
 static std::string bg_sync_latency_metric_name = "bg_zenfs_sync_latency";
+static std::string polled_sync_latency_metric_name =
+    "polled_zenfs_sync_latency";
 static std::string io_alloc_wal_latency_metric_name = "zenfs_io_alloc_wal_latency";
 static std::string io_alloc_non_wal_latency_metric_name = "zenfs_io_alloc_non_wal_latency";
 static std::string io_alloc_wal_actual_latency_metric_name = "zenfs_io_alloc_wal_actual_latency";
@@ -363,6 +1078,8 @@ static std::string roll_latency_metric_name = "zenfs_roll_latency";
 
 static std::string write_qps_metric_name = "zenfs_write_qps";
 static std::string read_qps_metric_name = "zenfs_read_qps";
+static std::string read_cache_hit_qps_metric_name = "zenfs_read_cache_hit_qps";
+static std::string hedged_read_qps_metric_name = "zenfs_hedged_read_qps";
 static std::string sync_qps_metric_name = "zenfs_sync_qps";
 static std::string io_alloc_qps_metric_name = "zenfs_io_alloc_qps";
 static std::string meta_alloc_qps_metric_name = "zenfs_meta_alloc_qps";
@@ -370,6 +1087,8 @@ static std::string roll_qps_metric_name = "zenfs_roll_qps";
 
 static std::string write_throughput_metric_name = "zenfs_write_throughput";
 static std::string roll_throughput_metric_name = "zenfs_roll_throughput";
+static std::string finish_wasted_throughput_metric_name =
+    "zenfs_finish_wasted_throughput";
 
 static std::string active_zones_metric_name = "zenfs_active_zones";
 static std::string open_zones_metric_name = "zenfs_open_zones";
@@ -397,6 +1116,9 @@ ZonedBlockDevice::ZonedBlockDevice(std::string bdevname, std::shared_ptr<Logger>
           *metrics_reporter_factory_->BuildHistReporter(fg_sync_latency_metric_name, bytedance_tags_)),
       bg_sync_latency_reporter_(
           *metrics_reporter_factory_->BuildHistReporter(bg_sync_latency_metric_name, bytedance_tags_)),
+      polled_sync_latency_reporter_(
+          *metrics_reporter_factory_->BuildHistReporter(
+              polled_sync_latency_metric_name, bytedance_tags_)),
       meta_alloc_latency_reporter_(
           *metrics_reporter_factory_->BuildHistReporter(
               meta_alloc_latency_metric_name, bytedance_tags_)),
@@ -414,6 +1136,11 @@ ZonedBlockDevice::ZonedBlockDevice(std::string bdevname, std::shared_ptr<Logger>
           write_qps_metric_name, bytedance_tags_)),
       read_qps_reporter_(*metrics_reporter_factory_->BuildCountReporter(
           read_qps_metric_name, bytedance_tags_)),
+      read_cache_hit_qps_reporter_(
+          *metrics_reporter_factory_->BuildCountReporter(
+              read_cache_hit_qps_metric_name, bytedance_tags_)),
+      hedged_read_qps_reporter_(*metrics_reporter_factory_->BuildCountReporter(
+          hedged_read_qps_metric_name, bytedance_tags_)),
       sync_qps_reporter_(*metrics_reporter_factory_->BuildCountReporter(
           sync_qps_metric_name, bytedance_tags_)),
       meta_alloc_qps_reporter_(*metrics_reporter_factory_->BuildCountReporter(
@@ -426,6 +1153,9 @@ ZonedBlockDevice::ZonedBlockDevice(std::string bdevname, std::shared_ptr<Logger>
           write_throughput_metric_name, bytedance_tags_)),
       roll_throughput_reporter_(*metrics_reporter_factory_->BuildCountReporter(
           roll_throughput_metric_name, bytedance_tags_)),
+      finish_wasted_throughput_reporter_(
+          *metrics_reporter_factory_->BuildCountReporter(
+              finish_wasted_throughput_metric_name, bytedance_tags_)),
       active_zones_reporter_(*metrics_reporter_factory_->BuildHistReporter(
           active_zones_metric_name, bytedance_tags_)),
       open_zones_reporter_(*metrics_reporter_factory_->BuildHistReporter(
@@ -449,136 +1179,434 @@ std::string ZonedBlockDevice::ErrorToString(int err) {
 }
 
 IOStatus ZonedBlockDevice::CheckScheduler() {
-  std::ostringstream path;
-  std::string s = filename_;
-  std::fstream f;
+  std::vector<ZoneDevice *> devices;
+  for (const auto &dev : devices_) devices.push_back(dev.get());
+  if (mirror_) devices.push_back(mirror_.get());
+
+  for (const auto dev : devices) {
+    std::ostringstream path;
+    std::string s = dev->filename;
+    std::fstream f;
+
+    s.erase(0, 5);  // Remove "/dev/" from /dev/nvmeXnY
+    path << "/sys/block/" << s << "/queue/scheduler";
+    f.open(path.str(), std::fstream::in);
+    if (!f.is_open()) {
+      return IOStatus::InvalidArgument("Failed to open " + path.str());
+    }
 
-  s.erase(0, 5);  // Remove "/dev/" from /dev/nvmeXnY
-  path << "/sys/block/" << s << "/queue/scheduler";
-  f.open(path.str(), std::fstream::in);
-  if (!f.is_open()) {
-    return IOStatus::InvalidArgument("Failed to open " + path.str());
-  }
+    std::string buf;
+    getline(f, buf);
+    if (buf.find("[mq-deadline]") == std::string::npos) {
+      f.close();
+      return IOStatus::InvalidArgument(
+          "Current ZBD scheduler is not mq-deadline, set it to mq-deadline.");
+    }
 
-  std::string buf;
-  getline(f, buf);
-  if (buf.find("[mq-deadline]") == std::string::npos) {
     f.close();
-    return IOStatus::InvalidArgument("Current ZBD scheduler is not mq-deadline, set it to mq-deadline.");
   }
-
-  f.close();
   return IOStatus::OK();
 }
 
-IOStatus ZonedBlockDevice::Open(bool readonly) {
-  struct zbd_zone *zone_rep;
-  unsigned int reported_zones;
-  uint64_t addr_space_sz;
-  zbd_info info;
-  Status s;
-  uint64_t i = 0;
-  uint64_t m = 0;
-  int ret;
+IOStatus ZonedBlockDevice::EnablePolledWAL(bool sqpoll, int sq_cpu) {
+  std::vector<ZoneDevice *> devices;
+  for (const auto &dev : devices_) devices.push_back(dev.get());
+  if (mirror_) devices.push_back(mirror_.get());
 
-  read_f_ = zbd_open(filename_.c_str(), O_RDONLY, &info);
-  if (read_f_ < 0) {
-    return IOStatus::InvalidArgument("Failed to open zoned block device: " + ErrorToString(errno));
+  for (const auto dev : devices) {
+    if (dev->write_f < 0)
+      return IOStatus::InvalidArgument("Device is read only");
   }
 
-  read_direct_f_ = zbd_open(filename_.c_str(), O_RDONLY | O_DIRECT, &info);
-  if (read_direct_f_ < 0) {
-    return IOStatus::InvalidArgument("Failed to open zoned block device: " + ErrorToString(errno));
+  for (const auto dev : devices) {
+    std::unique_ptr<ZonePolledQueue> queue(new ZonePolledQueue());
+    IOStatus s = queue->Open(dev->write_f, sqpoll, sq_cpu);
+    if (!s.ok()) {
+      Warn(logger_, "Polled WAL writes not available on %s: %s",
+           dev->filename.c_str(), s.ToString().c_str());
+      for (const auto d : devices) d->polled_queue.reset();
+      return s;
+    }
+    dev->polled_queue = std::move(queue);
   }
 
-  if (readonly) {
-    write_f_ = -1;
-  } else {
-    write_f_ = zbd_open(filename_.c_str(), O_WRONLY | O_DIRECT | O_EXCL, &info);
-    if (write_f_ < 0) {
-      return IOStatus::InvalidArgument("Failed to open zoned block device: " + ErrorToString(errno));
+  Info(logger_, "Polled WAL writes enabled, sqpoll: %d cpu: %d", sqpoll,
+       sq_cpu);
+  polled_wal_ = true;
+  return IOStatus::OK();
+}
+
+const char *ZonedBlockDevice::Map() {
+  std::lock_guard<std::mutex> lock(mapping_mtx_);
+
+  if (mapping_) return mapping_;
+
+  /* Reserve the whole address space, then map every device at its base */
+  uint64_t size = (uint64_t)nr_zones_ * zone_sz_;
+  void *addr = mmap(nullptr, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS,
+                    -1, 0);
+  if (addr == MAP_FAILED) {
+    Warn(logger_, "Failed to map zoned block device: %s",
+         ErrorToString(errno).c_str());
+    return nullptr;
+  }
+
+  for (const auto &dev : devices_) {
+    void *dev_addr = mmap((char *)addr + dev->base,
+                          (uint64_t)dev->nr_zones * zone_sz_, PROT_READ,
+                          MAP_SHARED | MAP_FIXED, dev->read_f, 0);
+    if (dev_addr == MAP_FAILED) {
+      Warn(logger_, "Failed to map zoned block device %s: %s",
+           dev->filename.c_str(), ErrorToString(errno).c_str());
+      munmap(addr, size);
+      return nullptr;
     }
   }
 
-  if (info.model != ZBD_DM_HOST_MANAGED) {
-    return IOStatus::NotSupported("Not a host managed block device");
+  mapping_ = (char *)addr;
+  return mapping_;
+}
+
+IOStatus ZonedBlockDevice::OpenDevice(ZoneDevice *dev, bool readonly,
+                                      bool exclusive, zbd_info *info) {
+  const char *name = dev->filename.c_str();
+
+  dev->read_f = zbd_open(name, O_RDONLY, info);
+  if (dev->read_f < 0) {
+    return IOStatus::InvalidArgument("Failed to open zoned block device " +
+                                     dev->filename + ": " +
+                                     ErrorToString(errno));
   }
 
-  if (info.nr_zones < ZENFS_MIN_ZONES) {
-    return IOStatus::NotSupported("To few zones on zoned block device (32 required)");
+  dev->read_direct_f = zbd_open(name, O_RDONLY | O_DIRECT, info);
+  if (dev->read_direct_f < 0) {
+    return IOStatus::InvalidArgument("Failed to open zoned block device " +
+                                     dev->filename + ": " +
+                                     ErrorToString(errno));
   }
 
-  IOStatus ios = CheckScheduler();
-  if (ios != IOStatus::OK()) return ios;
+  if (!readonly) {
+    int flags = O_WRONLY | O_DIRECT | (exclusive ? O_EXCL : 0);
+    dev->write_f = zbd_open(name, flags, info);
+    if (dev->write_f < 0) {
+      return IOStatus::InvalidArgument("Failed to open zoned block device " +
+                                       dev->filename + ": " +
+                                       ErrorToString(errno));
+    }
+  }
+
+  if (info->model != ZBD_DM_HOST_MANAGED) {
+    return IOStatus::NotSupported("Not a host managed block device: " +
+                                  dev->filename);
+  }
+
+  dev->nr_zones = info->nr_zones;
+  return IOStatus::OK();
+}
 
-  block_sz_ = info.pblock_size;
-  zone_sz_ = info.zone_size;
-  nr_zones_ = info.nr_zones;
+IOStatus ZonedBlockDevice::ClaimZoneRange(ZoneDevice *dev,
+                                          uint64_t dev_first) {
+  uint64_t first = std::max((uint64_t)range_first_, dev_first);
+  uint64_t end = std::min((uint64_t)range_first_ + range_nr_,
+                          dev_first + dev->nr_zones);
+  struct flock lock;
+
+  if (end <= first) return IOStatus::OK();
+
+  /* Open file description locks conflict between file descriptors of the
+   * same process too, and go away when the write fd is closed */
+  memset(&lock, 0, sizeof(lock));
+  lock.l_type = F_WRLCK;
+  lock.l_whence = SEEK_SET;
+  lock.l_start = (first - dev_first) * zone_sz_;
+  lock.l_len = (end - first) * zone_sz_;
+  if (fcntl(dev->write_f, F_OFD_SETLK, &lock) < 0) {
+    if (errno == EAGAIN || errno == EACCES)
+      return IOStatus::Busy("Zone range in use by another file system: " +
+                            dev->filename);
+    return IOStatus::IOError("Failed to claim zone range on " +
+                             dev->filename + ": " + ErrorToString(errno));
+  }
 
-  /* We need 3 open zones for meta data writes , the rest can be used for files
-   */
-  max_nr_active_io_zones_ = info.max_nr_active_zones - 3;
-  max_nr_open_io_zones_ = info.max_nr_active_zones - 3;
+  return IOStatus::OK();
+}
 
-  Info(logger_, "Zone block device nr zones: %u max active: %u max open: %u \n", info.nr_zones,
-       info.max_nr_active_zones, info.max_nr_open_zones);
+/* Io zones of a device that may be active at once, with reserved zones
+ * kept for metadata. Devices without an active zone limit report 0. */
+static uint32_t ActiveIOZoneLimit(uint32_t max_nr_active_zones,
+                                  uint32_t reserved) {
+  if (max_nr_active_zones == 0) return ZENFS_MAX_ACTIVE_IO_ZONES;
+  if (max_nr_active_zones <= reserved) return 1;
+  return std::min<uint32_t>(max_nr_active_zones - reserved,
+                            ZENFS_MAX_ACTIVE_IO_ZONES);
+}
 
-  addr_space_sz = (uint64_t)nr_zones_ * zone_sz_;
+IOStatus ZonedBlockDevice::Open(bool readonly) {
+  uint64_t max_active = 0;
+  uint64_t base = 0;
+  std::string name;
+  std::string list = filename_.substr(5);  // Remove "/dev/"
+  bool mirror = list.compare(0, strlen(ZENFS_MIRROR_PREFIX),
+                             ZENFS_MIRROR_PREFIX) == 0;
+
+  if (mirror) list.erase(0, strlen(ZENFS_MIRROR_PREFIX));
+
+  size_t at = list.rfind('@');
+  if (at != std::string::npos) {
+    const char *range = list.c_str() + at + 1;
+    char *end;
+
+    range_first_ = strtoul(range, &end, 10);
+    if (end == range || *end != '+')
+      return IOStatus::InvalidArgument("Invalid zone range: " + list);
+    range = end + 1;
+    range_nr_ = strtoul(range, &end, 10);
+    if (end == range || *end != '\0' || range_nr_ == 0)
+      return IOStatus::InvalidArgument("Invalid zone range: " + list);
+    list.erase(at);
+  }
 
-  ret = zbd_list_zones(read_f_, 0, addr_space_sz, ZBD_RO_ALL, &zone_rep, &reported_zones);
+  std::istringstream names(list);
+  while (std::getline(names, name, ',')) {
+    if (name.empty()) continue;
+    std::unique_ptr<ZoneDevice> dev(new ZoneDevice());
+    dev->filename = "/dev/" + name;
+    devices_.push_back(std::move(dev));
+  }
+  if (devices_.empty())
+    return IOStatus::InvalidArgument("No zoned block device given");
+
+  if (mirror) {
+    if (devices_.size() != 2)
+      return IOStatus::InvalidArgument("A mirror needs two devices");
+    mirror_ = std::move(devices_.back());
+    devices_.pop_back();
+  }
 
-  if (ret || reported_zones != nr_zones_) {
-    Error(logger_, "Failed to list zones, err: %d", ret);
-    return IOStatus::IOError("Failed to list zones");
+  /* Async reads fall back to synchronous reads without a completion queue */
+  if (io_setup(ZENFS_READ_AIO_DEPTH, &read_aio_ctx_) < 0) {
+    Warn(logger_, "Failed to allocate read io context\n");
+    read_aio_ctx_ = 0;
   }
 
-  while (m < ZENFS_OP_LOG_ZONES && i < reported_zones) {
-    struct zbd_zone *z = &zone_rep[i++];
-    /* Only use sequential write required zones */
-    if (zbd_zone_type(z) == ZBD_ZONE_TYPE_SWR) {
-      if (!zbd_zone_offline(z)) {
-        op_zones_.push_back(new Zone(this, z));
+  nr_zones_ = 0;
+  for (size_t d = 0; d < devices_.size(); d++) {
+    ZoneDevice *dev = devices_[d].get();
+    zbd_info info;
+
+    IOStatus ios = OpenDevice(dev, readonly, range_nr_ == 0, &info);
+    if (!ios.ok()) return ios;
+
+    if (d == 0) {
+      if (info.nr_zones < ZENFS_MIN_ZONES) {
+        return IOStatus::NotSupported(
+            "To few zones on zoned block device (32 required)");
       }
-      m++;
+      block_sz_ = info.pblock_size;
+      zone_sz_ = info.zone_size;
+      /* We need 3 open zones for meta data writes , the rest can be used for
+       * files */
+      dev->max_active_zones = ActiveIOZoneLimit(info.max_nr_active_zones, 3);
+    } else {
+      if (info.pblock_size != block_sz_ || info.zone_size != zone_sz_) {
+        return IOStatus::NotSupported(
+            "Zoned block devices must have the same block and zone size: " +
+            dev->filename);
+      }
+      dev->max_active_zones = ActiveIOZoneLimit(info.max_nr_active_zones, 0);
     }
+
+    dev->base = base;
+    base += (uint64_t)info.nr_zones * zone_sz_;
+    nr_zones_ += info.nr_zones;
+    max_active += dev->max_active_zones;
+
+    Info(logger_,
+         "Zone block device %s nr zones: %u max active: %u max open: %u \n",
+         dev->filename.c_str(), info.nr_zones, info.max_nr_active_zones,
+         info.max_nr_open_zones);
   }
 
-  m = 0;
-  // initialize metadata snapshop zones
-  while (m < ZENFS_SNAPSHOT_ZONES && i < reported_zones) {
-    struct zbd_zone *z = &zone_rep[i++];
-    /* Only use sequential write required zones */
-    if (zbd_zone_type(z) == ZBD_ZONE_TYPE_SWR) {
-      if (!zbd_zone_offline(z)) {
-        snapshot_zones_.push_back(new Zone(this, z));
-      }
-      m++;
+  if (mirror_) {
+    zbd_info info;
+
+    IOStatus ios = OpenDevice(mirror_.get(), readonly, range_nr_ == 0, &info);
+    if (!ios.ok()) return ios;
+
+    if (info.pblock_size != block_sz_ || info.zone_size != zone_sz_ ||
+        info.nr_zones < nr_zones_) {
+      return IOStatus::NotSupported(
+          "The mirror must have the same block and zone size and at least as "
+          "many zones: " +
+          mirror_->filename);
     }
+
+    /* Zones are opened in pairs, the mirror holds metadata copies too */
+    mirror_->max_active_zones = ActiveIOZoneLimit(info.max_nr_active_zones, 3);
+    max_active = std::min(max_active, (uint64_t)mirror_->max_active_zones);
+
+    Info(logger_, "Mirror device %s nr zones: %u max active: %u \n",
+         mirror_->filename.c_str(), info.nr_zones, info.max_nr_active_zones);
   }
 
+  IOStatus ios = CheckScheduler();
+  if (ios != IOStatus::OK()) return ios;
+
+  if (max_active > ZENFS_MAX_ACTIVE_IO_ZONES)
+    max_active = ZENFS_MAX_ACTIVE_IO_ZONES;
+
+  if (range_nr_ == 0) {
+    range_nr_ = nr_zones_;
+  } else {
+    if (((uint64_t)range_first_ + range_nr_) > nr_zones_)
+      return IOStatus::InvalidArgument("Zone range beyond the device");
+    if (range_nr_ < ZENFS_MIN_ZONES)
+      return IOStatus::NotSupported("To few zones in zone range (32 required)");
+
+    /* Every range needs its own metadata zones, take them out of a share of
+     * the device limit proportional to the range */
+    uint64_t share = (max_active + 3) * range_nr_ / nr_zones_;
+    max_active = share > 4 ? share - 3 : 1;
+
+    Info(logger_, "Zone range %u+%u, max active: %lu\n", range_first_,
+         range_nr_, max_active);
+  }
+
+  /* Without a range the claim covers the whole device, so that no range
+   * is mounted along with it */
+  if (!readonly) {
+    for (auto &dev : devices_) {
+      ios = ClaimZoneRange(dev.get(), dev->base / zone_sz_);
+      if (!ios.ok()) return ios;
+    }
+    if (mirror_) {
+      ios = ClaimZoneRange(mirror_.get(), 0);
+      if (!ios.ok()) return ios;
+    }
+  }
+
+  max_nr_active_io_zones_ = max_active;
+  max_nr_open_io_zones_ = max_active;
+
   active_io_zones_ = 0;
   open_io_zones_ = 0;
 
-  for (; i < reported_zones; i++) {
-    struct zbd_zone *z = &zone_rep[i];
-    /* Only use sequential write required zones */
-    if (zbd_zone_type(z) == ZBD_ZONE_TYPE_SWR) {
-      if (!zbd_zone_offline(z)) {
-        Zone *newZone = new Zone(this, z);
-        io_zones_.push_back(newZone);
-        if (zbd_zone_imp_open(z) || zbd_zone_exp_open(z) || zbd_zone_closed(z)) {
-          active_io_zones_++;
-          if (zbd_zone_imp_open(z) || zbd_zone_exp_open(z)) {
-            if (!readonly) {
-              newZone->Close();
+  uint64_t range_end = (uint64_t)range_first_ + range_nr_;
+  uint64_t op_m = 0;
+  uint64_t snapshot_m = 0;
+  for (size_t d = 0; d < devices_.size(); d++) {
+    ZoneDevice *dev = devices_[d].get();
+    struct zbd_zone *zone_rep;
+    struct zbd_zone *mirror_rep = nullptr;
+    unsigned int reported_zones;
+    unsigned int mirror_zones;
+    uint64_t dev_first = dev->base / zone_sz_;
+    int ret;
+
+    /* Only the zones in the range are used */
+    if (range_end <= dev_first || range_first_ >= dev_first + dev->nr_zones)
+      continue;
+
+    ret = zbd_list_zones(dev->read_f, 0, (uint64_t)dev->nr_zones * zone_sz_,
+                         ZBD_RO_ALL, &zone_rep, &reported_zones);
+
+    if (ret || reported_zones != dev->nr_zones) {
+      Error(logger_, "Failed to list zones of %s, err: %d",
+            dev->filename.c_str(), ret);
+      return IOStatus::IOError("Failed to list zones");
+    }
+
+    if (mirror_) {
+      ret = zbd_list_zones(mirror_->read_f, 0,
+                           (uint64_t)dev->nr_zones * zone_sz_, ZBD_RO_ALL,
+                           &mirror_rep, &mirror_zones);
+      if (ret || mirror_zones != dev->nr_zones) {
+        Error(logger_, "Failed to list zones of %s, err: %d",
+              mirror_->filename.c_str(), ret);
+        free(zone_rep);
+        return IOStatus::IOError("Failed to list zones");
+      }
+    }
+
+    /* A zone is only used if its mirror zone, if any, is usable as well */
+    auto mirror_zone = [&](uint64_t n) {
+      return mirror_rep ? &mirror_rep[n] : nullptr;
+    };
+    auto is_swr = [&](uint64_t n) {
+      return zbd_zone_type(&zone_rep[n]) == ZBD_ZONE_TYPE_SWR &&
+             (!mirror_rep ||
+              zbd_zone_type(&mirror_rep[n]) == ZBD_ZONE_TYPE_SWR);
+    };
+    auto is_offline = [&](uint64_t n) {
+      return zbd_zone_offline(&zone_rep[n]) ||
+             (mirror_rep && zbd_zone_offline(&mirror_rep[n]));
+    };
+
+    uint64_t i = range_first_ > dev_first ? range_first_ - dev_first : 0;
+    uint64_t end = std::min((uint64_t)reported_zones, range_end - dev_first);
+
+    /* The metadata zones are the first zones of the range */
+    while (op_m < ZENFS_OP_LOG_ZONES && i < end) {
+      struct zbd_zone *z = &zone_rep[i++];
+      /* Only use sequential write required zones */
+      if (is_swr(i - 1)) {
+        if (!is_offline(i - 1)) {
+          op_zones_.push_back(
+              new Zone(this, dev, z, mirror_.get(), mirror_zone(i - 1)));
+        }
+        op_m++;
+      }
+    }
+
+    // initialize metadata snapshop zones
+    while (snapshot_m < ZENFS_SNAPSHOT_ZONES && i < end) {
+      struct zbd_zone *z = &zone_rep[i++];
+      /* Only use sequential write required zones */
+      if (is_swr(i - 1)) {
+        if (!is_offline(i - 1)) {
+          snapshot_zones_.push_back(
+              new Zone(this, dev, z, mirror_.get(), mirror_zone(i - 1)));
+        }
+        snapshot_m++;
+      }
+    }
+
+    for (; i < end; i++) {
+      struct zbd_zone *z = &zone_rep[i];
+      struct zbd_zone *mz = mirror_zone(i);
+      /* Only use sequential write required zones */
+      if (is_swr(i)) {
+        if (!is_offline(i)) {
+          Zone *newZone = new Zone(this, dev, z, mirror_.get(), mz);
+          io_zones_.push_back(newZone);
+          io_zones_by_nr_.resize(newZone->GetZoneNr() + 1, nullptr);
+          io_zones_by_nr_[newZone->GetZoneNr()] = newZone;
+          if (mz && zbd_zone_wp(mz) != zbd_zone_wp(z)) {
+            /* An append did not make it to both copies before a crash.
+             * Finish the zone, it is reclaimed like any full zone */
+            Warn(logger_, "Mirrored zone 0x%lx diverged, finishing it",
+                 newZone->start_);
+            if (!readonly && !newZone->Finish().ok()) {
+              Warn(logger_, "Failed to finish diverged zone 0x%lx",
+                   newZone->start_);
+            }
+          } else if (zbd_zone_imp_open(z) || zbd_zone_exp_open(z) ||
+                     zbd_zone_closed(z)) {
+            active_io_zones_++;
+            if (zbd_zone_imp_open(z) || zbd_zone_exp_open(z)) {
+              if (!readonly) {
+                newZone->Close();
+              }
             }
           }
         }
       }
     }
+
+    free(zone_rep);
+    free(mirror_rep);
   }
 
-  free(zone_rep);
   start_time_ = time(NULL);
 
   meta_worker_.reset(new BackgroundWorker());
@@ -621,6 +1649,109 @@ uint64_t ZonedBlockDevice::GetReclaimableSpace() {
   return reclaimable;
 }
 
+ZoneSpaceInfo ZonedBlockDevice::GetSpaceInfo() {
+  ZoneSpaceInfo info;
+  uint32_t low, high, critical;
+
+  for (const auto z : io_zones_) {
+    info.total_space += z->max_capacity_;
+    info.free_space += z->capacity_;
+    if (z->IsFull())
+      info.reclaimable_space += z->max_capacity_ - z->used_capacity_;
+    if (z->IsEmpty()) info.empty_zones++;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(space_pressure_mtx_);
+    low = pressure_low_pct_;
+    high = pressure_high_pct_;
+    critical = pressure_critical_pct_;
+  }
+
+  int level = (int)ZoneSpacePressure::kNone;
+  if (info.total_space) {
+    uint64_t free_pct = 100 * info.free_space / info.total_space;
+    if (free_pct < critical)
+      level = (int)ZoneSpacePressure::kCritical;
+    else if (free_pct < high)
+      level = (int)ZoneSpacePressure::kHigh;
+    else if (free_pct < low)
+      level = (int)ZoneSpacePressure::kLow;
+  }
+
+  /* New zones can not be opened much longer */
+  if (info.empty_zones <= 2 && level < (int)ZoneSpacePressure::kHigh)
+    level = (int)ZoneSpacePressure::kHigh;
+
+  if (level > (int)ZoneSpacePressure::kNone &&
+      level < (int)ZoneSpacePressure::kCritical &&
+      info.reclaimable_space > info.free_space)
+    level++;
+
+  info.pressure = (ZoneSpacePressure)level;
+  return info;
+}
+
+ZoneGeometry ZonedBlockDevice::GetGeometry() {
+  ZoneGeometry geo;
+
+  geo.zone_size = zone_sz_;
+  geo.block_size = block_sz_;
+  geo.io_zones = io_zones_.size();
+  geo.max_active_zones = max_nr_active_io_zones_;
+  geo.streams.resize(Env::WLTH_EXTREME + 1);
+
+  ZoneStat zone_stat;
+  for (const auto z : io_zones_) {
+    if (geo.zone_capacity == 0 || z->max_capacity_ < geo.zone_capacity)
+      geo.zone_capacity = z->max_capacity_;
+
+    z->GetStat(&zone_stat);
+    for (size_t i = 0; i < geo.streams.size(); i++)
+      geo.streams[i].live_bytes += zone_stat.lifetime_bytes[i];
+
+    if (z->IsEmpty()) continue;
+    Env::WriteLifeTimeHint lifetime = z->lifetime_;
+    if (lifetime < Env::WLTH_NOT_SET || lifetime > Env::WLTH_EXTREME)
+      lifetime = Env::WLTH_NOT_SET;
+    ZoneStreamInfo &stream = geo.streams[lifetime];
+    stream.zones++;
+    if (!z->IsFull()) {
+      stream.partial_zones++;
+      stream.tail_bytes += z->capacity_;
+    }
+  }
+
+  return geo;
+}
+
+void ZonedBlockDevice::SetSpacePressureThresholds(uint32_t low_pct,
+                                                  uint32_t high_pct,
+                                                  uint32_t critical_pct) {
+  std::lock_guard<std::mutex> lock(space_pressure_mtx_);
+  pressure_low_pct_ = low_pct;
+  pressure_high_pct_ = high_pct;
+  pressure_critical_pct_ = critical_pct;
+}
+
+void ZonedBlockDevice::SetSpacePressureListener(
+    std::function<void(const ZoneSpaceInfo &)> listener) {
+  std::lock_guard<std::mutex> lock(space_pressure_mtx_);
+  space_pressure_listener_ = listener;
+}
+
+void ZonedBlockDevice::UpdateSpacePressure() {
+  ZoneSpaceInfo info = GetSpaceInfo();
+  std::lock_guard<std::mutex> lock(space_pressure_mtx_);
+
+  if (info.pressure == space_pressure_) return;
+
+  Info(logger_, "Space pressure changed from %d to %d, free %lu MB",
+       (int)space_pressure_, (int)info.pressure, info.free_space / MB);
+  space_pressure_ = info.pressure;
+  if (space_pressure_listener_) space_pressure_listener_(info);
+}
+
 void ZonedBlockDevice::ReportSpaceUtilization() {
   Info(logger_, "zbd free space %lu GB MkFS\n", GetFreeSpace() / (1024 * 1024 * 1024));
   zbd_free_space_reporter_.AddRecord(GetFreeSpace() / (1024 * 1024 * 1024));
@@ -675,6 +1806,8 @@ void ZonedBlockDevice::LogZoneUsage() {
 ZonedBlockDevice::~ZonedBlockDevice() {
 
   meta_worker_.reset(nullptr);
+  /* Pending resets and finishes reference the zones below */
+  data_worker_.reset(nullptr);
 
   for (const auto z : op_zones_) {
     delete z;
@@ -684,13 +1817,34 @@ ZonedBlockDevice::~ZonedBlockDevice() {
     delete z;
   }
 
+  for (const auto &zones : extra_op_zones_) {
+    for (const auto z : zones) delete z;
+  }
+
   for (const auto z : io_zones_) {
     delete z;
   }
 
-  zbd_close(read_f_);
-  zbd_close(read_direct_f_);
-  zbd_close(write_f_);
+  if (!abandoned_reads_.empty()) {
+    /* Take them out of the list so polling does not free them */
+    std::vector<std::unique_ptr<ZoneAsyncRead>> abandoned;
+    std::vector<ZoneAsyncRead *> reqs;
+    abandoned.swap(abandoned_reads_);
+    for (const auto &req : abandoned) reqs.push_back(req.get());
+    AbortAsyncReads(reqs);
+  }
+
+  if (read_aio_ctx_) io_destroy(read_aio_ctx_);
+
+  if (mapping_) munmap(mapping_, (uint64_t)nr_zones_ * zone_sz_);
+
+  if (mirror_) devices_.push_back(std::move(mirror_));
+  for (const auto &dev : devices_) {
+    dev->polled_queue.reset();
+    if (dev->read_f >= 0) zbd_close(dev->read_f);
+    if (dev->read_direct_f >= 0) zbd_close(dev->read_direct_f);
+    if (dev->write_f >= 0) zbd_close(dev->write_f);
+  }
 }
 
 #define LIFETIME_DIFF_NOT_GOOD (100)
@@ -714,11 +1868,59 @@ unsigned int GetLifeTimeDiff(Env::WriteLifeTimeHint zone_lifetime, Env::WriteLif
   return LIFETIME_DIFF_NOT_GOOD;
 }
 
-Zone *ZonedBlockDevice::AllocateMetaZone() {
+IOStatus ZonedBlockDevice::ReserveOpStreamZones(uint32_t nr_streams) {
+  uint32_t nr_extra = nr_streams - 1;
+
+  if (nr_streams == 0 || nr_streams > ZENFS_MAX_OP_STREAMS)
+    return IOStatus::InvalidArgument("Invalid number of op log streams");
+
+  if (extra_op_zones_.size() == nr_extra) return IOStatus::OK();
+  if (!extra_op_zones_.empty())
+    return IOStatus::InvalidArgument("Op log streams already reserved");
+
+  if (io_zones_.empty())
+    return IOStatus::InvalidArgument("No io zones for op log streams");
+
+  /* The zones are taken from the end of the range */
+  ZoneDevice *last = io_zones_.back()->GetDevice();
+  if (nr_extra >= max_nr_active_io_zones_ ||
+      nr_extra >= max_nr_open_io_zones_ || nr_extra >= last->max_active_zones ||
+      (nr_extra * ZENFS_OP_LOG_ZONES) > (io_zones_.size() / 2))
+    return IOStatus::InvalidArgument("Too many op log streams for device");
+
+  std::lock_guard<std::mutex> lock(zone_resources_mtx_);
+
+  for (uint32_t i = 0; i < nr_extra; i++) {
+    std::vector<Zone *> zones;
+    for (int m = 0; m < ZENFS_OP_LOG_ZONES; m++) {
+      Zone *z = io_zones_.back();
+      io_zones_.pop_back();
+      io_zones_by_nr_[z->GetZoneNr()] = nullptr;
+      if (!(z->IsFull() || z->IsEmpty())) active_io_zones_--;
+      zones.push_back(z);
+    }
+    extra_op_zones_.push_back(zones);
+  }
+
+  /* Every stream keeps a zone open for writing */
+  max_nr_active_io_zones_ -= nr_extra;
+  max_nr_open_io_zones_ -= nr_extra;
+  last->max_active_zones -= nr_extra;
+
+  return IOStatus::OK();
+}
+
+std::vector<Zone *> ZonedBlockDevice::GetOpZones(uint32_t stream) {
+  if (stream == 0) return op_zones_;
+  assert(stream <= extra_op_zones_.size());
+  return extra_op_zones_[stream - 1];
+}
+
+Zone *ZonedBlockDevice::AllocateMetaZone(uint32_t stream) {
   LatencyHistGuard guard(&meta_alloc_latency_reporter_);
   meta_alloc_qps_reporter_.AddCount(1);
 
-  for (const auto z : op_zones_) {
+  for (const auto z : GetOpZones(stream)) {
     if (z->IsEmpty()) {
       return z;
     }
@@ -751,7 +1953,34 @@ void ZonedBlockDevice::ResetUnusedIOZones() {
   }
 }
 
-Zone *ZonedBlockDevice::AllocateZone(Env::WriteLifeTimeHint file_lifetime, bool is_wal) {
+std::vector<ZoneDevice *> ZonedBlockDevice::DevicesByLoad() {
+  std::vector<ZoneDevice *> devices;
+
+  if (devices_.size() == 1) {
+    devices.push_back(devices_.front().get());
+    return devices;
+  }
+
+  std::map<ZoneDevice *, uint32_t> active;
+  for (const auto z : io_zones_) {
+    if (z->open_for_write_ || !(z->IsEmpty() || z->IsFull()))
+      active[z->GetDevice()]++;
+  }
+
+  /* Devices out of active zones can not take another zone */
+  for (const auto &dev : devices_) {
+    if (active[dev.get()] < dev->max_active_zones) devices.push_back(dev.get());
+  }
+
+  std::stable_sort(devices.begin(), devices.end(),
+                   [&](ZoneDevice *a, ZoneDevice *b) {
+                     return active[a] < active[b];
+                   });
+  return devices;
+}
+
+Zone *ZonedBlockDevice::AllocateZone(Env::WriteLifeTimeHint file_lifetime,
+                                     bool is_wal, uint64_t size_hint) {
   Zone *allocated_zone = nullptr;
   Zone *finish_victim = nullptr;
   unsigned int best_diff;
@@ -775,11 +2004,15 @@ Zone *ZonedBlockDevice::AllocateZone(Env::WriteLifeTimeHint file_lifetime, bool
 
   bool retry = true;
   int new_zone;
+  uint64_t alloc_start = Env::Default()->NowMicros();
+  uint64_t stall_mark = alloc_start;
 
   LatencyHistGuard guard_actual(reporter_actual);
   t1 = std::chrono::system_clock::now();
   do {
     new_zone = 0;
+    uint32_t threshold = adaptive_finish_ ? finish_controller_.GetThreshold()
+                                          : finish_threshold_;
 
     /* Reset any unused zones and finish used zones under capacity treshold*/
     for (int i = 0; i < io_zones_.size(); i++) {
@@ -799,6 +2032,7 @@ Zone *ZonedBlockDevice::AllocateZone(Env::WriteLifeTimeHint file_lifetime, bool
             if (active) active_io_zones_--;
             z->open_for_write_ = false;
             z->bg_processing_.store(false);
+            UpdateSpacePressure();
           });
           // For wal file, we only reset once.
           // if (is_wal) break;
@@ -806,13 +2040,19 @@ Zone *ZonedBlockDevice::AllocateZone(Env::WriteLifeTimeHint file_lifetime, bool
         }
 
         // Finish a almost FULL zone is costless
-        if (!is_wal &&
-            (z->capacity_ < (z->max_capacity_ * finish_threshold_ / 100))) {
-          /* If there is less than finish_threshold_% remaining capacity in a
+        if ((adaptive_finish_ || !is_wal) &&
+            (z->capacity_ < (z->max_capacity_ * threshold / 100))) {
+          /* If there is less than threshold% remaining capacity in a
            * non-open-zone, finish the zone */
+          uint64_t remaining = z->capacity_;
           z->open_for_write_ = true;
-          data_worker_->SubmitJob([&, z]() {
-            if (!z->Finish().ok()) Warn(logger_, "Failed finishing zone");
+          data_worker_->SubmitJob([&, z, remaining]() {
+            if (!z->Finish().ok()) {
+              Warn(logger_, "Failed finishing zone");
+            } else {
+              finish_controller_.OnFinish(remaining, z->max_capacity_);
+              finish_wasted_throughput_reporter_.AddCount(remaining);
+            }
             active_io_zones_--;
             z->open_for_write_ = false;
             z->bg_processing_.store(false);
@@ -826,43 +2066,70 @@ Zone *ZonedBlockDevice::AllocateZone(Env::WriteLifeTimeHint file_lifetime, bool
     t2 = std::chrono::system_clock::now();
 
     best_diff = LIFETIME_DIFF_NOT_GOOD;
-    /* Try to fill an already open zone(with the best life time diff) */
+    bool fits = false;
+    bool has_empty = false;
+    /* Try to fill an already open zone(with the best life time diff),
+     * preferring zones the rest of the file fits in */
     for (const auto z : io_zones_) {
       if (z->bg_processing_.load()) continue;
       if ((!z->open_for_write_) && (z->used_capacity_ > 0) && !z->IsFull()) {
         unsigned int diff = GetLifeTimeDiff(z->lifetime_, file_lifetime);
-        if (diff <= best_diff) {
+        /* RocksDB overestimates preallocation sizes by 10% */
+        bool z_fits =
+            size_hint == 0 || z->capacity_ >= size_hint - size_hint / 11;
+        if (diff == LIFETIME_DIFF_NOT_GOOD && best_diff < diff) continue;
+        if ((z_fits && !fits && diff < LIFETIME_DIFF_NOT_GOOD) ||
+            (z_fits == fits && diff <= best_diff)) {
           allocated_zone = z;
           best_diff = diff;
+          fits = z_fits;
         }
+      } else if (!z->open_for_write_ && z->IsEmpty()) {
+        has_empty = true;
       }
     }
 
+    long active = active_io_zones_.load();
+    bool can_open = active < max_nr_active_io_zones_ -
+                                 (is_wal ? 0 : reserved_zones);
+
     if (allocated_zone && best_diff < LIFETIME_DIFF_NOT_GOOD) {
-      bool expect = false;
-      if (allocated_zone->open_for_write_.compare_exchange_weak(expect, true)) {
-        retry = false;
-        open_io_zones_++;
-        break;
-      } else {
+      /* Start a file in an empty zone rather than split it, if one can be
+       * opened */
+      if (!fits && has_empty && can_open) {
         allocated_zone = nullptr;
+      } else {
+        bool expect = false;
+        if (allocated_zone->open_for_write_.compare_exchange_weak(expect,
+                                                                  true)) {
+          retry = false;
+          open_io_zones_++;
+          break;
+        } else {
+          allocated_zone = nullptr;
+        }
       }
     }
 
     // If we did not find a good match, allocate an empty one
-    long active = active_io_zones_.load();
+    active = active_io_zones_.load();
     if (active < max_nr_active_io_zones_ - (is_wal ? 0 : reserved_zones)) {
-      for (const auto z : io_zones_) {
-        if (z->bg_processing_.load()) continue;
-        if ((!z->open_for_write_) && z->IsEmpty()) {
-          bool expect = false;
-          if (z->open_for_write_.compare_exchange_weak(expect, true)) {
-            z->lifetime_ = file_lifetime;
-            allocated_zone = z;
-            new_zone = 1;
-            break;
+      /* Spread new zones over the devices, least loaded device first */
+      for (const auto dev : DevicesByLoad()) {
+        for (const auto z : io_zones_) {
+          if (z->GetDevice() != dev) continue;
+          if (z->bg_processing_.load()) continue;
+          if ((!z->open_for_write_) && z->IsEmpty()) {
+            bool expect = false;
+            if (z->open_for_write_.compare_exchange_weak(expect, true)) {
+              z->lifetime_ = file_lifetime;
+              allocated_zone = z;
+              new_zone = 1;
+              break;
+            }
           }
         }
+        if (allocated_zone) break;
       }
       if (allocated_zone) {
         while (new_zone != 0) {
@@ -882,14 +2149,28 @@ Zone *ZonedBlockDevice::AllocateZone(Env::WriteLifeTimeHint file_lifetime, bool
         }
       }
     }
+
+    /* Out of active zones, the adaptive threshold rises while waiting */
+    if (retry) {
+      uint64_t now = Env::Default()->NowMicros();
+      if (now - stall_mark >= ZoneFinishController::kStallUs) {
+        finish_controller_.OnStall();
+        stall_mark = now;
+      }
+    }
   } while (retry);
 
+  finish_controller_.OnAllocation(active_io_zones_.load(),
+                                  max_nr_active_io_zones_,
+                                  Env::Default()->NowMicros() - alloc_start);
+
   Debug(logger_,
         "Allocating zone(new=%d) start: 0x%lx wp: 0x%lx lt: %d file lt: %d\n",
         new_zone, allocated_zone->start_, allocated_zone->wp_,
         allocated_zone->lifetime_, file_lifetime);
 
   LogZoneStats();
+  UpdateSpacePressure();
 
   t3 = std::chrono::system_clock::now();
 
@@ -906,6 +2187,12 @@ Zone *ZonedBlockDevice::AllocateZone(Env::WriteLifeTimeHint file_lifetime, bool
   return allocated_zone;
 }
 
+ZoneFinishStats ZonedBlockDevice::GetFinishStats() {
+  ZoneFinishStats stats = finish_controller_.GetStats();
+  if (!adaptive_finish_) stats.threshold = finish_threshold_;
+  return stats;
+}
+
 std::string ZonedBlockDevice::GetFilename() { return filename_; }
 
 uint32_t ZonedBlockDevice::GetBlockSize() { return block_sz_; }
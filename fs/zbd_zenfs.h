@@ -22,6 +22,7 @@
 #include <condition_variable>
 #include <functional>
 #include <list>
+#include <map>
 #include <mutex>
 #include <sstream>
 #include <string>
@@ -32,25 +33,81 @@
 #include "rocksdb/env.h"
 #include "rocksdb/io_status.h"
 #include "rocksdb/metrics_reporter.h"
+#include "rocksdb/rate_limiter.h"
 #include "zbd_stat.h"
+#include "zone_cache.h"
+#include "zone_fault.h"
+#include "zone_finish.h"
+#include "zone_latency.h"
+#include "zone_uring.h"
 
 namespace ROCKSDB_NAMESPACE {
 
 class ZonedBlockDevice;
+struct ZoneDevice;
 
 struct zenfs_aio_ctx {
   struct iocb iocb;
   struct iocb *iocbs[1];
   io_context_t io_ctx;
-  int inflight;
+  int inflight; /* Bytes of the current write not yet completed */
   int fd;
+  char *buf;       /* Next byte to write */
+  uint64_t offset; /* Device offset of buf */
+};
+
+/* A physically contiguous part of a file read */
+struct ZoneReadFragment {
+  uint64_t dev_off;
+  size_t len;
+  char *dst;
+};
+
+/* An asynchronous read of a set of fragments, submitted through
+ * ZonedBlockDevice::SubmitAsyncRead. The request must stay alive until it is
+ * done, see PollAsyncReads and AbortAsyncReads. */
+struct ZoneAsyncRead {
+  std::vector<ZoneReadFragment> fragments;
+  std::vector<struct iocb> iocbs;
+  std::vector<char *> bounce;   /* Aligned bounce buffer per iocb, or null */
+  std::vector<size_t> frag_idx; /* Fragment read by each iocb */
+  std::vector<ZoneDevice *> devs; /* Device read by each iocb */
+  std::unique_ptr<char[]> buffer; /* Destination owned by the request */
+  size_t inflight = 0;
+  bool done = false;
+  IOStatus status;
+
+  ~ZoneAsyncRead() {
+    for (char *b : bounce) free(b);
+  }
+};
+
+/* One of the zoned block devices spanned by a ZonedBlockDevice. The devices
+ * are concatenated into a single address space in the order they are given:
+ * zone offsets are global and a device holds [base, base + nr_zones * zone
+ * size). Device offsets are global offsets minus base. */
+struct ZoneDevice {
+  std::string filename;
+  int read_f = -1;
+  int read_direct_f = -1;
+  int write_f = -1;
+  uint64_t base = 0;
+  uint32_t nr_zones = 0;
+  uint32_t max_active_zones = 0; /* Io zones that may be active at once */
+  std::unique_ptr<ZonePolledQueue> polled_queue;
+  std::atomic<uint32_t> inflight_reads{0}; /* Read queue depth */
 };
 
 class Zone {
   ZonedBlockDevice *zbd_;
+  ZoneDevice *dev_;
+  ZoneDevice *mirror_dev_; /* Holds a copy at the same offset, or null */
 
  public:
-  explicit Zone(ZonedBlockDevice *zbd, struct zbd_zone *z);
+  /* mz is the zone at the same offset on mirror_dev, if mirrored */
+  explicit Zone(ZonedBlockDevice *zbd, ZoneDevice *dev, struct zbd_zone *z,
+                ZoneDevice *mirror_dev = nullptr,
+                struct zbd_zone *mz = nullptr);
 
   uint64_t start_;
   uint64_t capacity_; /* remaining capacity */
@@ -62,11 +119,19 @@ class Zone {
   std::atomic<long> used_capacity_;
   struct zenfs_aio_ctx wr_ctx;
 
+  /* Counters since mount, see ZoneStat */
+  std::atomic<uint64_t> bytes_written_;
+  std::atomic<uint64_t> bytes_invalidated_;
+  std::atomic<time_t> last_write_time_;
+  std::atomic<time_t> last_delete_time_;
+
   IOStatus Reset();
   IOStatus Finish();
   IOStatus Close();
 
-  IOStatus Append(char *data, uint32_t size);
+  /* Polled writes go through the device's polled queue, see
+   * ZonedBlockDevice::EnablePolledWAL */
+  IOStatus Append(char *data, uint32_t size, bool polled = false);
   IOStatus Append_async(char *data, uint32_t size);
   IOStatus Sync();
   bool IsUsed();
@@ -74,10 +139,45 @@ class Zone {
   bool IsEmpty();
   uint64_t GetZoneNr();
   uint64_t GetCapacityLeft();
+  ZoneDevice *GetDevice() { return dev_; }
+  ZoneDevice *GetMirrorDevice() { return mirror_dev_; }
+
+  /* Account for a live file extent in this zone. Files linked to each
+   * other share their extents, an extent that is already live only gets
+   * another reference and is accounted for once. */
+  void AddExtent(uint64_t start, uint64_t length,
+                 Env::WriteLifeTimeHint lifetime, time_t ctime);
+  void RemoveExtent(uint64_t start, uint64_t length);
+  /* Grow a live extent that was appended to in place. If the extent is
+   * shared, the other files keep the old length and the grown extent is
+   * accounted for separately. */
+  void ExtendExtent(uint64_t start, uint64_t length, uint64_t new_length);
+  /* Number of files referencing the extent, zero if it is not live */
+  uint32_t GetExtentRefs(uint64_t start, uint64_t length);
+  void GetStat(ZoneStat *stat);
 
   void EncodeJson(std::ostream &json_stream);
 
   void CloseWR(); /* Done writing */
+
+ private:
+  IOStatus SubmitWrite();
+  IOStatus WriteMirror(const char *data, uint32_t size, uint64_t offset,
+                       bool polled);
+
+  struct LiveExtent {
+    uint64_t length;
+    Env::WriteLifeTimeHint lifetime;
+    time_t ctime;
+    uint32_t refs;
+  };
+
+  /* Live extents by start. Recovery decodes file updates into temporary
+   * files, which reference the extents of the file they update until they
+   * are merged. */
+  std::multimap<uint64_t, LiveExtent> live_extents_;
+  uint64_t lifetime_bytes_[Env::WLTH_EXTREME + 1];
+  std::mutex live_extents_mtx_;
 };
 
 // Abstract class as interface.
@@ -145,18 +245,49 @@ class ZonedBlockDevice {
   uint64_t zone_sz_;
   uint32_t nr_zones_;
   std::vector<Zone *> io_zones_;
+  /* Io zones by zone number, null for zones that are not io zones */
+  std::vector<Zone *> io_zones_by_nr_;
   std::mutex io_zones_mtx_;
   std::mutex wal_zones_mtx_;
   // meta log zones used to keep track of running record of metadata
   std::vector<Zone *> op_zones_;
+  // op log zones of additional op log streams, reserved from the io zones
+  std::vector<std::vector<Zone *>> extra_op_zones_;
   // snapshot zones used to recover entire file system
   std::vector<Zone *> snapshot_zones_;
-  int read_f_;
-  int read_direct_f_;
-  int write_f_;
+  std::vector<std::unique_ptr<ZoneDevice>> devices_;
+  /* Copy of the first device in mirror mode, see the constructor */
+  std::unique_ptr<ZoneDevice> mirror_;
+  bool polled_wal_ = false;
+  /* Zones claimed by this file system, see the constructor */
+  uint32_t range_first_ = 0;
+  uint32_t range_nr_ = 0;
+  std::shared_ptr<RateLimiter> rate_limiter_;
+  char *mapping_ = nullptr; /* Read-only mapping of the device, see Map() */
+  std::mutex mapping_mtx_;
   time_t start_time_;
   std::shared_ptr<Logger> logger_;
   uint32_t finish_threshold_ = 0;
+  bool adaptive_finish_ = false;
+  ZoneFinishController finish_controller_;
+
+  uint32_t pressure_low_pct_ = 20;
+  uint32_t pressure_high_pct_ = 10;
+  uint32_t pressure_critical_pct_ = 5;
+  ZoneSpacePressure space_pressure_ = ZoneSpacePressure::kNone;
+  std::function<void(const ZoneSpaceInfo &)> space_pressure_listener_;
+  std::mutex space_pressure_mtx_; /* Serializes level changes */
+
+  std::unique_ptr<ZoneReadCache> read_cache_;
+  std::shared_ptr<ZoneFaultInjector> fault_injector_;
+
+  io_context_t read_aio_ctx_ = 0;
+  bool read_aio_reaping_ = false;
+  std::mutex read_aio_mtx_; /* Protects async read request state */
+  std::condition_variable read_aio_cv_;
+  /* Hedged reads that lost the race, freed once they are done */
+  std::vector<std::unique_ptr<ZoneAsyncRead>> abandoned_reads_;
+  std::unique_ptr<ZoneLatencyTracker> hedge_latency_;
 
   std::atomic<long> active_io_zones_;
   std::atomic<long> open_io_zones_;
@@ -168,6 +299,27 @@ class ZonedBlockDevice {
   void EncodeJsonZone(std::ostream &json_stream,
                       const std::vector<Zone *> zones);
 
+  /* Recompute the space pressure, notifying the listener of changes */
+  void UpdateSpacePressure();
+
+  /* Devices are opened exclusively unless the file system uses a zone
+   * range, ranges are claimed with ClaimZoneRange instead */
+  IOStatus OpenDevice(ZoneDevice *dev, bool readonly, bool exclusive,
+                      zbd_info *info);
+  /* Lock the zones of the range on dev, so that no other file system on
+   * the device, in this process or another, mounts the same zones */
+  IOStatus ClaimZoneRange(ZoneDevice *dev, uint64_t dev_first);
+  std::vector<ZoneDevice *> DevicesByLoad();
+
+  IOStatus ReadRun(const ZoneReadFragment *run, size_t nr_fragments,
+                   bool direct, ZoneDevice *dev);
+  IOStatus HedgedReadRun(const ZoneReadFragment *run, size_t nr_fragments);
+  /* The copy of dev with the fewest reads in flight */
+  ZoneDevice *PickReadDevice(ZoneDevice *dev);
+  void CompleteAsyncReadLocked(ZoneAsyncRead *req, struct iocb *iocb,
+                               long res);
+  void ReapAbandonedReadsLocked();
+
  public:
   std::mutex zone_resources_mtx_; /* Protects active/open io zones */
 
@@ -175,6 +327,20 @@ class ZonedBlockDevice {
   std::condition_variable metazone_reset_cv_;
 
  public:
+  /* bdevname may be a comma separated list of devices, which are spanned
+   * by a single address space, see ZoneDevice. The devices must share the
+   * block and zone size and be given in the same order on every open. The
+   * metadata zones are the first zones of the address space.
+   *
+   * "mirror:<primary>,<mirror>" mirrors two devices instead: every zone of
+   * the primary is paired with the zone at the same offset on the mirror,
+   * writes go to both and reads to whichever has fewer reads in flight.
+   *
+   * A "@<first zone>+<nr zones>" suffix restricts the file system to a range
+   * of zones, metadata zones included, so that several file systems can
+   * share a device. Their active zone limits must add up to no more than
+   * the device's, by default every range gets a share proportional to its
+   * size. */
   explicit ZonedBlockDevice(std::string bdevname,
                             std::shared_ptr<Logger> logger);
   explicit ZonedBlockDevice(
@@ -187,10 +353,49 @@ class ZonedBlockDevice {
   IOStatus Open(bool readonly = false);
   IOStatus CheckScheduler();
 
-  Zone *GetIOZone(uint64_t offset);
+  /* The device holding offset */
+  ZoneDevice *GetDevice(uint64_t offset) {
+    for (auto it = devices_.rbegin(); it != devices_.rend(); ++it)
+      if ((*it)->base <= offset) return it->get();
+    return devices_.front().get();
+  }
+  uint32_t GetNrDevices() { return devices_.size(); }
+  /* The claimed zone range, the whole address space without a range */
+  uint32_t GetRangeFirstZone() { return range_first_; }
+  uint32_t GetRangeNrZones() { return range_nr_; }
+
+  Zone *GetIOZone(uint64_t offset) { return GetIOZoneByNr(offset / zone_sz_); }
+  Zone *GetIOZoneByNr(uint64_t zone_nr) {
+    if (zone_nr >= io_zones_by_nr_.size()) return nullptr;
+    return io_zones_by_nr_[zone_nr];
+  }
 
-  Zone *AllocateZone(Env::WriteLifeTimeHint lifetime, bool is_wal);
-  Zone *AllocateMetaZone();
+  /* Read all fragments, serving what is possible from the read cache and
+   * coalescing physically adjacent fragments into one vectored read. Direct
+   * reads stay on the direct path, unaligned heads and tails are read
+   * through aligned bounce buffers. */
+  IOStatus Read(const std::vector<ZoneReadFragment> &fragments, bool direct);
+
+  /* Queue the fragments of req for reading on the device's read completion
+   * queue. Cache hits are served immediately and whatever cannot be queued
+   * is read synchronously, so req may be done on return. Fragments are
+   * read from dev if given, from the least loaded copy otherwise. */
+  IOStatus SubmitAsyncRead(ZoneAsyncRead *req, bool direct,
+                           ZoneDevice *dev = nullptr);
+  /* Wait until at least min_completions of reqs are done. Returns TimedOut
+   * if timeout_us is not 0 and that did not happen within it. */
+  IOStatus PollAsyncReads(const std::vector<ZoneAsyncRead *> &reqs,
+                          size_t min_completions, uint64_t timeout_us = 0);
+  /* Try to cancel the outstanding reads of reqs and wait for the ones that
+   * could not be cancelled. Cancelled requests fail with an IOError. */
+  IOStatus AbortAsyncReads(const std::vector<ZoneAsyncRead *> &reqs);
+
+  /* size_hint is the number of bytes the file is expected to write. An
+   * empty zone is preferred over a partly written one the file would not
+   * fit in, 0 if unknown. */
+  Zone *AllocateZone(Env::WriteLifeTimeHint lifetime, bool is_wal,
+                     uint64_t size_hint = 0);
+  Zone *AllocateMetaZone(uint32_t stream = 0);
   Zone *AllocateSnapshotZone();
 
   uint64_t GetFreeSpace();
@@ -198,6 +403,24 @@ class ZonedBlockDevice {
   uint64_t GetReclaimableSpace();
   void ReportSpaceUtilization();
 
+  /* Space pressure is graded by the free space left, in percent of the io
+   * zone capacity: below low_pct it is low, below high_pct high and below
+   * critical_pct critical. It is at least high when no more than two zones
+   * are empty, and one level up while the reclaimable space exceeds the
+   * free space, as that only comes back once files are deleted. */
+  ZoneSpaceInfo GetSpaceInfo();
+  void SetSpacePressureThresholds(uint32_t low_pct, uint32_t high_pct,
+                                  uint32_t critical_pct);
+  /* Called with the new space info whenever the pressure level changes, so
+   * that writers can be slowed down before allocations run out of zones.
+   * Runs in allocation and zone reset paths, it must not block or write to
+   * the file system. */
+  void SetSpacePressureListener(
+      std::function<void(const ZoneSpaceInfo &)> listener);
+
+  /* Zone capacity and the zones used by each write lifetime */
+  ZoneGeometry GetGeometry();
+
   std::string GetFilename();
   uint32_t GetBlockSize();
 
@@ -205,9 +428,16 @@ class ZonedBlockDevice {
   void LogZoneStats();
   void LogZoneUsage();
 
-  int GetReadFD() { return read_f_; }
-  int GetReadDirectFD() { return read_direct_f_; }
-  int GetWriteFD() { return write_f_; }
+  /* Map the whole device read-only through the page cache, the mapping is
+   * created on first use and lives as long as the device. Returns null if
+   * the device cannot be mapped. Direct writes and zone resets invalidate
+   * the cached pages, so the mapping sees the same data as buffered reads. */
+  const char *Map();
+
+  /* File descriptors of the first device */
+  int GetReadFD() { return devices_.front()->read_f; }
+  int GetReadDirectFD() { return devices_.front()->read_direct_f; }
+  int GetWriteFD() { return devices_.front()->write_f; }
 
   uint64_t GetZoneSize() { return zone_sz_; }
   uint32_t GetNrZones() { return nr_zones_; }
@@ -215,9 +445,65 @@ class ZonedBlockDevice {
   uint32_t GetMaxOpenZones() { return max_nr_open_io_zones_ + 1; };
 
   std::vector<Zone *> GetOpZones() { return op_zones_; }
+  std::vector<Zone *> GetOpZones(uint32_t stream);
+  /* Move the zones of op log streams 1..nr_streams-1 out of the io zones,
+   * taking them from the end of the zone range. Must be done before any files
+   * are recovered. */
+  IOStatus ReserveOpStreamZones(uint32_t nr_streams);
   std::vector<Zone *> GetSnapshotZones() { return snapshot_zones_; }
 
   void SetFinishTreshold(uint32_t threshold) { finish_threshold_ = threshold; }
+  /* Adapt the finish threshold to the active zone pressure, up to
+   * max_threshold percent, instead of using the static threshold from the
+   * superblock, see ZoneFinishController. Finishing then also applies to
+   * WAL allocations. */
+  void EnableAdaptiveFinish(uint32_t max_threshold) {
+    finish_controller_.SetMaxThreshold(max_threshold);
+    adaptive_finish_ = true;
+  }
+  /* Capacity lost to finishing zones, tracked with either policy */
+  ZoneFinishStats GetFinishStats();
+
+  /* Write WAL data through a polled io_uring queue instead of pwrite, so
+   * WAL syncs do not wait for interrupts, see ZonePolledQueue. sqpoll adds
+   * a submission queue poller thread, bound to sq_cpu if not negative.
+   * Returns NotSupported if ZenFS was built without ZENFS_IO_URING. Must be
+   * called before any WAL files are written. */
+  IOStatus EnablePolledWAL(bool sqpoll = false, int sq_cpu = -1);
+  bool IsPolledWAL() { return polled_wal_; }
+
+  /* Limit the bandwidth of io zone appends. WAL appends are requested at
+   * high priority, all others at low priority, so a limiter shared by
+   * several file systems keeps compactions from starving WAL writes. */
+  void SetRateLimiter(std::shared_ptr<RateLimiter> limiter) {
+    rate_limiter_ = limiter;
+  }
+  RateLimiter *GetRateLimiter() { return rate_limiter_.get(); }
+  /* Wait for the rate limiter to admit an append of size bytes */
+  void ThrottleWrite(uint64_t size, bool is_wal);
+
+  bool IsMirrored() { return mirror_ != nullptr; }
+  /* Reissue a direct read to the mirror when it takes longer than the given
+   * percentile of recent read latencies, and use whichever copy completes
+   * first. Needs mirror mode and must be called before any reads. */
+  IOStatus EnableHedgedReads(double percentile);
+
+  /* Cache recently written io zone data in memory, 0 disables the cache.
+   * Must be set before any files are opened. */
+  void SetReadCacheSize(uint64_t cache_size) {
+    if (cache_size == 0)
+      read_cache_.reset();
+    else
+      read_cache_.reset(new ZoneReadCache(cache_size));
+  }
+  ZoneReadCache *GetReadCache() { return read_cache_.get(); }
+
+  /* Route all zone writes through a fault injector, for testing only. Must
+   * be set before the file system is mounted. */
+  void SetFaultInjector(std::shared_ptr<ZoneFaultInjector> injector) {
+    fault_injector_ = injector;
+  }
+  ZoneFaultInjector *GetFaultInjector() { return fault_injector_.get(); }
 
   bool SetMaxActiveZones(uint32_t max_active) {
     if (max_active == 0) /* No limit */
@@ -247,6 +533,9 @@ class ZonedBlockDevice {
   void EncodeJson(std::ostream &json_stream);
 
   std::vector<ZoneStat> GetStat();
+  /* Like GetStat, but hands out one zone at a time instead of building the
+   * complete vector */
+  void ForEachZoneStat(const std::function<void(const ZoneStat &)> &fn);
 
   std::string bytedance_tags_;
   std::shared_ptr<CurriedMetricsReporterFactory> metrics_reporter_factory_;
@@ -256,6 +545,7 @@ class ZonedBlockDevice {
   LatencyReporter read_latency_reporter_;
   LatencyReporter fg_sync_latency_reporter_;
   LatencyReporter bg_sync_latency_reporter_;
+  LatencyReporter polled_sync_latency_reporter_; /* WAL syncs, polled */
   LatencyReporter meta_alloc_latency_reporter_;
   LatencyReporter io_alloc_wal_latency_reporter_;
   LatencyReporter io_alloc_non_wal_latency_reporter_;
@@ -266,6 +556,8 @@ class ZonedBlockDevice {
   using QPSReporter = CountReporterHandle &;
   QPSReporter write_qps_reporter_;
   QPSReporter read_qps_reporter_;
+  QPSReporter read_cache_hit_qps_reporter_;
+  QPSReporter hedged_read_qps_reporter_;
   QPSReporter sync_qps_reporter_;
   QPSReporter meta_alloc_qps_reporter_;
   QPSReporter io_alloc_qps_reporter_;
@@ -274,6 +566,7 @@ class ZonedBlockDevice {
   using ThroughputReporter = CountReporterHandle &;
   ThroughputReporter write_throughput_reporter_;
   ThroughputReporter roll_throughput_reporter_;
+  ThroughputReporter finish_wasted_throughput_reporter_;
 
   using DataReporter = HistReporterHandle &;
   DataReporter active_zones_reporter_;
@@ -0,0 +1,128 @@
+// Copyright (c) 2019-present, Western Digital Corporation
+//  This source code is licensed under both the GPLv2 (found in the
+//  COPYING file in the root directory) and Apache 2.0 License
+//  (found in the LICENSE.Apache file in the root directory).
+
+#if !defined(ROCKSDB_LITE) && !defined(OS_WIN)
+
+#include "zone_cache.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <iterator>
+
+namespace ROCKSDB_NAMESPACE {
+
+ZoneReadCache::ZoneReadCache(uint64_t capacity) : capacity_(capacity) {}
+
+ZoneReadCache::~ZoneReadCache() {
+  for (auto& e : entries_) free(e.second.data);
+}
+
+void ZoneReadCache::EraseLocked(std::map<uint64_t, Entry>::iterator it) {
+  usage_ -= it->second.size;
+  free(it->second.data);
+  entries_.erase(it);
+}
+
+/* CLOCK eviction: the hand sweeps the entries in device offset order, giving
+ * referenced entries a second chance */
+void ZoneReadCache::EvictLocked(uint64_t needed) {
+  while (!entries_.empty() && (usage_ + needed) > capacity_) {
+    auto it = entries_.lower_bound(clock_hand_);
+    if (it == entries_.end()) it = entries_.begin();
+
+    clock_hand_ = it->first + 1;
+    if (it->second.referenced) {
+      it->second.referenced = false;
+    } else {
+      EraseLocked(it);
+    }
+  }
+}
+
+void ZoneReadCache::Insert(uint64_t offset, const char* data, uint64_t size) {
+  if (size > capacity_) return;
+
+  std::lock_guard<std::mutex> lock(mtx_);
+
+  while (size) {
+    uint64_t len = std::min(size, kMaxEntrySize);
+
+    /* Drop stale entries overlapping the new data */
+    auto it = entries_.upper_bound(offset);
+    if (it != entries_.begin()) {
+      auto prev = std::prev(it);
+      if (prev->first + prev->second.size > offset) EraseLocked(prev);
+    }
+    it = entries_.lower_bound(offset);
+    while (it != entries_.end() && it->first < offset + len) {
+      auto next = std::next(it);
+      EraseLocked(it);
+      it = next;
+    }
+
+    EvictLocked(len);
+
+    char* buf = (char*)malloc(len);
+    if (buf == nullptr) return;
+    memcpy(buf, data, len);
+
+    entries_[offset] = Entry{buf, len, false};
+    usage_ += len;
+
+    offset += len;
+    data += len;
+    size -= len;
+  }
+}
+
+bool ZoneReadCache::Lookup(uint64_t offset, uint64_t size, char* scratch) {
+  std::lock_guard<std::mutex> lock(mtx_);
+  uint64_t pos = offset;
+  uint64_t end = offset + size;
+
+  while (pos < end) {
+    auto it = entries_.upper_bound(pos);
+    if (it == entries_.begin()) break;
+    --it;
+
+    uint64_t entry_end = it->first + it->second.size;
+    if (pos >= entry_end) break;
+
+    uint64_t n = std::min(end, entry_end) - pos;
+    memcpy(scratch + (pos - offset), it->second.data + (pos - it->first), n);
+    it->second.referenced = true;
+    pos += n;
+  }
+
+  if (pos != end) {
+    misses_++;
+    return false;
+  }
+
+  hits_++;
+  return true;
+}
+
+void ZoneReadCache::Invalidate(uint64_t start, uint64_t size) {
+  std::lock_guard<std::mutex> lock(mtx_);
+
+  auto it = entries_.upper_bound(start);
+  if (it != entries_.begin()) {
+    auto prev = std::prev(it);
+    if (prev->first + prev->second.size > start) EraseLocked(prev);
+  }
+  it = entries_.lower_bound(start);
+  while (it != entries_.end() && it->first < start + size) {
+    auto next = std::next(it);
+    EraseLocked(it);
+    it = next;
+  }
+}
+
+}  // namespace ROCKSDB_NAMESPACE
+
+#endif  // !defined(ROCKSDB_LITE) && !defined(OS_WIN)
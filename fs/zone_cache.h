@@ -0,0 +1,69 @@
+// Copyright (c) 2019-present, Western Digital Corporation
+//  This source code is licensed under both the GPLv2 (found in the
+//  COPYING file in the root directory) and Apache 2.0 License
+//  (found in the LICENSE.Apache file in the root directory).
+
+#pragma once
+
+#if !defined(ROCKSDB_LITE) && defined(OS_LINUX)
+
+#include <stdint.h>
+
+#include <atomic>
+#include <map>
+#include <mutex>
+
+namespace ROCKSDB_NAMESPACE {
+
+/* Write-through cache for recently written io zone data.
+ *
+ * Entries are keyed by device offset, which identifies both the zone and the
+ * offset within the zone. Data is inserted as it is appended to a zone and is
+ * dropped when the zone is reset. Memory usage is bounded by the capacity
+ * given at creation, entries are evicted using the CLOCK algorithm.
+ */
+class ZoneReadCache {
+ public:
+  /* Writes larger than this are split into multiple entries */
+  static const uint64_t kMaxEntrySize = 1024 * 1024;
+
+  explicit ZoneReadCache(uint64_t capacity);
+  ~ZoneReadCache();
+
+  void Insert(uint64_t offset, const char* data, uint64_t size);
+
+  /* Returns true and copies the data into scratch if the complete range
+   * [offset, offset + size) is cached */
+  bool Lookup(uint64_t offset, uint64_t size, char* scratch);
+
+  /* Drop all entries in [start, start + size) */
+  void Invalidate(uint64_t start, uint64_t size);
+
+  uint64_t GetCapacity() { return capacity_; }
+  uint64_t GetUsage() { return usage_; }
+  uint64_t GetHits() { return hits_; }
+  uint64_t GetMisses() { return misses_; }
+
+ private:
+  struct Entry {
+    char* data;
+    uint64_t size;
+    bool referenced;
+  };
+
+  void EvictLocked(uint64_t needed);
+  void EraseLocked(std::map<uint64_t, Entry>::iterator it);
+
+  const uint64_t capacity_;
+  uint64_t usage_ = 0;
+  uint64_t clock_hand_ = 0;
+  std::map<uint64_t, Entry> entries_;
+  std::mutex mtx_;
+
+  std::atomic<uint64_t> hits_{0};
+  std::atomic<uint64_t> misses_{0};
+};
+
+}  // namespace ROCKSDB_NAMESPACE
+
+#endif  // !defined(ROCKSDB_LITE) && defined(OS_LINUX)
@@ -0,0 +1,58 @@
+// Copyright (c) 2019-present, Western Digital Corporation
+//  This source code is licensed under both the GPLv2 (found in the
+//  COPYING file in the root directory) and Apache 2.0 License
+//  (found in the LICENSE.Apache file in the root directory).
+
+#if !defined(ROCKSDB_LITE) && !defined(OS_WIN)
+
+#include "zone_fault.h"
+
+#include <unistd.h>
+
+namespace ROCKSDB_NAMESPACE {
+
+void ZoneFaultInjector::SetCrashPoint(uint64_t write_nr, FaultType type) {
+  std::lock_guard<std::mutex> lock(mtx_);
+  crash_write_nr_ = write_nr;
+  crash_type_ = type;
+}
+
+IOStatus ZoneFaultInjector::BeforeWrite(uint32_t size, uint32_t block_size,
+                                        uint32_t* len) {
+  if (write_delay_us_) usleep(write_delay_us_);
+
+  std::lock_guard<std::mutex> lock(mtx_);
+
+  *len = 0;
+  if (power_lost_) return IOStatus::OK();
+
+  *len = size;
+  if (++writes_ == crash_write_nr_ && crash_type_ != kNone) {
+    fault_injected_ = true;
+    switch (crash_type_) {
+      case kFail:
+        *len = 0;
+        return IOStatus::IOError("Injected write failure");
+      case kDrop:
+        power_lost_ = true;
+        *len = 0;
+        return IOStatus::OK();
+      case kTear:
+        /* The device keeps whole blocks only */
+        power_lost_ = true;
+        *len = (size / 2 / block_size) * block_size;
+        return IOStatus::OK();
+      case kNone:
+        break;
+    }
+  }
+
+  if (short_writes_ && size > block_size)
+    *len = ((size / 2 + block_size - 1) / block_size) * block_size;
+
+  return IOStatus::OK();
+}
+
+}  // namespace ROCKSDB_NAMESPACE
+
+#endif  // !defined(ROCKSDB_LITE) && !defined(OS_WIN)
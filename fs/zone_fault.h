@@ -0,0 +1,74 @@
+// Copyright (c) 2019-present, Western Digital Corporation
+//  This source code is licensed under both the GPLv2 (found in the
+//  COPYING file in the root directory) and Apache 2.0 License
+//  (found in the LICENSE.Apache file in the root directory).
+
+#pragma once
+
+#if !defined(ROCKSDB_LITE) && defined(OS_LINUX)
+
+#include <stdint.h>
+
+#include <atomic>
+#include <mutex>
+
+#include "rocksdb/io_status.h"
+
+namespace ROCKSDB_NAMESPACE {
+
+/* Fault injection for zone writes, used to test crash consistency.
+ *
+ * Writes are numbered from 1 in submission order. When the write selected by
+ * SetCrashPoint is reached, the configured fault is injected. After a power
+ * loss no data reaches the device anymore: writes, resets, finishes and
+ * closes only update the in-memory zone state, so the file system carries on
+ * as if nothing happened while the device keeps the state at the time of the
+ * crash. A new device instance without an injector sees what would have
+ * survived the power loss.
+ *
+ * One injector may be shared by several device instances to keep counting
+ * writes across remounts.
+ */
+class ZoneFaultInjector {
+ public:
+  enum FaultType {
+    kNone = 0,
+    kFail, /* The write fails with an IO error, nothing is written */
+    kDrop, /* Power is lost before the write reaches the device */
+    kTear, /* Power is lost after part of the write reached the device */
+  };
+
+  ZoneFaultInjector() {}
+
+  void SetCrashPoint(uint64_t write_nr, FaultType type);
+  /* Complete at most half of every write larger than a block, the remainder
+   * has to be resubmitted by the writer */
+  void SetShortWrites(bool short_writes) { short_writes_ = short_writes; }
+  /* Delay every write by the given number of microseconds */
+  void SetWriteDelay(uint64_t usecs) { write_delay_us_ = usecs; }
+
+  /* Called before a write of size bytes. Returns an error for an injected
+   * write failure. Otherwise *len is set to the number of bytes to write
+   * now, which is less than size for short and torn writes. A *len of zero
+   * means the power has been lost and the write must be skipped, but
+   * reported as complete. */
+  IOStatus BeforeWrite(uint32_t size, uint32_t block_size, uint32_t* len);
+
+  bool PowerLost() { return power_lost_; }
+  bool FaultInjected() { return fault_injected_; }
+  uint64_t GetWrites() { return writes_; }
+
+ private:
+  std::mutex mtx_;
+  uint64_t writes_ = 0;
+  uint64_t crash_write_nr_ = 0;
+  FaultType crash_type_ = kNone;
+  std::atomic<bool> power_lost_{false};
+  std::atomic<bool> fault_injected_{false};
+  std::atomic<bool> short_writes_{false};
+  std::atomic<uint64_t> write_delay_us_{0};
+};
+
+}  // namespace ROCKSDB_NAMESPACE
+
+#endif  // !defined(ROCKSDB_LITE) && defined(OS_LINUX)
@@ -0,0 +1,77 @@
+// Copyright (c) 2019-present, Western Digital Corporation
+//  This source code is licensed under both the GPLv2 (found in the
+//  COPYING file in the root directory) and Apache 2.0 License
+//  (found in the LICENSE.Apache file in the root directory).
+
+#if !defined(ROCKSDB_LITE) && !defined(OS_WIN)
+
+#include "zone_finish.h"
+
+#include <algorithm>
+
+namespace ROCKSDB_NAMESPACE {
+
+ZoneFinishController::ZoneFinishController(uint32_t max_threshold)
+    : max_threshold_(std::min(max_threshold, (uint32_t)100)) {}
+
+void ZoneFinishController::SetMaxThreshold(uint32_t max_threshold) {
+  std::lock_guard<std::mutex> lock(mtx_);
+  max_threshold_ = std::min(max_threshold, (uint32_t)100);
+  if (threshold_.load(std::memory_order_relaxed) > max_threshold_)
+    threshold_.store(max_threshold_, std::memory_order_relaxed);
+}
+
+void ZoneFinishController::RaiseLocked() {
+  uint32_t t = threshold_.load(std::memory_order_relaxed);
+  threshold_.store(std::min(t + kStep, max_threshold_.load()),
+                   std::memory_order_relaxed);
+}
+
+void ZoneFinishController::OnStall() {
+  std::lock_guard<std::mutex> lock(mtx_);
+  stalls_++;
+  RaiseLocked();
+}
+
+void ZoneFinishController::OnAllocation(long active, long max_active,
+                                        uint64_t wait_us) {
+  std::lock_guard<std::mutex> lock(mtx_);
+  uint32_t t = threshold_.load(std::memory_order_relaxed);
+  long occupancy = max_active > 0 ? active * 100 / max_active : 100;
+
+  /* Stalls were already acted on by OnStall */
+  if (wait_us >= kStallUs) return;
+
+  if (occupancy >= kHighOccupancy) {
+    RaiseLocked();
+  } else if (occupancy <= kLowOccupancy) {
+    threshold_.store(t > kStep ? t - kStep : 0, std::memory_order_relaxed);
+  } else if (t > 0 && waste_pct_ > t / 2) {
+    threshold_.store(t - 1, std::memory_order_relaxed);
+  }
+}
+
+void ZoneFinishController::OnFinish(uint64_t remaining,
+                                    uint64_t max_capacity) {
+  std::lock_guard<std::mutex> lock(mtx_);
+  uint32_t pct = max_capacity ? (uint32_t)(remaining * 100 / max_capacity) : 0;
+
+  finishes_++;
+  wasted_bytes_ += remaining;
+  waste_pct_ = (waste_pct_ * 7 + pct) / 8;
+}
+
+ZoneFinishStats ZoneFinishController::GetStats() {
+  std::lock_guard<std::mutex> lock(mtx_);
+  ZoneFinishStats stats;
+
+  stats.threshold = threshold_.load(std::memory_order_relaxed);
+  stats.finishes = finishes_;
+  stats.wasted_bytes = wasted_bytes_;
+  stats.stalls = stalls_;
+  return stats;
+}
+
+}  // namespace ROCKSDB_NAMESPACE
+
+#endif  // !defined(ROCKSDB_LITE) && !defined(OS_WIN)
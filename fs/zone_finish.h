@@ -0,0 +1,69 @@
+// Copyright (c) 2019-present, Western Digital Corporation
+//  This source code is licensed under both the GPLv2 (found in the
+//  COPYING file in the root directory) and Apache 2.0 License
+//  (found in the LICENSE.Apache file in the root directory).
+
+#pragma once
+
+#if !defined(ROCKSDB_LITE) && defined(OS_LINUX)
+
+#include <stdint.h>
+
+#include <atomic>
+#include <mutex>
+
+#include "zbd_stat.h"
+
+namespace ROCKSDB_NAMESPACE {
+
+/* Adapts the zone finish threshold to the active zone pressure.
+ *
+ * Finishing a zone that is not being written frees its active zone, but
+ * its remaining capacity is lost until the zone is reset. The threshold is
+ * the remaining capacity, in percent of the zone capacity, below which such
+ * zones are finished. It is raised by kStep whenever an allocation waits
+ * kStallUs for an active zone or finds active zones nearly exhausted, and
+ * lowered by kStep when at most kLowOccupancy percent of them are in use.
+ * In between it backs off slowly while finished zones give up more than
+ * half of what the threshold allows.
+ */
+class ZoneFinishController {
+ public:
+  static const uint32_t kStep = 5;
+  static const uint32_t kHighOccupancy = 90; /* percent of active zones */
+  static const uint32_t kLowOccupancy = 50;
+  static const uint64_t kStallUs = 1000;
+
+  /* The threshold stays within [0, max_threshold] */
+  explicit ZoneFinishController(uint32_t max_threshold = 0);
+  void SetMaxThreshold(uint32_t max_threshold);
+
+  uint32_t GetThreshold() {
+    return threshold_.load(std::memory_order_relaxed);
+  }
+
+  /* An allocation is still waiting for an active zone after kStallUs */
+  void OnStall();
+  /* An allocation completed with active of max_active zones in use after
+   * waiting wait_us */
+  void OnAllocation(long active, long max_active, uint64_t wait_us);
+  /* A zone was finished with remaining of max_capacity bytes unwritten */
+  void OnFinish(uint64_t remaining, uint64_t max_capacity);
+
+  ZoneFinishStats GetStats();
+
+ private:
+  void RaiseLocked();
+
+  std::atomic<uint32_t> max_threshold_;
+  std::atomic<uint32_t> threshold_{0};
+  std::mutex mtx_;
+  uint32_t waste_pct_ = 0; /* Moving average over recent finishes */
+  uint64_t finishes_ = 0;
+  uint64_t wasted_bytes_ = 0;
+  uint64_t stalls_ = 0;
+};
+
+}  // namespace ROCKSDB_NAMESPACE
+
+#endif  // !defined(ROCKSDB_LITE) && defined(OS_LINUX)
@@ -0,0 +1,42 @@
+// Copyright (c) 2019-present, Western Digital Corporation
+//  This source code is licensed under both the GPLv2 (found in the
+//  COPYING file in the root directory) and Apache 2.0 License
+//  (found in the LICENSE.Apache file in the root directory).
+
+#if !defined(ROCKSDB_LITE) && !defined(OS_WIN)
+
+#include "zone_latency.h"
+
+#include <algorithm>
+
+namespace ROCKSDB_NAMESPACE {
+
+ZoneLatencyTracker::ZoneLatencyTracker(double percentile)
+    : percentile_(percentile) {
+  samples_.reserve(kWindow);
+}
+
+void ZoneLatencyTracker::Record(uint64_t latency_us) {
+  std::lock_guard<std::mutex> lock(mtx_);
+
+  if (samples_.size() < kWindow) {
+    samples_.push_back(latency_us);
+  } else {
+    samples_[next_] = latency_us;
+    next_ = (next_ + 1) % kWindow;
+  }
+
+  nr_samples_++;
+  if (nr_samples_ < kMinSamples || (nr_samples_ % kUpdateInterval) != 0)
+    return;
+
+  std::vector<uint64_t> sorted(samples_);
+  size_t idx = (size_t)(sorted.size() * percentile_ / 100);
+  if (idx >= sorted.size()) idx = sorted.size() - 1;
+  std::nth_element(sorted.begin(), sorted.begin() + idx, sorted.end());
+  value_.store(sorted[idx], std::memory_order_relaxed);
+}
+
+}  // namespace ROCKSDB_NAMESPACE
+
+#endif  // !defined(ROCKSDB_LITE) && !defined(OS_WIN)
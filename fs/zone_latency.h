@@ -0,0 +1,48 @@
+// Copyright (c) 2019-present, Western Digital Corporation
+//  This source code is licensed under both the GPLv2 (found in the
+//  COPYING file in the root directory) and Apache 2.0 License
+//  (found in the LICENSE.Apache file in the root directory).
+
+#pragma once
+
+#if !defined(ROCKSDB_LITE) && defined(OS_LINUX)
+
+#include <stdint.h>
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+namespace ROCKSDB_NAMESPACE {
+
+/* Tracks a percentile of recent latencies.
+ *
+ * Latencies are kept in a window of the last kWindow samples and the
+ * percentile is recomputed every kUpdateInterval samples, so reading it is a
+ * single atomic load. The percentile is 0 until kMinSamples latencies were
+ * recorded.
+ */
+class ZoneLatencyTracker {
+ public:
+  static const size_t kWindow = 1024;
+  static const size_t kMinSamples = 256;
+  static const size_t kUpdateInterval = 64;
+
+  /* percentile is in (0, 100) */
+  explicit ZoneLatencyTracker(double percentile);
+
+  void Record(uint64_t latency_us);
+  uint64_t GetPercentile() { return value_.load(std::memory_order_relaxed); }
+
+ private:
+  const double percentile_;
+  std::vector<uint64_t> samples_;
+  size_t next_ = 0;
+  uint64_t nr_samples_ = 0;
+  std::mutex mtx_;
+  std::atomic<uint64_t> value_{0};
+};
+
+}  // namespace ROCKSDB_NAMESPACE
+
+#endif  // !defined(ROCKSDB_LITE) && defined(OS_LINUX)
@@ -0,0 +1,109 @@
+// Copyright (c) 2019-present, Western Digital Corporation
+//  This source code is licensed under both the GPLv2 (found in the
+//  COPYING file in the root directory) and Apache 2.0 License
+//  (found in the LICENSE.Apache file in the root directory).
+
+#if !defined(ROCKSDB_LITE) && !defined(OS_WIN)
+
+#include "zone_uring.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <string>
+
+/* Entries in the polled ring, only one write is in flight at a time */
+#define ZENFS_POLLED_QUEUE_DEPTH (8)
+/* Idle time before the submission queue poller thread goes to sleep */
+#define ZENFS_SQPOLL_IDLE_MS (1000)
+
+namespace ROCKSDB_NAMESPACE {
+
+ZonePolledQueue::~ZonePolledQueue() {
+#ifdef ZENFS_IO_URING
+  if (open_) io_uring_queue_exit(&ring_);
+#endif
+}
+
+#ifdef ZENFS_IO_URING
+IOStatus ZonePolledQueue::Open(int fd, bool sqpoll, int sq_cpu) {
+  struct io_uring_params params;
+  int ret;
+
+  memset(&params, 0, sizeof(params));
+  params.flags = IORING_SETUP_IOPOLL;
+  if (sqpoll) {
+    params.flags |= IORING_SETUP_SQPOLL;
+    params.sq_thread_idle = ZENFS_SQPOLL_IDLE_MS;
+    if (sq_cpu >= 0) {
+      params.flags |= IORING_SETUP_SQ_AFF;
+      params.sq_thread_cpu = sq_cpu;
+    }
+  }
+
+  ret = io_uring_queue_init_params(ZENFS_POLLED_QUEUE_DEPTH, &ring_, &params);
+  if (ret < 0)
+    return IOStatus::NotSupported("Failed to set up polled io_uring: " +
+                                  std::string(strerror(-ret)));
+
+  /* Submission queue polling requires registered files on older kernels */
+  ret = io_uring_register_files(&ring_, &fd, 1);
+  if (ret < 0) {
+    io_uring_queue_exit(&ring_);
+    return IOStatus::NotSupported("Failed to register device with io_uring: " +
+                                  std::string(strerror(-ret)));
+  }
+
+  open_ = true;
+  return IOStatus::OK();
+}
+
+IOStatus ZonePolledQueue::Write(const char* buf, uint32_t len, uint64_t offset,
+                                uint32_t* written) {
+  std::lock_guard<std::mutex> lock(mtx_);
+  struct io_uring_cqe* cqe;
+  struct io_uring_sqe* sqe;
+  int ret;
+
+  *written = 0;
+  if (!open_) return IOStatus::IOError("Polled queue not open");
+
+  sqe = io_uring_get_sqe(&ring_);
+  if (sqe == nullptr) return IOStatus::IOError("Polled queue full");
+
+  io_uring_prep_write(sqe, 0, buf, len, offset);
+  sqe->flags |= IOSQE_FIXED_FILE;
+
+  ret = io_uring_submit(&ring_);
+  if (ret < 0) return IOStatus::IOError("Failed to submit polled write");
+
+  /* On an IOPOLL ring waiting polls the device for the completion */
+  do {
+    ret = io_uring_wait_cqe(&ring_, &cqe);
+  } while (ret == -EINTR);
+  if (ret < 0) return IOStatus::IOError("Failed to complete polled write");
+
+  ret = cqe->res;
+  io_uring_cqe_seen(&ring_, cqe);
+  if (ret <= 0) return IOStatus::IOError("Polled write failed");
+
+  *written = ret;
+  return IOStatus::OK();
+}
+#else
+IOStatus ZonePolledQueue::Open(int /*fd*/, bool /*sqpoll*/, int /*sq_cpu*/) {
+  return IOStatus::NotSupported(
+      "Polled writes need ZenFS built with ZENFS_IO_URING=1");
+}
+
+IOStatus ZonePolledQueue::Write(const char* /*buf*/, uint32_t /*len*/,
+                                uint64_t /*offset*/, uint32_t* written) {
+  *written = 0;
+  return IOStatus::NotSupported(
+      "Polled writes need ZenFS built with ZENFS_IO_URING=1");
+}
+#endif
+
+}  // namespace ROCKSDB_NAMESPACE
+
+#endif  // !defined(ROCKSDB_LITE) && !defined(OS_WIN)
@@ -0,0 +1,56 @@
+// Copyright (c) 2019-present, Western Digital Corporation
+//  This source code is licensed under both the GPLv2 (found in the
+//  COPYING file in the root directory) and Apache 2.0 License
+//  (found in the LICENSE.Apache file in the root directory).
+
+#pragma once
+
+#if !defined(ROCKSDB_LITE) && defined(OS_LINUX)
+
+#include <stdint.h>
+
+#include <mutex>
+
+#ifdef ZENFS_IO_URING
+#include <liburing.h>
+#endif
+
+#include "rocksdb/io_status.h"
+
+namespace ROCKSDB_NAMESPACE {
+
+/* Polled write queue for latency critical writes.
+ *
+ * Writes are submitted through an io_uring set up for completion polling
+ * (IORING_SETUP_IOPOLL): the writer spins on the device completion queue
+ * instead of sleeping until an interrupt wakes it up. With sqpoll, a kernel
+ * thread bound to sq_cpu polls the submission queue as well, so submitting
+ * takes no system call. Polling needs an O_DIRECT file descriptor and a
+ * device with poll queues (e.g. nvme.poll_queues=N), otherwise writes fail.
+ *
+ * Only available when built with ZENFS_IO_URING, Open returns NotSupported
+ * otherwise. Writes are serialized, one write is in flight at a time.
+ */
+class ZonePolledQueue {
+ public:
+  ZonePolledQueue() {}
+  ~ZonePolledQueue();
+
+  IOStatus Open(int fd, bool sqpoll, int sq_cpu);
+
+  /* Write len bytes at offset and poll until the write completes. *written
+   * is set to the number of bytes written, which may be less than len. */
+  IOStatus Write(const char* buf, uint32_t len, uint64_t offset,
+                 uint32_t* written);
+
+ private:
+#ifdef ZENFS_IO_URING
+  struct io_uring ring_;
+#endif
+  bool open_ = false;
+  std::mutex mtx_;
+};
+
+}  // namespace ROCKSDB_NAMESPACE
+
+#endif  // !defined(ROCKSDB_LITE) && defined(OS_LINUX)
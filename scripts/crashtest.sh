@@ -0,0 +1,25 @@
+#!/bin/bash
+set -e
+
+# Run the ZenFS crash consistency test (test/zenfs_crash_test) against a
+# zoned block device. The test reformats the device for every crash point, so
+# use a memory backed null_blk device (see setup_zone_nullblk.sh).
+#
+# Usage: crashtest.sh <zoned block device name> [extra zenfs_crash_test flags]
+
+DEV=$1
+shift || true
+
+if [ -z "$DEV" ]; then
+	echo "Usage: crashtest.sh <zoned block device, e.g. nullb0> [flags]"
+	exit -1
+fi
+
+CRASHTEST=${CRASHTEST:-../test/zenfs_crash_test}
+AUX_PATH=/tmp/zenfs-crashtest-aux-$DEV
+
+echo mq-deadline > /sys/class/block/$DEV/queue/scheduler
+
+rm -rf $AUX_PATH
+$CRASHTEST --zbd=$DEV --aux_path=$AUX_PATH "$@"
+rm -rf $AUX_PATH
@@ -0,0 +1,30 @@
+#!/bin/bash
+set -e
+
+# Run the ZenFS feature tests (test/zenfs_feature_test) against a zoned block
+# device. The tests reformat the device, so use a memory backed null_blk
+# device (see setup_zone_nullblk.sh).
+#
+# Usage: featuretest.sh <zoned block device name> [extra test flags]
+#
+# The device name may also be a comma separated list of devices or a
+# mirror:<device>,<mirror> pair.
+
+DEV=$1
+shift || true
+
+if [ -z "$DEV" ]; then
+	echo "Usage: featuretest.sh <zoned block device, e.g. nullb0> [flags]"
+	exit -1
+fi
+
+FEATURETEST=${FEATURETEST:-../test/zenfs_feature_test}
+AUX_PATH=/tmp/zenfs-featuretest-aux-$(echo $DEV | tr ',:' '__')
+
+for D in $(echo ${DEV#mirror:} | tr ',' ' '); do
+	echo mq-deadline > /sys/class/block/$D/queue/scheduler
+done
+
+rm -rf $AUX_PATH
+$FEATURETEST --zbd=$DEV --aux_path=$AUX_PATH "$@"
+rm -rf $AUX_PATH
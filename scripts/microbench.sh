@@ -0,0 +1,30 @@
+#!/bin/bash
+set -e
+
+# Run the ZenFS microbenchmarks (test/zenfs_bench) against a zoned block
+# device. Use a memory backed null_blk device (see setup_zone_nullblk.sh) to
+# get results that are reproducible and comparable across commits.
+#
+# Usage: microbench.sh <zoned block device name> [extra zenfs_bench flags]
+#
+# The device name may also be a comma separated list of devices or a
+# mirror:<device>,<mirror> pair.
+
+DEV=$1
+shift || true
+
+if [ -z "$DEV" ]; then
+	echo "Usage: microbench.sh <zoned block device, e.g. nullb0> [flags]"
+	exit -1
+fi
+
+BENCH=${BENCH:-../test/zenfs_bench}
+AUX_PATH=/tmp/zenfs-bench-aux-$DEV
+
+for D in $(echo ${DEV#mirror:} | tr ',' ' '); do
+	echo mq-deadline > /sys/class/block/$D/queue/scheduler
+done
+
+rm -rf $AUX_PATH
+$BENCH --zbd=$DEV --aux_path=$AUX_PATH "$@"
+rm -rf $AUX_PATH
@@ -3,11 +3,13 @@
 # 400x 256MB Zones - 100GB
 ZONE_SZ=256
 SIZE=$(($ZONE_SZ * 400))
+# Use a different name to set up more than one device, e.g. for a mirror
+NAME=${1:-zns_nullb}
 
 modprobe null_blk
 cd /sys/kernel/config/nullb &&
-    mkdir -p zns_nullb &&
-    cd zns_nullb ; echo 0 > power; 
+    mkdir -p $NAME &&
+    cd $NAME ; echo 0 > power; 
     echo 1 > zoned &&
     echo $ZONE_SZ > zone_size &&
     echo 0 > zone_nr_conv &&
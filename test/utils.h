@@ -23,7 +23,10 @@ using GFLAGS_NAMESPACE::ParseCommandLineFlags;
 using GFLAGS_NAMESPACE::RegisterFlagValidator;
 using GFLAGS_NAMESPACE::SetUsageMessage;
 
-DEFINE_string(zbd, "", "Path to a zoned block device.");
+DEFINE_string(zbd, "",
+              "Path to a zoned block device, or a comma separated list of "
+              "devices to span, or mirror:<device>,<mirror>. Append "
+              "@<first zone>+<nr zones> to use a range of zones.");
 DEFINE_string(aux_path, "",
 "Path for auxiliary file storage (log and lock files).");
 DEFINE_bool(force, false, "Force file system creation.");
@@ -0,0 +1,514 @@
+// Copyright (c) 2019-present, Western Digital Corporation
+//  This source code is licensed under both the GPLv2 (found in the
+//  COPYING file in the root directory) and Apache 2.0 License
+//  (found in the LICENSE.Apache file in the root directory).
+
+// Microbenchmarks for the ZenFS internals.
+//
+// Every benchmark starts from a freshly created file system, so results are
+// comparable across commits as long as the same device geometry is used. The
+// intended target is a memory backed null_blk zoned device, see
+// scripts/microbench.sh.
+//
+// Output follows the google-benchmark layout:
+//   <name>/<args>   <time per op>   <iterations>   <throughput>
+
+#include "utils.h"
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <sstream>
+#include <string>
+#include <vector>
+
+DEFINE_string(benchmarks, "append,read,alloc,metasync,mount,walsync",
+              "Comma separated list of benchmarks to run.");
+DEFINE_int32(bench_threads, 8, "Number of threads for contended benchmarks.");
+DEFINE_int32(bench_ops, 1000, "Operations per benchmark run.");
+DEFINE_int32(bench_reps, 3, "Repetitions, the fastest run is reported.");
+DEFINE_uint64(write_rate_limit, 0,
+              "Limit io zone appends to this many bytes per second, 0 for no "
+              "limit, see ZonedBlockDevice::SetRateLimiter.");
+DEFINE_int32(adaptive_finish, 0,
+             "Adapt the zone finish threshold to the active zone pressure, up "
+             "to this percentage, 0 uses the static --finish_threshold, see "
+             "ZonedBlockDevice::EnableAdaptiveFinish.");
+DEFINE_uint64(read_cache_size, 64 << 20,
+              "Size of the read cache for the cached read benchmark, see "
+              "ZonedBlockDevice::SetReadCacheSize.");
+DEFINE_double(hedge_percentile, 99,
+              "Read latency percentile that triggers a hedged read, for the "
+              "hedged read benchmark on a mirrored device.");
+
+namespace ROCKSDB_NAMESPACE {
+
+using BenchClock = std::chrono::steady_clock;
+
+struct BenchResult {
+  std::string name;
+  uint64_t iterations = 0;
+  uint64_t bytes = 0;
+  uint64_t nanos = 0;
+};
+
+static void PrintHeader() {
+  fprintf(stdout, "%-40s %15s %12s %15s\n", "Benchmark", "Time/op", "Iterations",
+          "Throughput");
+  fprintf(stdout, "%s\n", std::string(85, '-').c_str());
+}
+
+static void PrintResult(const BenchResult &r) {
+  double ns_per_op = r.iterations ? (double)r.nanos / r.iterations : 0;
+  double secs = (double)r.nanos / 1e9;
+  std::ostringstream thr;
+
+  if (r.bytes && secs > 0) {
+    thr << (uint64_t)(r.bytes / secs / (1024 * 1024)) << " MB/s";
+  } else if (secs > 0) {
+    thr << (uint64_t)(r.iterations / secs) << " op/s";
+  }
+
+  fprintf(stdout, "%-40s %12.0f ns %12lu %15s\n", r.name.c_str(), ns_per_op,
+          r.iterations, thr.str().c_str());
+  fflush(stdout);
+}
+
+/* Run fn bench_reps times and report the fastest run */
+static void Run(const std::string &name, std::function<BenchResult()> fn) {
+  BenchResult best;
+
+  for (int i = 0; i < FLAGS_bench_reps; i++) {
+    BenchResult r = fn();
+    if (r.iterations == 0) {
+      fprintf(stderr, "%s: benchmark failed\n", name.c_str());
+      return;
+    }
+    if (best.iterations == 0 || r.nanos < best.nanos) best = r;
+  }
+
+  best.name = name;
+  PrintResult(best);
+}
+
+static uint64_t ElapsedNanos(BenchClock::time_point start) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             BenchClock::now() - start)
+      .count();
+}
+
+/* Create an empty file system and mount it */
+static ZenFS *FreshFS(std::shared_ptr<Logger> logger) {
+  ZonedBlockDevice *zbd = zbd_open(false, logger);
+  if (zbd == nullptr) return nullptr;
+
+  ZenFS *zenFS = new ZenFS(zbd, FileSystem::Default(), logger);
+  Status s = zenFS->MkFS(FLAGS_aux_path, FLAGS_finish_threshold,
+                         FLAGS_max_open_zones, FLAGS_max_active_zones);
+  delete zenFS;
+  if (!s.ok()) {
+    fprintf(stderr, "Failed to create file system, error: %s\n",
+            s.ToString().c_str());
+    return nullptr;
+  }
+
+  zbd = zbd_open(false, logger);
+  if (zbd == nullptr) return nullptr;
+
+  s = zenfs_mount(zbd, &zenFS, false, logger);
+  if (!s.ok()) {
+    fprintf(stderr, "Failed to mount filesystem, error: %s\n",
+            s.ToString().c_str());
+    return nullptr;
+  }
+
+  if (FLAGS_adaptive_finish > 0)
+    zenFS->GetZonedBlockDevice()->EnableAdaptiveFinish(FLAGS_adaptive_finish);
+
+  if (FLAGS_write_rate_limit) {
+    zenFS->GetZonedBlockDevice()->SetRateLimiter(std::shared_ptr<RateLimiter>(
+        NewGenericRateLimiter(FLAGS_write_rate_limit)));
+  }
+
+  return zenFS;
+}
+
+static char *AlignedBuffer(size_t sz) {
+  void *buf;
+  if (posix_memalign(&buf, 4096, sz)) return nullptr;
+  memset(buf, 0xa5, sz);
+  return (char *)buf;
+}
+
+/* ZoneFile::Append through a direct writable file, syncing every sync_every
+ * appends (0 = only on close) */
+static BenchResult BenchAppend(std::shared_ptr<Logger> logger, size_t sz,
+                               int sync_every) {
+  BenchResult r;
+  ZenFS *zenFS = FreshFS(logger);
+  if (zenFS == nullptr) return r;
+
+  char *buf = AlignedBuffer(sz);
+  FileOptions fopts;
+  IOOptions iopts;
+  IODebugContext dbg;
+  std::unique_ptr<FSWritableFile> file;
+
+  fopts.use_direct_writes = true;
+  IOStatus s = zenFS->NewWritableFile("bench/append.sst", fopts, &file, &dbg);
+
+  auto start = BenchClock::now();
+  for (int i = 0; s.ok() && i < FLAGS_bench_ops; i++) {
+    s = file->Append(Slice(buf, sz), iopts, &dbg);
+    if (s.ok() && sync_every && (i % sync_every) == 0)
+      s = file->Sync(iopts, &dbg);
+  }
+  if (s.ok()) s = file->Close(iopts, &dbg);
+  r.nanos = ElapsedNanos(start);
+
+  if (s.ok()) {
+    r.iterations = FLAGS_bench_ops;
+    r.bytes = (uint64_t)FLAGS_bench_ops * sz;
+  }
+
+  file.reset();
+  free(buf);
+  delete zenFS;
+  return r;
+}
+
+/* Small appends to a buffered WAL file, each followed by a sync. mode is
+ * "pwrite", "polled" or "sqpoll", see ZonedBlockDevice::EnablePolledWAL. */
+static BenchResult BenchWALSync(std::shared_ptr<Logger> logger,
+                                const std::string &mode) {
+  BenchResult r;
+  ZenFS *zenFS = FreshFS(logger);
+  if (zenFS == nullptr) return r;
+
+  std::string record(128, 'w');
+  FileOptions fopts;
+  IOOptions iopts;
+  IODebugContext dbg;
+  std::unique_ptr<FSWritableFile> file;
+  IOStatus s;
+
+  if (mode != "pwrite")
+    s = zenFS->GetZonedBlockDevice()->EnablePolledWAL(mode == "sqpoll");
+  if (s.ok()) s = zenFS->NewWritableFile("bench/wal.log", fopts, &file, &dbg);
+
+  auto start = BenchClock::now();
+  for (int i = 0; s.ok() && i < FLAGS_bench_ops; i++) {
+    s = file->Append(Slice(record), iopts, &dbg);
+    if (s.ok()) s = file->Sync(iopts, &dbg);
+  }
+  r.nanos = ElapsedNanos(start);
+  if (s.ok()) s = file->Close(iopts, &dbg);
+
+  if (s.ok()) {
+    r.iterations = FLAGS_bench_ops;
+    r.bytes = (uint64_t)FLAGS_bench_ops * record.size();
+  } else {
+    fprintf(stderr, "walsync/%s: %s\n", mode.c_str(), s.ToString().c_str());
+  }
+
+  file.reset();
+  delete zenFS;
+  return r;
+}
+
+/* PositionedRead of a whole file made up of nr_extents extents. Unaligned
+ * syncs of a buffered file force a new extent for every append. mode is
+ * "buffered", "direct", "mmap", "hedged", which are direct reads with
+ * hedging across a mirror, see ZonedBlockDevice::EnableHedgedReads, or
+ * "cached", which are direct reads of data still in the read cache. */
+static BenchResult BenchRead(std::shared_ptr<Logger> logger, int nr_extents,
+                             const std::string &mode) {
+  const size_t extent_sz = 4096 - 512;
+  BenchResult r;
+  ZenFS *zenFS = FreshFS(logger);
+  if (zenFS == nullptr) return r;
+
+  FileOptions fopts;
+  IOOptions iopts;
+  IODebugContext dbg;
+  std::unique_ptr<FSWritableFile> wfile;
+  std::unique_ptr<FSRandomAccessFile> rfile;
+  char *buf = AlignedBuffer(extent_sz * nr_extents + 4096);
+
+  if (mode == "cached")
+    zenFS->GetZonedBlockDevice()->SetReadCacheSize(FLAGS_read_cache_size);
+
+  IOStatus s = zenFS->NewWritableFile("bench/read.sst", fopts, &wfile, &dbg);
+  for (int i = 0; s.ok() && i < nr_extents; i++) {
+    s = wfile->Append(Slice(buf, extent_sz), iopts, &dbg);
+    if (s.ok()) s = wfile->Sync(iopts, &dbg);
+  }
+  if (s.ok()) s = wfile->Close(iopts, &dbg);
+  wfile.reset();
+
+  if (s.ok() && mode == "hedged")
+    s = zenFS->GetZonedBlockDevice()->EnableHedgedReads(FLAGS_hedge_percentile);
+
+  fopts.use_direct_reads =
+      (mode == "direct" || mode == "hedged" || mode == "cached");
+  fopts.use_mmap_reads = (mode == "mmap");
+  if (s.ok())
+    s = zenFS->NewRandomAccessFile("bench/read.sst", fopts, &rfile, &dbg);
+
+  size_t n = extent_sz * nr_extents;
+  auto start = BenchClock::now();
+  for (int i = 0; s.ok() && i < FLAGS_bench_ops; i++) {
+    Slice result;
+    s = rfile->Read(0, n, iopts, &result, buf, &dbg);
+    if (s.ok() && result.size() != n) s = IOStatus::IOError("Short read");
+  }
+  r.nanos = ElapsedNanos(start);
+
+  if (s.ok()) {
+    r.iterations = FLAGS_bench_ops;
+    r.bytes = (uint64_t)FLAGS_bench_ops * n;
+  } else {
+    fprintf(stderr, "read: %s\n", s.ToString().c_str());
+  }
+
+  ZoneReadCache *cache = zenFS->GetZonedBlockDevice()->GetReadCache();
+  if (cache) {
+    fprintf(stderr, "read: cache %lu hits, %lu misses\n", cache->GetHits(),
+            cache->GetMisses());
+  }
+
+  rfile.reset();
+  free(buf);
+  delete zenFS;
+  return r;
+}
+
+/* AllocateZone from bench_threads threads, each allocation writes a block
+ * and releases the zone so that it is reset by later allocations. */
+static BenchResult BenchAllocateZone(std::shared_ptr<Logger> logger) {
+  BenchResult r;
+  ZenFS *zenFS = FreshFS(logger);
+  if (zenFS == nullptr) return r;
+
+  ZonedBlockDevice *zbd = zenFS->GetZonedBlockDevice();
+  uint32_t bs = zbd->GetBlockSize();
+  std::atomic<int> failed(0);
+  std::vector<std::thread> threads;
+  int ops_per_thread = FLAGS_bench_ops / FLAGS_bench_threads;
+  if (ops_per_thread == 0) ops_per_thread = 1;
+
+  auto start = BenchClock::now();
+  for (int t = 0; t < FLAGS_bench_threads; t++) {
+    threads.emplace_back([&, t]() {
+      char *buf = AlignedBuffer(bs);
+      Env::WriteLifeTimeHint hint =
+          (Env::WriteLifeTimeHint)(Env::WLTH_SHORT + t % 3);
+      for (int i = 0; i < ops_per_thread; i++) {
+        Zone *z = zbd->AllocateZone(hint, false);
+        if (z == nullptr || !z->Append(buf, bs).ok()) {
+          failed++;
+          break;
+        }
+        z->CloseWR();
+      }
+      free(buf);
+    });
+  }
+  for (auto &t : threads) t.join();
+  r.nanos = ElapsedNanos(start);
+
+  if (!failed) r.iterations = ops_per_thread * FLAGS_bench_threads;
+
+  ZoneFinishStats finish = zbd->GetFinishStats();
+  fprintf(stderr, "alloc: %lu finishes wasted %lu KB, %lu stalls\n",
+          finish.finishes, finish.wasted_bytes / 1024, finish.stalls);
+
+  delete zenFS;
+  return r;
+}
+
+/* Small appends followed by a sync, every sync persists a file update
+ * through SyncFileMetadata. */
+static BenchResult BenchMetadataSync(std::shared_ptr<Logger> logger,
+                                     int threads_nr) {
+  BenchResult r;
+  ZenFS *zenFS = FreshFS(logger);
+  if (zenFS == nullptr) return r;
+
+  std::atomic<int> failed(0);
+  std::vector<std::thread> threads;
+  int ops_per_thread = FLAGS_bench_ops / threads_nr;
+  if (ops_per_thread == 0) ops_per_thread = 1;
+
+  auto start = BenchClock::now();
+  for (int t = 0; t < threads_nr; t++) {
+    threads.emplace_back([&, t]() {
+      char data[128] = {0};
+      FileOptions fopts;
+      IOOptions iopts;
+      IODebugContext dbg;
+      std::unique_ptr<FSWritableFile> file;
+      std::string fname = "bench/metasync_" + std::to_string(t) + ".log";
+
+      IOStatus s = zenFS->NewWritableFile(fname, fopts, &file, &dbg);
+      for (int i = 0; s.ok() && i < ops_per_thread; i++) {
+        s = file->Append(Slice(data, sizeof(data)), iopts, &dbg);
+        if (s.ok()) s = file->Sync(iopts, &dbg);
+      }
+      if (s.ok()) s = file->Close(iopts, &dbg);
+      if (!s.ok()) failed++;
+    });
+  }
+  for (auto &t : threads) t.join();
+  r.nanos = ElapsedNanos(start);
+
+  if (!failed) r.iterations = ops_per_thread * threads_nr;
+
+  delete zenFS;
+  return r;
+}
+
+/* Populate a file system with nr_files files, then measure a read only mount
+ * (recovery) and a read/write mount (recovery + snapshot roll). */
+static bool BenchMount(std::shared_ptr<Logger> logger, int nr_files,
+                       BenchResult *recovery, BenchResult *roll) {
+  ZenFS *zenFS = FreshFS(logger);
+  if (zenFS == nullptr) return false;
+
+  char data[4096] = {0};
+  FileOptions fopts;
+  IOOptions iopts;
+  IODebugContext dbg;
+  IOStatus s;
+
+  for (int i = 0; s.ok() && i < nr_files; i++) {
+    std::unique_ptr<FSWritableFile> file;
+    std::string fname = "bench/mount_" + std::to_string(i) + ".sst";
+    s = zenFS->NewWritableFile(fname, fopts, &file, &dbg);
+    if (s.ok()) s = file->Append(Slice(data, sizeof(data)), iopts, &dbg);
+    if (s.ok()) s = file->Close(iopts, &dbg);
+  }
+  delete zenFS;
+  if (!s.ok()) return false;
+
+  ZonedBlockDevice *zbd = zbd_open(true, logger);
+  if (zbd == nullptr) return false;
+  auto start = BenchClock::now();
+  Status ms = zenfs_mount(zbd, &zenFS, true, logger);
+  recovery->nanos = ElapsedNanos(start);
+  if (!ms.ok()) return false;
+  delete zenFS;
+
+  zbd = zbd_open(false, logger);
+  if (zbd == nullptr) return false;
+  start = BenchClock::now();
+  ms = zenfs_mount(zbd, &zenFS, false, logger);
+  roll->nanos = ElapsedNanos(start);
+  if (!ms.ok()) return false;
+  delete zenFS;
+
+  /* The read/write mount is recovery followed by a roll */
+  roll->nanos -= std::min(roll->nanos, recovery->nanos);
+  recovery->iterations = 1;
+  roll->iterations = 1;
+  return true;
+}
+
+static bool Enabled(const std::string &name) {
+  std::stringstream ss(FLAGS_benchmarks);
+  std::string b;
+  while (std::getline(ss, b, ',')) {
+    if (b == name) return true;
+  }
+  return false;
+}
+
+int bench() {
+  std::shared_ptr<Logger> logger;
+  Status s;
+
+  if (FLAGS_aux_path.empty()) {
+    fprintf(stderr, "You need to specify --aux_path\n");
+    return 1;
+  }
+  if (FLAGS_aux_path.back() != '/') FLAGS_aux_path.append("/");
+
+  s = Env::Default()->NewLogger(GetLogFilename(FLAGS_zbd), &logger);
+  if (!s.ok()) {
+    fprintf(stderr, "ZenFS: Could not create logger");
+  } else {
+    logger->SetInfoLogLevel(INFO_LEVEL);
+  }
+
+  PrintHeader();
+
+  if (Enabled("append")) {
+    for (size_t sz : {4096, 65536, 1048576}) {
+      for (int sync_every : {1, 16, 0}) {
+        Run("BM_Append/" + std::to_string(sz) + "/sync:" +
+                std::to_string(sync_every),
+            [&]() { return BenchAppend(logger, sz, sync_every); });
+      }
+    }
+  }
+
+  if (Enabled("read")) {
+    std::vector<std::string> modes = {"buffered", "direct", "mmap"};
+    if (FLAGS_zbd.compare(0, 7, "mirror:") == 0) modes.push_back("hedged");
+    if (FLAGS_read_cache_size) modes.push_back("cached");
+    for (int extents : {1, 8, 64}) {
+      for (const std::string &mode : modes) {
+        Run("BM_PositionedRead/extents:" + std::to_string(extents) + "/" +
+                mode,
+            [&]() { return BenchRead(logger, extents, mode); });
+      }
+    }
+  }
+
+  if (Enabled("alloc")) {
+    Run("BM_AllocateZone/threads:" + std::to_string(FLAGS_bench_threads),
+        [&]() { return BenchAllocateZone(logger); });
+  }
+
+  if (Enabled("metasync")) {
+    for (int threads : {1, FLAGS_bench_threads}) {
+      Run("BM_SyncFileMetadata/threads:" + std::to_string(threads),
+          [&]() { return BenchMetadataSync(logger, threads); });
+    }
+  }
+
+  if (Enabled("walsync")) {
+    for (std::string mode : {"pwrite", "polled", "sqpoll"}) {
+      Run("BM_WALSync/" + mode,
+          [&]() { return BenchWALSync(logger, mode); });
+    }
+  }
+
+  if (Enabled("mount")) {
+    for (int files : {100, 1000, 10000}) {
+      BenchResult recovery, roll;
+      if (!BenchMount(logger, files, &recovery, &roll)) {
+        fprintf(stderr, "mount: benchmark failed\n");
+        continue;
+      }
+      recovery.name = "BM_MountRecovery/files:" + std::to_string(files);
+      roll.name = "BM_SnapshotRoll/files:" + std::to_string(files);
+      PrintResult(recovery);
+      PrintResult(roll);
+    }
+  }
+
+  return 0;
+}
+
+}  // namespace ROCKSDB_NAMESPACE
+
+int main(int argc, char **argv) {
+  gflags::SetUsageMessage(std::string("\nUSAGE:\n") + std::string(argv[0]) +
+                          +" --zbd=<zoned block device> --aux_path=<path> "
+                           "[--benchmarks=append,read,alloc,metasync,mount]");
+
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+
+  return ROCKSDB_NAMESPACE::bench();
+}
@@ -0,0 +1,375 @@
+// Copyright (c) 2019-present, Western Digital Corporation
+//  This source code is licensed under both the GPLv2 (found in the
+//  COPYING file in the root directory) and Apache 2.0 License
+//  (found in the LICENSE.Apache file in the root directory).
+
+// Crash consistency test.
+//
+// A deterministic workload of file writes, syncs, renames, deletes and
+// remounts is run on a fresh file system with a ZoneFaultInjector in front of
+// the device. For every crash point the injector fails, drops or tears one
+// write; dropped and torn writes also cut the power, after which nothing
+// reaches the device anymore. The file system is then mounted from what is
+// left on the device and everything acknowledged before the fault is
+// verified: synced data must be readable and acknowledged deletes and
+// renames must have stuck.
+//
+// The intended target is a memory backed null_blk zoned device, see
+// scripts/crashtest.sh. Recovery times are reported per fault type.
+
+#include "utils.h"
+
+#include <algorithm>
+#include <chrono>
+#include <iterator>
+#include <map>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+DEFINE_string(crash_faults, "drop,tear,fail",
+              "Comma separated list of faults to inject.");
+DEFINE_int32(crash_points, 50, "Crash points per fault type.");
+DEFINE_int32(crash_rounds, 3, "Mounts per workload run.");
+DEFINE_int32(crash_ops, 100, "File operations per mount.");
+DEFINE_int32(crash_seed, 42, "Seed for the workload.");
+DEFINE_bool(crash_short_writes, false,
+            "Complete only part of every write, forcing resubmission.");
+DEFINE_int32(crash_write_delay_us, 0, "Delay every write by this much.");
+DEFINE_bool(crash_sparse_wal, false,
+            "Write sparse WAL files, recovered from their sync trailers.");
+
+namespace ROCKSDB_NAMESPACE {
+
+using CrashClock = std::chrono::steady_clock;
+
+/* What the workload got acknowledged before the fault */
+struct CrashModel {
+  struct File {
+    uint64_t id;
+    uint64_t synced_size;
+  };
+  std::map<std::string, File> files;
+  /* Names that must not exist */
+  std::set<std::string> deleted;
+  uint64_t ops = 0;
+};
+
+static char Pattern(uint64_t id, uint64_t offset) {
+  return (char)((id * 131 + offset * 7 + (offset >> 12)) & 0xff);
+}
+
+static bool Acked(const IOStatus &s, ZoneFaultInjector *injector) {
+  return s.ok() && !injector->PowerLost();
+}
+
+/* Create a file and append to it in chunks, syncing after every chunk */
+static void WriteFile(ZenFS *zenFS, ZoneFaultInjector *injector,
+                      std::mt19937 *rng, uint64_t id, CrashModel *model) {
+  std::string fname = "crash/f" + std::to_string(id);
+  if (FLAGS_crash_sparse_wal) fname += ".log";
+  std::unique_ptr<FSWritableFile> file;
+  FileOptions fopts;
+  IOOptions iopts;
+  IODebugContext dbg;
+  uint64_t size = 0;
+
+  IOStatus s = zenFS->NewWritableFile(fname, fopts, &file, &dbg);
+  if (!s.ok()) return;
+
+  int chunks = 1 + (*rng)() % 4;
+  for (int c = 0; s.ok() && c < chunks; c++) {
+    size_t len = 1 + (*rng)() % (64 * 1024);
+    std::string data(len, 0);
+
+    for (size_t i = 0; i < len; i++) data[i] = Pattern(id, size + i);
+
+    s = file->Append(Slice(data), iopts, &dbg);
+    if (s.ok()) s = file->Fsync(iopts, &dbg);
+    if (!Acked(s, injector)) break;
+
+    size += len;
+    model->files[fname] = CrashModel::File{id, size};
+  }
+
+  file->Close(iopts, &dbg);
+}
+
+/* Rename or delete a random acknowledged file. Files touched by operations
+ * that were not acknowledged are dropped from the model, as either outcome
+ * is valid. */
+static void ModifyFile(ZenFS *zenFS, ZoneFaultInjector *injector,
+                       std::mt19937 *rng, bool rename, CrashModel *model) {
+  IOOptions iopts;
+  IODebugContext dbg;
+  IOStatus s;
+
+  auto it = model->files.begin();
+  std::advance(it, (*rng)() % model->files.size());
+  std::string fname = it->first;
+  CrashModel::File file = it->second;
+
+  model->files.erase(it);
+
+  if (rename) {
+    std::string target = fname + "_r" + std::to_string(model->ops);
+    s = zenFS->RenameFile(fname, target, iopts, &dbg);
+    if (Acked(s, injector)) {
+      model->files[target] = file;
+      model->deleted.insert(fname);
+    }
+  } else {
+    s = zenFS->DeleteFile(fname, iopts, &dbg);
+    if (Acked(s, injector)) model->deleted.insert(fname);
+  }
+}
+
+/* Run the workload until it is done or the power is lost */
+static bool RunWorkload(std::shared_ptr<Logger> logger,
+                        std::shared_ptr<ZoneFaultInjector> injector,
+                        CrashModel *model) {
+  std::mt19937 rng(FLAGS_crash_seed);
+  uint64_t next_id = 0;
+
+  for (int r = 0; r < FLAGS_crash_rounds && !injector->PowerLost(); r++) {
+    ZonedBlockDevice *zbd = zbd_open(false, logger);
+    if (zbd == nullptr) return false;
+    zbd->SetFaultInjector(injector);
+
+    ZenFS *zenFS;
+    Status s = zenfs_mount(zbd, &zenFS, false, logger);
+    if (!s.ok()) {
+      /* Failing to mount on an injected write error is fine */
+      if (injector->FaultInjected()) return true;
+      fprintf(stderr, "Failed to mount filesystem, error: %s\n",
+              s.ToString().c_str());
+      return false;
+    }
+    zenFS->SetSparseWALSync(FLAGS_crash_sparse_wal);
+
+    for (int i = 0; i < FLAGS_crash_ops && !injector->PowerLost(); i++) {
+      uint32_t op = rng() % 10;
+
+      model->ops++;
+      if (model->files.empty() || op < 6) {
+        WriteFile(zenFS, injector.get(), &rng, next_id++, model);
+      } else {
+        ModifyFile(zenFS, injector.get(), &rng, op < 8, model);
+      }
+    }
+
+    /* After a power loss this is the crash, nothing reaches the device */
+    delete zenFS;
+  }
+
+  return true;
+}
+
+static bool VerifyFile(ZenFS *zenFS, const std::string &fname,
+                       const CrashModel::File &file) {
+  std::unique_ptr<FSRandomAccessFile> rfile;
+  FileOptions fopts;
+  IOOptions iopts;
+  IODebugContext dbg;
+  uint64_t size = 0;
+  Slice result;
+
+  IOStatus s = zenFS->GetFileSize(fname, iopts, &size, &dbg);
+  if (!s.ok() || size < file.synced_size) {
+    fprintf(stderr, "%s: expected at least %lu bytes, found %lu (%s)\n",
+            fname.c_str(), file.synced_size, size, s.ToString().c_str());
+    return false;
+  }
+
+  std::string buf(file.synced_size, 0);
+  s = zenFS->NewRandomAccessFile(fname, fopts, &rfile, &dbg);
+  if (s.ok())
+    s = rfile->Read(0, file.synced_size, iopts, &result, &buf[0], &dbg);
+  if (!s.ok() || result.size() != file.synced_size) {
+    fprintf(stderr, "%s: read failed: %s\n", fname.c_str(),
+            s.ToString().c_str());
+    return false;
+  }
+
+  for (uint64_t i = 0; i < file.synced_size; i++) {
+    if (result[i] != Pattern(file.id, i)) {
+      fprintf(stderr, "%s: data mismatch at offset %lu\n", fname.c_str(), i);
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/* Mount what is left on the device and check it against the model */
+static bool Verify(std::shared_ptr<Logger> logger, const CrashModel &model,
+                   uint64_t *mount_nanos) {
+  IOOptions iopts;
+  IODebugContext dbg;
+  bool ok = true;
+
+  ZonedBlockDevice *zbd = zbd_open(false, logger);
+  if (zbd == nullptr) return false;
+
+  ZenFS *zenFS;
+  auto start = CrashClock::now();
+  Status s = zenfs_mount(zbd, &zenFS, false, logger);
+  *mount_nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                     CrashClock::now() - start)
+                     .count();
+  if (!s.ok()) {
+    fprintf(stderr, "Recovery mount failed: %s\n", s.ToString().c_str());
+    return false;
+  }
+
+  for (const auto &f : model.files) {
+    if (!VerifyFile(zenFS, f.first, f.second)) ok = false;
+  }
+
+  for (const auto &fname : model.deleted) {
+    if (!zenFS->FileExists(fname, iopts, &dbg).IsNotFound()) {
+      fprintf(stderr, "%s: deleted file still exists\n", fname.c_str());
+      ok = false;
+    }
+  }
+
+  delete zenFS;
+  return ok;
+}
+
+static bool MakeFS(std::shared_ptr<Logger> logger) {
+  ZonedBlockDevice *zbd = zbd_open(false, logger);
+  if (zbd == nullptr) return false;
+
+  ZenFS *zenFS = new ZenFS(zbd, FileSystem::Default(), logger);
+  Status s = zenFS->MkFS(FLAGS_aux_path, FLAGS_finish_threshold,
+                         FLAGS_max_open_zones, FLAGS_max_active_zones);
+  delete zenFS;
+  if (!s.ok()) {
+    fprintf(stderr, "Failed to create file system, error: %s\n",
+            s.ToString().c_str());
+    return false;
+  }
+
+  return true;
+}
+
+static std::shared_ptr<ZoneFaultInjector> NewInjector() {
+  auto injector = std::make_shared<ZoneFaultInjector>();
+  injector->SetShortWrites(FLAGS_crash_short_writes);
+  injector->SetWriteDelay(FLAGS_crash_write_delay_us);
+  return injector;
+}
+
+static bool ParseFault(const std::string &name,
+                       ZoneFaultInjector::FaultType *type) {
+  if (name == "drop") {
+    *type = ZoneFaultInjector::kDrop;
+  } else if (name == "tear") {
+    *type = ZoneFaultInjector::kTear;
+  } else if (name == "fail") {
+    *type = ZoneFaultInjector::kFail;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+int crashtest() {
+  std::shared_ptr<Logger> logger;
+  int failures = 0;
+  Status s;
+
+  if (FLAGS_aux_path.empty()) {
+    fprintf(stderr, "You need to specify --aux_path\n");
+    return 1;
+  }
+  if (FLAGS_aux_path.back() != '/') FLAGS_aux_path.append("/");
+
+  s = Env::Default()->NewLogger(GetLogFilename(FLAGS_zbd), &logger);
+  if (!s.ok()) {
+    fprintf(stderr, "ZenFS: Could not create logger");
+  } else {
+    logger->SetInfoLogLevel(INFO_LEVEL);
+  }
+
+  /* Fault free run to count the writes and check the workload itself */
+  CrashModel baseline;
+  auto injector = NewInjector();
+  uint64_t mount_nanos;
+
+  if (!MakeFS(logger)) return 1;
+  auto start = CrashClock::now();
+  if (!RunWorkload(logger, injector, &baseline)) return 1;
+  double secs = std::chrono::duration_cast<std::chrono::duration<double>>(
+                    CrashClock::now() - start)
+                    .count();
+  if (!Verify(logger, baseline, &mount_nanos)) {
+    fprintf(stderr, "Fault free run failed verification\n");
+    return 1;
+  }
+
+  uint64_t nr_writes = injector->GetWrites();
+  fprintf(stdout, "Workload: %lu ops, %lu writes, %.0f op/s, mount %lu us\n",
+          baseline.ops, nr_writes, baseline.ops / secs, mount_nanos / 1000);
+
+  std::stringstream faults(FLAGS_crash_faults);
+  std::string fault;
+  while (std::getline(faults, fault, ',')) {
+    ZoneFaultInjector::FaultType type;
+    std::vector<uint64_t> mount_times;
+    int failed = 0;
+
+    if (!ParseFault(fault, &type)) {
+      fprintf(stderr, "Unknown fault: %s\n", fault.c_str());
+      return 1;
+    }
+
+    uint64_t step = std::max<uint64_t>(1, nr_writes / FLAGS_crash_points);
+    for (uint64_t w = 1; w <= nr_writes; w += step) {
+      CrashModel model;
+
+      injector = NewInjector();
+      injector->SetCrashPoint(w, type);
+
+      if (!MakeFS(logger)) return 1;
+      if (!RunWorkload(logger, injector, &model) ||
+          !Verify(logger, model, &mount_nanos)) {
+        fprintf(stderr, "%s at write %lu: FAILED\n", fault.c_str(), w);
+        failed++;
+        continue;
+      }
+      mount_times.push_back(mount_nanos);
+    }
+
+    std::sort(mount_times.begin(), mount_times.end());
+    uint64_t total = 0;
+    for (uint64_t t : mount_times) total += t;
+
+    fprintf(stdout, "%-6s %4lu crash points, %3d failed", fault.c_str(),
+            (nr_writes + step - 1) / step, failed);
+    if (!mount_times.empty()) {
+      fprintf(stdout, ", recovery us min %lu avg %lu max %lu",
+              mount_times.front() / 1000,
+              total / mount_times.size() / 1000,
+              mount_times.back() / 1000);
+    }
+    fprintf(stdout, "\n");
+    failures += failed;
+  }
+
+  return failures ? 1 : 0;
+}
+
+}  // namespace ROCKSDB_NAMESPACE
+
+int main(int argc, char **argv) {
+  gflags::SetUsageMessage(std::string("\nUSAGE:\n") + std::string(argv[0]) +
+                          +" --zbd=<zoned block device> --aux_path=<path> "
+                           "[--crash_faults=drop,tear,fail]");
+
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+
+  return ROCKSDB_NAMESPACE::crashtest();
+}
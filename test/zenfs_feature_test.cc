@@ -0,0 +1,1223 @@
+// Copyright (c) 2019-present, Western Digital Corporation
+//  This source code is licensed under both the GPLv2 (found in the
+//  COPYING file in the root directory) and Apache 2.0 License
+//  (found in the LICENSE.Apache file in the root directory).
+
+// Functional tests for the optional ZenFS features.
+//
+// Every test starts from a freshly created file system and checks the
+// behaviour of one feature, including what is left after a remount. The
+// intended target is a memory backed null_blk zoned device, see
+// scripts/featuretest.sh.
+
+#include "utils.h"
+#include "util/coding.h"
+
+#include <chrono>
+#include <map>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+DEFINE_string(tests,
+              "readcache,oldformat,spanning,link,snapshot,ranges,streams,"
+              "recovery,divergence,extents,delete",
+              "Comma separated list of tests to run.");
+
+namespace ROCKSDB_NAMESPACE {
+
+#define CHECK(cond)                                                 \
+  do {                                                              \
+    if (!(cond)) {                                                  \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, \
+              #cond);                                               \
+      return false;                                                 \
+    }                                                               \
+  } while (0)
+
+#define CHECK_OK(s)                                                    \
+  do {                                                                 \
+    auto _s = (s);                                                     \
+    if (!_s.ok()) {                                                    \
+      fprintf(stderr, "%s:%d: %s: %s\n", __FILE__, __LINE__, #s,       \
+              _s.ToString().c_str());                                  \
+      return false;                                                    \
+    }                                                                  \
+  } while (0)
+
+/* Like zbd_open, for a device other than --zbd */
+static ZonedBlockDevice *OpenZbd(const std::string &dev, bool readonly,
+                                 std::shared_ptr<Logger> logger,
+                                 IOStatus *status = nullptr) {
+  ZonedBlockDevice *zbd = new ZonedBlockDevice(dev, logger);
+  IOStatus s = zbd->Open(readonly);
+
+  if (status) *status = s;
+  if (!s.ok()) {
+    if (!status)
+      fprintf(stderr, "Failed to open zoned block device: %s, error: %s\n",
+              dev.c_str(), s.ToString().c_str());
+    delete zbd;
+    return nullptr;
+  }
+
+  return zbd;
+}
+
+static bool MakeFS(std::shared_ptr<Logger> logger,
+                   const std::string &dev = FLAGS_zbd,
+                   uint32_t nr_op_streams = 1) {
+  ZonedBlockDevice *zbd = OpenZbd(dev, false, logger);
+  if (zbd == nullptr) return false;
+
+  ZenFS *zenFS = new ZenFS(zbd, FileSystem::Default(), logger);
+  Status s = zenFS->MkFS(FLAGS_aux_path, FLAGS_finish_threshold,
+                         FLAGS_max_open_zones, FLAGS_max_active_zones,
+                         nr_op_streams);
+  delete zenFS;
+  if (!s.ok()) {
+    fprintf(stderr, "Failed to create file system, error: %s\n",
+            s.ToString().c_str());
+    return false;
+  }
+
+  return true;
+}
+
+static ZenFS *MountFS(std::shared_ptr<Logger> logger,
+                      const std::string &dev = FLAGS_zbd) {
+  ZonedBlockDevice *zbd = OpenZbd(dev, false, logger);
+  if (zbd == nullptr) return nullptr;
+
+  ZenFS *zenFS;
+  Status s = zenfs_mount(zbd, &zenFS, false, logger);
+  if (!s.ok()) {
+    fprintf(stderr, "Failed to mount filesystem, error: %s\n",
+            s.ToString().c_str());
+    return nullptr;
+  }
+
+  return zenFS;
+}
+
+static char Pattern(uint64_t seed, uint64_t offset) {
+  return (char)((seed * 131 + offset * 7 + (offset >> 12)) & 0xff);
+}
+
+static std::string PatternData(uint64_t seed, size_t size) {
+  std::string data(size, 0);
+  for (size_t i = 0; i < size; i++) data[i] = Pattern(seed, i);
+  return data;
+}
+
+static IOStatus WriteFile(FileSystem *fs, const std::string &fname,
+                          const std::string &data, bool direct) {
+  std::unique_ptr<FSWritableFile> file;
+  FileOptions fopts;
+  IOOptions iopts;
+  IODebugContext dbg;
+
+  /* Direct writes need an aligned buffer */
+  char *buf;
+  if (posix_memalign((void **)&buf, 4096, data.size() + 4096))
+    return IOStatus::IOError("Failed to allocate write buffer");
+  memcpy(buf, data.data(), data.size());
+
+  fopts.use_direct_writes = direct;
+  IOStatus s = fs->NewWritableFile(fname, fopts, &file, &dbg);
+  if (s.ok()) s = file->Append(Slice(buf, data.size()), iopts, &dbg);
+  if (s.ok()) s = file->Close(iopts, &dbg);
+  free(buf);
+  return s;
+}
+
+static IOStatus ReadFile(FileSystem *fs, const std::string &fname,
+                         bool direct, std::string *data) {
+  std::unique_ptr<FSRandomAccessFile> file;
+  FileOptions fopts;
+  IOOptions iopts;
+  IODebugContext dbg;
+  uint64_t size = 0;
+  Slice result;
+
+  IOStatus s = fs->GetFileSize(fname, iopts, &size, &dbg);
+  if (!s.ok()) return s;
+
+  fopts.use_direct_reads = direct;
+  s = fs->NewRandomAccessFile(fname, fopts, &file, &dbg);
+  if (!s.ok()) return s;
+
+  /* Direct reads need an aligned buffer */
+  char *buf;
+  if (posix_memalign((void **)&buf, 4096, size + 4096))
+    return IOStatus::IOError("Failed to allocate read buffer");
+  s = file->Read(0, size, iopts, &result, buf, &dbg);
+  if (s.ok()) data->assign(result.data(), result.size());
+  free(buf);
+  return s;
+}
+
+/* The io zone holding the data of fname */
+static bool FindFileZone(ZenFS *zenFS, const std::string &fname,
+                         ZoneStat *zone) {
+  for (auto &&z : zenFS->GetStat()) {
+    for (auto &&f : z.files) {
+      if (f.filename == fname) {
+        *zone = z;
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+/* ZoneReadCache on its own: lookups, CLOCK eviction and invalidation */
+static bool TestReadCacheUnit() {
+  const uint64_t bs = 4096;
+  ZoneReadCache cache(4 * bs);
+  std::string a = PatternData(1, bs), b = PatternData(2, bs);
+  std::string buf(2 * bs, 0);
+
+  cache.Insert(0, a.data(), bs);
+  cache.Insert(bs, b.data(), bs);
+  CHECK(cache.GetUsage() == 2 * bs);
+
+  /* Lookups spanning entries are served from both */
+  CHECK(cache.Lookup(0, 2 * bs, &buf[0]));
+  CHECK(buf == a + b);
+  CHECK(cache.Lookup(bs / 2, bs, &buf[0]));
+  CHECK(buf.compare(0, bs, (a + b).substr(bs / 2, bs)) == 0);
+
+  /* Partly cached ranges miss */
+  uint64_t misses = cache.GetMisses();
+  CHECK(!cache.Lookup(bs, 2 * bs, &buf[0]));
+  CHECK(cache.GetMisses() == misses + 1);
+
+  /* Overwriting a range replaces the stale entry */
+  cache.Insert(0, b.data(), bs);
+  CHECK(cache.Lookup(0, bs, &buf[0]));
+  CHECK(buf.compare(0, bs, b) == 0);
+  CHECK(cache.GetUsage() == 2 * bs);
+
+  cache.Invalidate(0, 8 * bs);
+  CHECK(cache.GetUsage() == 0);
+  CHECK(!cache.Lookup(bs, bs, &buf[0]));
+
+  /* CLOCK eviction gives referenced entries a second chance */
+  ZoneReadCache clock(3 * bs);
+  for (uint64_t off = 0; off < 3 * bs; off += bs)
+    clock.Insert(off, a.data(), bs);
+  CHECK(clock.Lookup(bs, bs, &buf[0]));
+  clock.Insert(3 * bs, a.data(), bs);
+  CHECK(!clock.Lookup(0, bs, &buf[0]));
+  clock.Insert(4 * bs, a.data(), bs);
+  CHECK(clock.GetUsage() == 3 * bs);
+  CHECK(!clock.Lookup(2 * bs, bs, &buf[0]));
+  CHECK(clock.Lookup(bs, bs, &buf[0]));
+  CHECK(clock.Lookup(3 * bs, 2 * bs, &buf[0]));
+
+  /* Writes larger than the cache are not cached at all */
+  std::string big(4 * bs, 'x');
+  clock.Insert(8 * bs, big.data(), big.size());
+  CHECK(!clock.Lookup(8 * bs, bs, &buf[0]));
+  CHECK(clock.GetUsage() == 3 * bs);
+
+  return true;
+}
+
+/* Reads of written data are served from the cache until the zone is reset */
+static bool TestReadCache(std::shared_ptr<Logger> logger) {
+  if (!TestReadCacheUnit()) return false;
+  if (!MakeFS(logger)) return false;
+  ZenFS *zenFS = MountFS(logger);
+  if (zenFS == nullptr) return false;
+  std::unique_ptr<ZenFS> guard(zenFS);
+
+  ZonedBlockDevice *zbd = zenFS->GetZonedBlockDevice();
+  IOOptions iopts;
+  IODebugContext dbg;
+  std::string data = PatternData(3, 1024 * 1024);
+  std::string result;
+  ZoneStat zone;
+
+  zbd->SetReadCacheSize(16 << 20);
+  ZoneReadCache *cache = zbd->GetReadCache();
+  CHECK(cache != nullptr);
+
+  CHECK_OK(WriteFile(zenFS, "cache/f.sst", data, true));
+  CHECK(cache->GetUsage() >= data.size());
+
+  uint64_t hits = cache->GetHits();
+  CHECK_OK(ReadFile(zenFS, "cache/f.sst", true, &result));
+  CHECK(result == data);
+  CHECK(cache->GetHits() > hits);
+
+  /* WAL data is not cached */
+  uint64_t usage = cache->GetUsage();
+  CHECK_OK(WriteFile(zenFS, "cache/f.log", data, false));
+  CHECK(cache->GetUsage() == usage);
+
+  CHECK(FindFileZone(zenFS, "cache/f.sst", &zone));
+  CHECK_OK(zenFS->DeleteFile("cache/f.sst", iopts, &dbg));
+  CHECK_OK(zenFS->DeleteFile("cache/f.log", iopts, &dbg));
+  zbd->ResetUnusedIOZones();
+
+  std::string buf(4096, 0);
+  CHECK(!cache->Lookup(zone.start_position, buf.size(), &buf[0]));
+  CHECK(cache->GetUsage() == 0);
+
+  return true;
+}
+
+/* Record and field tags of the original fixed width metadata encoding */
+enum OldRecordTag : uint32_t {
+  kOldFilesSnapshot = 1,
+  kOldFileUpdate = 2,
+  kOldFileDeletion = 3,
+  kOldEndRecord = 4,
+};
+
+enum OldFileTag : uint32_t {
+  kOldFileID = 1,
+  kOldFileName = 2,
+  kOldFileSize = 3,
+  kOldWriteLifeTimeHint = 4,
+  kOldExtent = 5,
+  kOldModificationTime = 6,
+};
+
+struct OldFile {
+  uint64_t id;
+  std::string name;
+  uint64_t size;
+  std::vector<std::pair<uint64_t, uint32_t>> extents;
+};
+
+static std::string EncodeOldFile(const OldFile &f) {
+  std::string out;
+
+  PutFixed32(&out, kOldFileID);
+  PutFixed64(&out, f.id);
+  PutFixed32(&out, kOldFileName);
+  PutLengthPrefixedSlice(&out, Slice(f.name));
+  PutFixed32(&out, kOldFileSize);
+  PutFixed64(&out, f.size);
+  PutFixed32(&out, kOldWriteLifeTimeHint);
+  PutFixed32(&out, (uint32_t)Env::WLTH_MEDIUM);
+  for (const auto &e : f.extents) {
+    std::string extent;
+    PutFixed64(&extent, e.first);
+    PutFixed32(&extent, e.second);
+    PutFixed32(&out, kOldExtent);
+    PutLengthPrefixedSlice(&out, Slice(extent));
+  }
+  PutFixed32(&out, kOldModificationTime);
+  PutFixed64(&out, (uint64_t)time(0));
+  return out;
+}
+
+static std::string OldRecord(uint32_t tag, const std::string &data) {
+  std::string out;
+  PutFixed32(&out, tag);
+  PutLengthPrefixedSlice(&out, Slice(data));
+  return out;
+}
+
+/* Write each of data to an io zone, returning the extents. Unused zones
+ * are reset by zone allocation, so all data goes to one zone. */
+static bool WriteOldExtents(
+    ZonedBlockDevice *zbd, const std::vector<std::string> &data,
+    std::vector<std::pair<uint64_t, uint32_t>> *extents) {
+  Zone *z = zbd->AllocateZone(Env::WLTH_MEDIUM, false);
+  if (z == nullptr) return false;
+
+  bool ok = true;
+  for (const auto &d : data) {
+    char *buf;
+    if (!ok || posix_memalign((void **)&buf, 4096, d.size())) {
+      ok = false;
+      break;
+    }
+    memcpy(buf, d.data(), d.size());
+    extents->push_back(std::make_pair(z->wp_, (uint32_t)d.size()));
+    ok = z->Append(buf, d.size()).ok();
+    free(buf);
+  }
+  z->CloseWR();
+  return ok;
+}
+
+static bool CheckFile(ZenFS *zenFS, const std::string &fname,
+                      const std::string &data) {
+  std::string result;
+  CHECK_OK(ReadFile(zenFS, fname, false, &result));
+  CHECK(result == data);
+  return true;
+}
+
+/* Metadata written by ZenFS before the compact encoding: a fixed width
+ * snapshot in the snapshot zone followed by unsequenced fixed width updates
+ * and a deletion in the op log, all mounted by the current code */
+static bool TestOldFormat(std::shared_ptr<Logger> logger) {
+  if (!MakeFS(logger)) return false;
+
+  const size_t sz = 64 * 1024;
+  std::string a = PatternData(4, sz), b1 = PatternData(5, sz),
+              b2 = PatternData(6, sz), c = PatternData(7, sz);
+  OldFile fa{1, "old/a.sst", sz, {}}, fb{2, "old/b.sst", sz, {}},
+      fc{3, "old/c.sst", sz, {}};
+  std::pair<uint64_t, uint32_t> b2_extent;
+
+  {
+    ZonedBlockDevice *zbd = zbd_open(false, logger);
+    if (zbd == nullptr) return false;
+    std::unique_ptr<ZonedBlockDevice> guard(zbd);
+
+    std::vector<std::pair<uint64_t, uint32_t>> extents;
+    CHECK(WriteOldExtents(zbd, {a, b1, b2, c}, &extents));
+    fa.extents.push_back(extents[0]);
+    fb.extents.push_back(extents[1]);
+    b2_extent = extents[2];
+    fc.extents.push_back(extents[3]);
+
+    Superblock super(zbd, FLAGS_aux_path, FLAGS_finish_threshold,
+                     FLAGS_max_open_zones, FLAGS_max_active_zones);
+    std::string super_string;
+
+    for (auto z : zbd->GetSnapshotZones()) CHECK_OK(z->Reset());
+    for (auto z : zbd->GetOpZones()) CHECK_OK(z->Reset());
+
+    /* Snapshot of a and c */
+    {
+      ZenMetaLog log(zbd, zbd->GetSnapshotZones()[0]);
+      std::string files;
+      PutLengthPrefixedSlice(&files, Slice(EncodeOldFile(fa)));
+      PutLengthPrefixedSlice(&files, Slice(EncodeOldFile(fc)));
+
+      super.EncodeTo(&super_string);
+      CHECK_OK(log.AddRecord(super_string));
+      CHECK_OK(log.AddRecord(OldRecord(kOldFilesSnapshot, files)));
+      std::string end;
+      PutFixed32(&end, kOldEndRecord);
+      CHECK_OK(log.AddRecord(end));
+    }
+
+    /* Create b with one extent and grow it by another, rename a and
+     * delete c. Updates only carry the extents added since the last one. */
+    {
+      ZenMetaLog log(zbd, zbd->GetOpZones()[0]);
+      OldFile grown{2, fb.name, 2 * sz, {b2_extent}};
+      OldFile renamed{1, "old/a_renamed.sst", sz, {}};
+      std::string deletion;
+
+      PutFixed64(&deletion, fc.id);
+      PutLengthPrefixedSlice(&deletion, Slice(fc.name));
+
+      super.EncodeTo(&super_string);
+      CHECK_OK(log.AddRecord(super_string));
+      CHECK_OK(log.AddRecord(OldRecord(kOldFileUpdate, EncodeOldFile(fb))));
+      CHECK_OK(
+          log.AddRecord(OldRecord(kOldFileUpdate, EncodeOldFile(grown))));
+      CHECK_OK(
+          log.AddRecord(OldRecord(kOldFileUpdate, EncodeOldFile(renamed))));
+      CHECK_OK(log.AddRecord(OldRecord(kOldFileDeletion, deletion)));
+    }
+  }
+
+  IOOptions iopts;
+  IODebugContext dbg;
+
+  /* The first mount rewrites the metadata in the compact encoding, the
+   * second one reads it back */
+  for (int mount = 0; mount < 2; mount++) {
+    ZenFS *zenFS = MountFS(logger);
+    if (zenFS == nullptr) return false;
+    std::unique_ptr<ZenFS> guard(zenFS);
+
+    CHECK(CheckFile(zenFS, "old/a_renamed.sst", a));
+    CHECK(CheckFile(zenFS, "old/b.sst", b1 + b2));
+    CHECK(zenFS->FileExists("old/a.sst", iopts, &dbg).IsNotFound());
+    CHECK(zenFS->FileExists("old/c.sst", iopts, &dbg).IsNotFound());
+
+    /* Compact records written after the recovered ones */
+    if (mount == 0) {
+      CHECK_OK(WriteFile(zenFS, "old/d.sst", c, false));
+      CHECK_OK(zenFS->DeleteFile("old/a_renamed.sst", iopts, &dbg));
+      CHECK(CheckFile(zenFS, "old/b.sst", b1 + b2));
+    } else {
+      CHECK(zenFS->FileExists("old/a_renamed.sst", iopts, &dbg).IsNotFound());
+      CHECK(CheckFile(zenFS, "old/d.sst", c));
+    }
+  }
+
+  return true;
+}
+
+/* Zones of files written at the same time are spread over all devices of
+ * a spanned file system. Needs --zbd=<device>,<device>, null_blk devices
+ * report no active zone limit. */
+static bool TestSpanning(std::shared_ptr<Logger> logger) {
+  if (FLAGS_zbd.find(',') == std::string::npos ||
+      FLAGS_zbd.compare(0, 7, "mirror:") == 0) {
+    fprintf(stderr, "spanning: needs a list of devices, skipped\n");
+    return true;
+  }
+
+  if (!MakeFS(logger)) return false;
+  ZenFS *zenFS = MountFS(logger);
+  if (zenFS == nullptr) return false;
+  std::unique_ptr<ZenFS> guard(zenFS);
+
+  ZonedBlockDevice *zbd = zenFS->GetZonedBlockDevice();
+  std::string data = PatternData(8, 1024 * 1024);
+  std::vector<std::unique_ptr<FSWritableFile>> files;
+  IOOptions iopts;
+  IODebugContext dbg;
+
+  CHECK(zbd->GetNrDevices() > 1);
+
+  /* The files are open at the same time, so each one writes to a zone of
+   * its own */
+  for (int i = 0; i < 4; i++) {
+    std::unique_ptr<FSWritableFile> file;
+    FileOptions fopts;
+
+    CHECK_OK(zenFS->NewWritableFile("span/f" + std::to_string(i) + ".sst",
+                                    fopts, &file, &dbg));
+    CHECK_OK(file->Append(Slice(data), iopts, &dbg));
+    CHECK_OK(file->Sync(iopts, &dbg));
+    files.push_back(std::move(file));
+  }
+  for (auto &f : files) CHECK_OK(f->Close(iopts, &dbg));
+
+  std::set<ZoneDevice *> devices;
+  for (auto &&z : zenFS->GetStat()) {
+    if (z.used_capacity)
+      devices.insert(zbd->GetIOZone(z.start_position)->GetDevice());
+  }
+  CHECK(devices.size() == zbd->GetNrDevices());
+
+  for (int i = 0; i < 4; i++)
+    CHECK(CheckFile(zenFS, "span/f" + std::to_string(i) + ".sst", data));
+
+  return true;
+}
+
+/* Used capacity of the io zone starting at start */
+static uint64_t ZoneUsed(ZenFS *zenFS, uint64_t start) {
+  for (auto &&z : zenFS->GetStat()) {
+    if (z.start_position == start) return z.used_capacity;
+  }
+  return 0;
+}
+
+/* Write data like RocksDB writes table files with direct writes: the last
+ * block is padded and the padding truncated away before closing */
+static IOStatus WritePaddedFile(FileSystem *fs, const std::string &fname,
+                                const std::string &data) {
+  std::unique_ptr<FSWritableFile> file;
+  FileOptions fopts;
+  IOOptions iopts;
+  IODebugContext dbg;
+  size_t padded = (data.size() + 4095) & ~(size_t)4095;
+
+  char *buf;
+  if (posix_memalign((void **)&buf, 4096, padded))
+    return IOStatus::IOError("Failed to allocate write buffer");
+  memset(buf, 0, padded);
+  memcpy(buf, data.data(), data.size());
+
+  fopts.use_direct_writes = true;
+  IOStatus s = fs->NewWritableFile(fname, fopts, &file, &dbg);
+  if (s.ok()) s = file->Append(Slice(buf, padded), iopts, &dbg);
+  if (s.ok()) s = file->Truncate(data.size(), iopts, &dbg);
+  if (s.ok()) s = file->Close(iopts, &dbg);
+  free(buf);
+  return s;
+}
+
+/* Links share the extents of their source: they read the same data, have
+ * the same size, outlive the source and are recovered on mount without
+ * counting the shared data twice */
+static bool TestLink(std::shared_ptr<Logger> logger) {
+  if (!MakeFS(logger)) return false;
+
+  std::string data = PatternData(9, 64 * 1024 + 100);
+  IOOptions iopts;
+  IODebugContext dbg;
+  uint64_t size, count, used;
+  bool same;
+  ZoneStat zone;
+
+  {
+    ZenFS *zenFS = MountFS(logger);
+    if (zenFS == nullptr) return false;
+    std::unique_ptr<ZenFS> guard(zenFS);
+
+    CHECK_OK(WritePaddedFile(zenFS, "link/src.sst", data));
+    CHECK_OK(WriteFile(zenFS, "link/other.sst", data, false));
+    CHECK(FindFileZone(zenFS, "link/src.sst", &zone));
+    used = zone.used_capacity;
+
+    CHECK_OK(zenFS->LinkFile("link/src.sst", "link/a.sst", iopts, &dbg));
+    CHECK_OK(zenFS->GetFileSize("link/a.sst", iopts, &size, &dbg));
+    CHECK(size == data.size());
+    CHECK(CheckFile(zenFS, "link/a.sst", data));
+    CHECK(ZoneUsed(zenFS, zone.start_position) == used);
+
+    CHECK_OK(zenFS->NumFileLinks("link/src.sst", iopts, &count, &dbg));
+    CHECK(count == 2);
+    CHECK_OK(zenFS->NumFileLinks("link/other.sst", iopts, &count, &dbg));
+    CHECK(count == 1);
+    CHECK_OK(
+        zenFS->AreFilesSame("link/src.sst", "link/a.sst", iopts, &same, &dbg));
+    CHECK(same);
+    CHECK_OK(zenFS->AreFilesSame("link/src.sst", "link/other.sst", iopts,
+                                 &same, &dbg));
+    CHECK(!same);
+
+    /* The data stays allocated as long as a link refers to it */
+    CHECK_OK(zenFS->DeleteFile("link/src.sst", iopts, &dbg));
+    CHECK(zenFS->FileExists("link/src.sst", iopts, &dbg).IsNotFound());
+    zenFS->GetZonedBlockDevice()->ResetUnusedIOZones();
+    CHECK(CheckFile(zenFS, "link/a.sst", data));
+    CHECK_OK(zenFS->NumFileLinks("link/a.sst", iopts, &count, &dbg));
+    CHECK(count == 1);
+    CHECK(ZoneUsed(zenFS, zone.start_position) == used);
+
+    CHECK_OK(zenFS->LinkFile("link/a.sst", "link/b.sst", iopts, &dbg));
+  }
+
+  ZenFS *zenFS = MountFS(logger);
+  if (zenFS == nullptr) return false;
+  std::unique_ptr<ZenFS> guard(zenFS);
+
+  for (auto &&fname : {"link/a.sst", "link/b.sst"}) {
+    CHECK_OK(zenFS->GetFileSize(fname, iopts, &size, &dbg));
+    CHECK(size == data.size());
+    CHECK(CheckFile(zenFS, fname, data));
+    CHECK_OK(zenFS->NumFileLinks(fname, iopts, &count, &dbg));
+    CHECK(count == 2);
+  }
+  CHECK_OK(zenFS->AreFilesSame("link/a.sst", "link/b.sst", iopts, &same, &dbg));
+  CHECK(same);
+  CHECK(ZoneUsed(zenFS, zone.start_position) == used);
+
+  /* The shared extents are released with the last link */
+  CHECK_OK(zenFS->DeleteFile("link/a.sst", iopts, &dbg));
+  CHECK(CheckFile(zenFS, "link/b.sst", data));
+  CHECK(ZoneUsed(zenFS, zone.start_position) == used);
+  CHECK_OK(zenFS->DeleteFile("link/b.sst", iopts, &dbg));
+  CHECK(ZoneUsed(zenFS, zone.start_position) + data.size() <= used);
+
+  return true;
+}
+
+static uint64_t TotalUsed(ZenFS *zenFS) {
+  uint64_t used = 0;
+  for (auto &&z : zenFS->GetStat()) used += z.used_capacity;
+  return used;
+}
+
+/* The files of a snapshot view, with their contents and sizes */
+static bool CheckSnapshotFiles(
+    FileSystem *view,
+    const std::vector<std::pair<std::string, std::string>> &files) {
+  IOOptions iopts;
+  IODebugContext dbg;
+  std::vector<std::string> children;
+  std::string result;
+  uint64_t size;
+
+  CHECK_OK(view->GetChildren("snap", iopts, &children, &dbg));
+  CHECK(children.size() == files.size());
+  for (auto &&f : files) {
+    CHECK_OK(view->GetFileSize(f.first, iopts, &size, &dbg));
+    CHECK(size == f.second.size());
+    CHECK_OK(ReadFile(view, f.first, false, &result));
+    CHECK(result == f.second);
+  }
+  return true;
+}
+
+/* A snapshot keeps the files as they were when it was created, including
+ * the synced part of a file open for writing, while the live files are
+ * deleted and overwritten. It survives a remount and its data becomes
+ * reclaimable when it is deleted. */
+static bool TestSnapshot(std::shared_ptr<Logger> logger) {
+  if (!MakeFS(logger)) return false;
+
+  const size_t sz = 256 * 1024;
+  std::string a = PatternData(10, sz + 100), b1 = PatternData(11, sz),
+              b2 = PatternData(12, sz), c1 = PatternData(13, sz),
+              c2 = PatternData(14, sz);
+  std::vector<std::pair<std::string, std::string>> snapshot_files = {
+      {"snap/a.sst", a}, {"snap/b.sst", b1}, {"snap/c.log", c1}};
+  std::vector<uint64_t> zones;
+  IOOptions iopts;
+  IODebugContext dbg;
+  uint64_t id;
+
+  {
+    ZenFS *zenFS = MountFS(logger);
+    if (zenFS == nullptr) return false;
+    std::unique_ptr<ZenFS> guard(zenFS);
+
+    std::unique_ptr<FSWritableFile> c;
+    std::unique_ptr<FileSystem> view;
+    FileOptions fopts;
+    ZoneStat zone;
+
+    CHECK_OK(WritePaddedFile(zenFS, "snap/a.sst", a));
+    CHECK_OK(WriteFile(zenFS, "snap/b.sst", b1, false));
+    CHECK_OK(zenFS->NewWritableFile("snap/c.log", fopts, &c, &dbg));
+    CHECK_OK(c->Append(Slice(c1), iopts, &dbg));
+    CHECK_OK(c->Sync(iopts, &dbg));
+
+    for (auto &&f : snapshot_files) {
+      CHECK(FindFileZone(zenFS, f.first, &zone));
+      zones.push_back(zone.start_position);
+    }
+
+    CHECK_OK(zenFS->CreateSnapshot(&id));
+    CHECK(zenFS->ListSnapshots() == std::vector<uint64_t>{id});
+
+    /* Change every live file after the snapshot */
+    CHECK_OK(zenFS->DeleteFile("snap/a.sst", iopts, &dbg));
+    CHECK_OK(WriteFile(zenFS, "snap/b.sst", b2, false));
+    CHECK_OK(c->Append(Slice(c2), iopts, &dbg));
+    CHECK_OK(c->Sync(iopts, &dbg));
+    CHECK_OK(c->Close(iopts, &dbg));
+    zenFS->GetZonedBlockDevice()->ResetUnusedIOZones();
+
+    for (auto &&z : zenFS->GetStat()) {
+      for (auto start : zones) {
+        if (z.start_position == start)
+          CHECK(z.write_position > z.start_position && z.used_capacity > 0);
+      }
+    }
+
+    CHECK_OK(zenFS->OpenSnapshot(id, &view));
+    CHECK(CheckSnapshotFiles(view.get(), snapshot_files));
+    CHECK(view->NewWritableFile("snap/d.sst", fopts, &c, &dbg)
+              .IsNotSupported());
+
+    CHECK(zenFS->FileExists("snap/a.sst", iopts, &dbg).IsNotFound());
+    CHECK(CheckFile(zenFS, "snap/b.sst", b2));
+    CHECK(CheckFile(zenFS, "snap/c.log", c1 + c2));
+  }
+
+  ZenFS *zenFS = MountFS(logger);
+  if (zenFS == nullptr) return false;
+  std::unique_ptr<ZenFS> guard(zenFS);
+
+  {
+    std::unique_ptr<FileSystem> view;
+
+    CHECK(zenFS->ListSnapshots() == std::vector<uint64_t>{id});
+    CHECK_OK(zenFS->OpenSnapshot(id, &view));
+    CHECK(CheckSnapshotFiles(view.get(), snapshot_files));
+    CHECK(CheckFile(zenFS, "snap/b.sst", b2));
+    CHECK(CheckFile(zenFS, "snap/c.log", c1 + c2));
+  }
+
+  /* Data only the snapshot referred to is released, zones left without
+   * live data are reset */
+  uint64_t used = TotalUsed(zenFS);
+  CHECK_OK(zenFS->DeleteSnapshot(id));
+  CHECK(zenFS->ListSnapshots().empty());
+  std::unique_ptr<FileSystem> view;
+  CHECK(zenFS->OpenSnapshot(id, &view).IsNotFound());
+  CHECK(TotalUsed(zenFS) + a.size() + b1.size() <= used);
+
+  zenFS->GetZonedBlockDevice()->ResetUnusedIOZones();
+  for (auto &&z : zenFS->GetStat()) {
+    if (z.used_capacity == 0) CHECK(z.write_position == z.start_position);
+  }
+
+  CHECK(CheckFile(zenFS, "snap/b.sst", b2));
+  CHECK(CheckFile(zenFS, "snap/c.log", c1 + c2));
+
+  return true;
+}
+
+/* Two file systems on disjoint zone ranges of --zbd, mounted at the same
+ * time. Each one keeps to its zones and its share of the active zone limit,
+ * a range can only be mounted once and appends go through the rate limiter
+ * at the priority of the file. */
+static bool TestRanges(std::shared_ptr<Logger> logger) {
+  if (FLAGS_zbd.find_first_of(",@:") != std::string::npos) {
+    fprintf(stderr, "ranges: needs a single device, skipped\n");
+    return true;
+  }
+
+  uint32_t nr_zones;
+  uint64_t zone_sz, max_active;
+  {
+    ZonedBlockDevice *zbd = OpenZbd(FLAGS_zbd, false, logger);
+    if (zbd == nullptr) return false;
+    nr_zones = zbd->GetNrZones();
+    max_active = zbd->GetMaxActiveZones() - 1;
+    zone_sz = zbd->GetZoneSize();
+    delete zbd;
+  }
+
+  uint32_t half = nr_zones / 2;
+  std::string ranges[2] = {
+      FLAGS_zbd + "@0+" + std::to_string(half),
+      FLAGS_zbd + "@" + std::to_string(half) + "+" +
+          std::to_string(nr_zones - half)};
+  uint64_t range_start[2] = {0, half * zone_sz};
+  uint64_t range_end[2] = {half * zone_sz, nr_zones * zone_sz};
+
+  if (half < 32) {
+    fprintf(stderr, "ranges: needs 64 zones, skipped\n");
+    return true;
+  }
+
+  for (auto &range : ranges) {
+    if (!MakeFS(logger, range)) return false;
+  }
+
+  std::unique_ptr<ZenFS> fs[2];
+  for (int r = 0; r < 2; r++) {
+    fs[r].reset(MountFS(logger, ranges[r]));
+    if (!fs[r]) return false;
+  }
+
+  /* The ranges split the device limit, metadata zones included */
+  uint64_t budget = 0;
+  for (auto &f : fs)
+    budget += f->GetZonedBlockDevice()->GetMaxActiveZones() - 1 + 3;
+  CHECK(budget <= max_active + 3);
+
+  /* Mounted ranges and the whole device are claimed */
+  IOStatus s;
+  CHECK(OpenZbd(ranges[0], false, logger, &s) == nullptr);
+  CHECK(s.IsBusy());
+  CHECK(OpenZbd(FLAGS_zbd + "@" + std::to_string(half - 1) + "+32", false,
+                logger, &s) == nullptr);
+  CHECK(s.IsBusy());
+  CHECK(OpenZbd(FLAGS_zbd, false, logger, &s) == nullptr);
+  CHECK(s.IsBusy());
+
+  /* Interleaved writes to both file systems */
+  std::string data[2] = {PatternData(15, 1024 * 1024),
+                         PatternData(16, 1024 * 1024)};
+  for (int i = 0; i < 4; i++) {
+    for (int r = 0; r < 2; r++) {
+      CHECK_OK(WriteFile(fs[r].get(), "range/f" + std::to_string(i) + ".sst",
+                         data[r], false));
+    }
+  }
+
+  for (int r = 0; r < 2; r++) {
+    for (int i = 0; i < 4; i++)
+      CHECK(CheckFile(fs[r].get(), "range/f" + std::to_string(i) + ".sst",
+                      data[r]));
+    for (auto &&z : fs[r]->GetStat()) {
+      CHECK(z.start_position >= range_start[r] &&
+            z.start_position < range_end[r]);
+    }
+  }
+
+  /* WAL appends are requested at high priority, others at low priority */
+  std::shared_ptr<RateLimiter> limiter(NewGenericRateLimiter(2 << 20));
+  fs[0]->GetZonedBlockDevice()->SetRateLimiter(limiter);
+
+  auto start = std::chrono::steady_clock::now();
+  CHECK_OK(WriteFile(fs[0].get(), "range/limited.sst", data[0], false));
+  CHECK_OK(WriteFile(fs[0].get(), "range/limited.log", data[0], false));
+  CHECK_OK(WriteFile(fs[0].get(), "range/limited2.sst", data[0], false));
+  CHECK_OK(WriteFile(fs[0].get(), "range/limited2.log", data[0], false));
+  auto elapsed = std::chrono::steady_clock::now() - start;
+
+  CHECK(elapsed >= std::chrono::seconds(1));
+  CHECK(limiter->GetTotalBytesThrough(Env::IO_LOW) >= 2 * data[0].size());
+  CHECK(limiter->GetTotalBytesThrough(Env::IO_HIGH) >= 2 * data[0].size());
+
+  /* Both survive a remount */
+  for (int r = 0; r < 2; r++) {
+    fs[r].reset();
+    fs[r].reset(MountFS(logger, ranges[r]));
+    if (!fs[r]) return false;
+    CHECK(CheckFile(fs[r].get(), "range/f3.sst", data[r]));
+  }
+  CHECK(CheckFile(fs[0].get(), "range/limited.log", data[0]));
+
+  return true;
+}
+
+/* Records of consecutive file ids go to different op log streams. Files
+ * deleted, recreated and renamed across streams must be recovered in the
+ * order the operations were made. */
+static bool TestStreams(std::shared_ptr<Logger> logger) {
+  const uint32_t nr_streams = 4;
+  if (!MakeFS(logger, FLAGS_zbd, nr_streams)) return false;
+
+  std::vector<std::string> data;
+  for (int i = 0; i < 10; i++) data.push_back(PatternData(20 + i, 64 * 1024));
+  std::map<std::string, std::string> expected;
+  IOOptions iopts;
+  IODebugContext dbg;
+
+  {
+    ZenFS *zenFS = MountFS(logger);
+    if (zenFS == nullptr) return false;
+    std::unique_ptr<ZenFS> guard(zenFS);
+
+    /* Keep all records in the op logs, no checkpoint snapshots */
+    zenFS->SetRecoveryBudget(0);
+
+    for (int i = 0; i < 8; i++) {
+      std::string fname = "streams/f" + std::to_string(i) + ".sst";
+      CHECK_OK(WriteFile(zenFS, fname, data[i], false));
+      expected[fname] = data[i];
+    }
+
+    /* Overwriting deletes the old file and creates one with a new id */
+    CHECK_OK(WriteFile(zenFS, "streams/f0.sst", data[8], false));
+    expected["streams/f0.sst"] = data[8];
+
+    /* The old name is reused by a new file after the rename */
+    CHECK_OK(zenFS->RenameFile("streams/f1.sst", "streams/r1.sst", iopts,
+                               &dbg));
+    CHECK_OK(WriteFile(zenFS, "streams/f1.sst", data[9], false));
+    expected["streams/r1.sst"] = data[1];
+    expected["streams/f1.sst"] = data[9];
+
+    CHECK_OK(zenFS->DeleteFile("streams/f2.sst", iopts, &dbg));
+    expected.erase("streams/f2.sst");
+    CHECK_OK(zenFS->RenameFile("streams/f3.sst", "streams/f2.sst", iopts,
+                               &dbg));
+    expected["streams/f2.sst"] = data[3];
+    expected.erase("streams/f3.sst");
+  }
+
+  /* The first mount merges the streams, the second one reads the snapshot
+   * written by the first */
+  for (int mount = 0; mount < 2; mount++) {
+    ZenFS *zenFS = MountFS(logger);
+    if (zenFS == nullptr) return false;
+    std::unique_ptr<ZenFS> guard(zenFS);
+    std::vector<std::string> children;
+
+    for (uint32_t stream = 1; stream < nr_streams; stream++)
+      CHECK(!zenFS->GetZonedBlockDevice()->GetOpZones(stream).empty());
+
+    zenFS->GetZenFSChildren("streams", &children);
+    CHECK(children.size() == expected.size());
+    for (auto &&f : expected) CHECK(CheckFile(zenFS, f.first, f.second));
+    CHECK(zenFS->FileExists("streams/f3.sst", iopts, &dbg).IsNotFound());
+  }
+
+  return true;
+}
+
+/* Records after the superblock of a metadata log zone, as read on mount */
+static bool CountZoneRecords(ZonedBlockDevice *zbd, Zone *zone, uint32_t *seq,
+                             uint64_t *count) {
+  ZenMetaLog log(zbd, zone);
+  Superblock super;
+  std::string scratch;
+  Slice record;
+
+  if (!log.ReadRecord(&record, &scratch).ok() || record.size() == 0)
+    return false;
+  if (!super.DecodeFrom(&record).ok()) return false;
+  *seq = super.GetSeq();
+
+  *count = 0;
+  while (log.ReadRecord(&record, &scratch).ok() && record.size() >= 4) {
+    (*count)++;
+    if (DecodeFixed32(record.data()) == kOldEndRecord) break;
+  }
+  return true;
+}
+
+/* Mount reads every snapshot zone and the newest op log zone */
+static uint64_t CountLogRecords(ZonedBlockDevice *zbd) {
+  uint64_t total = 0, count, op_count = 0;
+  uint32_t seq, op_seq = 0;
+
+  for (auto z : zbd->GetSnapshotZones()) {
+    if (CountZoneRecords(zbd, z, &seq, &count)) total += count;
+  }
+  for (auto z : zbd->GetOpZones()) {
+    if (CountZoneRecords(zbd, z, &seq, &count) && seq > op_seq) {
+      op_seq = seq;
+      op_count = count;
+    }
+  }
+  return total + op_count;
+}
+
+/* Every mount rolls to a new snapshot zone here, as the current one is
+ * finished before mounting. Each log zone is read exactly once. */
+static bool TestRecovery(std::shared_ptr<Logger> logger) {
+  if (!MakeFS(logger)) return false;
+
+  std::string data = PatternData(30, 64 * 1024);
+
+  for (int round = 0; round < 4; round++) {
+    uint64_t finished = 0, expected;
+
+    {
+      ZonedBlockDevice *zbd = OpenZbd(FLAGS_zbd, false, logger);
+      if (zbd == nullptr) return false;
+      std::unique_ptr<ZonedBlockDevice> guard(zbd);
+
+      for (auto z : zbd->GetSnapshotZones()) {
+        if (z->IsEmpty()) continue;
+        CHECK(finished == 0);
+        finished = z->start_;
+        CHECK_OK(z->Finish());
+      }
+      CHECK(finished != 0);
+      expected = CountLogRecords(zbd);
+    }
+
+    ZenFS *zenFS = MountFS(logger);
+    if (zenFS == nullptr) return false;
+    std::unique_ptr<ZenFS> guard(zenFS);
+
+    CHECK(zenFS->GetRecoveredRecords() == expected);
+    for (auto z : zenFS->GetZonedBlockDevice()->GetSnapshotZones()) {
+      if (z->start_ == finished) CHECK(z->IsEmpty());
+    }
+
+    for (int i = 0; i < round; i++)
+      CHECK(CheckFile(zenFS, "recovery/f" + std::to_string(i) + ".sst", data));
+    CHECK_OK(WriteFile(zenFS, "recovery/f" + std::to_string(round) + ".sst",
+                       data, false));
+  }
+
+  return true;
+}
+
+/* A crash between the two copies of a mirrored append leaves a zone that
+ * was written on the primary only. Mounting finishes and then resets it,
+ * so it is handed out again with its full capacity. Needs
+ * --zbd=mirror:<device>,<mirror>. */
+static bool TestDivergence(std::shared_ptr<Logger> logger) {
+  if (FLAGS_zbd.compare(0, 7, "mirror:") != 0) {
+    fprintf(stderr, "divergence: needs a mirror, skipped\n");
+    return true;
+  }
+
+  if (!MakeFS(logger)) return false;
+
+  std::string data = PatternData(31, 1024 * 1024);
+  uint64_t diverged = 0;
+
+  {
+    ZonedBlockDevice *zbd = OpenZbd(FLAGS_zbd, false, logger);
+    if (zbd == nullptr) return false;
+    std::unique_ptr<ZonedBlockDevice> guard(zbd);
+
+    Zone *zone = nullptr;
+    for (auto &&z : zbd->GetStat()) {
+      Zone *candidate = zbd->GetIOZone(z.start_position);
+      if (candidate->IsEmpty()) {
+        zone = candidate;
+        break;
+      }
+    }
+    CHECK(zone != nullptr);
+    diverged = zone->start_;
+
+    /* Write the first block of the primary copy only */
+    ZoneDevice *dev = zone->GetDevice();
+    char *buf;
+    CHECK(posix_memalign((void **)&buf, 4096, 4096) == 0);
+    memcpy(buf, data.data(), 4096);
+    ssize_t ret = pwrite(dev->write_f, buf, 4096, zone->start_ - dev->base);
+    free(buf);
+    CHECK(ret == 4096);
+  }
+
+  ZenFS *zenFS = MountFS(logger);
+  if (zenFS == nullptr) return false;
+  std::unique_ptr<ZenFS> guard(zenFS);
+
+  Zone *zone = zenFS->GetZonedBlockDevice()->GetIOZone(diverged);
+  CHECK(zone->IsEmpty());
+  CHECK(zone->GetCapacityLeft() == zone->max_capacity_);
+
+  for (int i = 0; i < 4; i++) {
+    std::string fname = "divergence/f" + std::to_string(i) + ".sst";
+    CHECK_OK(WriteFile(zenFS, fname, data, false));
+    CHECK(CheckFile(zenFS, fname, data));
+  }
+
+  return true;
+}
+
+static uint32_t ExtentCount(ZenFS *zenFS, const std::string &fname) {
+  uint32_t count = 0;
+  for (auto &&z : zenFS->GetStat()) {
+    for (auto &&f : z.files) {
+      if (f.filename == fname) count += f.extents_in_zone;
+    }
+  }
+  return count;
+}
+
+/* Write data in records of record_sz bytes, syncing after each one */
+static bool WriteSyncedFile(ZenFS *zenFS, const std::string &fname,
+                            const std::string &data, size_t record_sz) {
+  std::unique_ptr<FSWritableFile> file;
+  FileOptions fopts;
+  IOOptions iopts;
+  IODebugContext dbg;
+
+  CHECK_OK(zenFS->NewWritableFile(fname, fopts, &file, &dbg));
+  for (size_t pos = 0; pos < data.size(); pos += record_sz) {
+    CHECK_OK(file->Append(Slice(data.data() + pos, record_sz), iopts, &dbg));
+    CHECK_OK(file->Sync(iopts, &dbg));
+  }
+  CHECK_OK(file->Close(iopts, &dbg));
+  return true;
+}
+
+/* Syncs of a buffered file continue the last extent when the synced data
+ * is block aligned. Unaligned syncs are padded to the next block, so every
+ * one of them adds an extent. */
+static bool TestExtents(std::shared_ptr<Logger> logger) {
+  if (!MakeFS(logger)) return false;
+
+  const int nr_syncs = 64;
+  std::string aligned = PatternData(32, nr_syncs * 4096);
+  std::string unaligned = PatternData(33, nr_syncs * 1000);
+
+  {
+    ZenFS *zenFS = MountFS(logger);
+    if (zenFS == nullptr) return false;
+    std::unique_ptr<ZenFS> guard(zenFS);
+
+    CHECK(WriteSyncedFile(zenFS, "extents/aligned.log", aligned, 4096));
+    CHECK(WriteSyncedFile(zenFS, "extents/unaligned.log", unaligned, 1000));
+  }
+
+  /* The merged extent is recovered from the extent length updates */
+  ZenFS *zenFS = MountFS(logger);
+  if (zenFS == nullptr) return false;
+  std::unique_ptr<ZenFS> guard(zenFS);
+
+  CHECK(ExtentCount(zenFS, "extents/aligned.log") == 1);
+  CHECK(ExtentCount(zenFS, "extents/unaligned.log") == nr_syncs);
+  CHECK(CheckFile(zenFS, "extents/aligned.log", aligned));
+  CHECK(CheckFile(zenFS, "extents/unaligned.log", unaligned));
+
+  return true;
+}
+
+/* A deletion whose op log record fails to be written leaves the file in
+ * place, and a later deletion of it is persisted */
+static bool TestDelete(std::shared_ptr<Logger> logger) {
+  if (!MakeFS(logger)) return false;
+
+  std::string data = PatternData(34, 64 * 1024);
+  IOOptions iopts;
+  IODebugContext dbg;
+
+  {
+    ZenFS *zenFS = MountFS(logger);
+    if (zenFS == nullptr) return false;
+    std::unique_ptr<ZenFS> guard(zenFS);
+    ZonedBlockDevice *zbd = zenFS->GetZonedBlockDevice();
+
+    CHECK_OK(WriteFile(zenFS, "delete/a.sst", data, false));
+
+    /* The next zone write is the deletion record */
+    std::shared_ptr<ZoneFaultInjector> injector(new ZoneFaultInjector());
+    injector->SetCrashPoint(1, ZoneFaultInjector::kFail);
+    zbd->SetFaultInjector(injector);
+    CHECK(!zenFS->DeleteFile("delete/a.sst", iopts, &dbg).ok());
+    CHECK(injector->FaultInjected());
+    zbd->SetFaultInjector(nullptr);
+
+    CHECK(CheckFile(zenFS, "delete/a.sst", data));
+    CHECK_OK(zenFS->DeleteFile("delete/a.sst", iopts, &dbg));
+    CHECK(zenFS->FileExists("delete/a.sst", iopts, &dbg).IsNotFound());
+    CHECK_OK(WriteFile(zenFS, "delete/b.sst", data, false));
+  }
+
+  ZenFS *zenFS = MountFS(logger);
+  if (zenFS == nullptr) return false;
+  std::unique_ptr<ZenFS> guard(zenFS);
+
+  CHECK(zenFS->FileExists("delete/a.sst", iopts, &dbg).IsNotFound());
+  CHECK(CheckFile(zenFS, "delete/b.sst", data));
+
+  return true;
+}
+
+static bool Enabled(const std::string &name) {
+  std::stringstream ss(FLAGS_tests);
+  std::string t;
+  while (std::getline(ss, t, ',')) {
+    if (t == name) return true;
+  }
+  return false;
+}
+
+int featuretest() {
+  std::shared_ptr<Logger> logger;
+  int failures = 0;
+  Status s;
+
+  if (FLAGS_aux_path.empty()) {
+    fprintf(stderr, "You need to specify --aux_path\n");
+    return 1;
+  }
+  if (FLAGS_aux_path.back() != '/') FLAGS_aux_path.append("/");
+
+  s = Env::Default()->NewLogger(GetLogFilename(FLAGS_zbd), &logger);
+  if (!s.ok()) {
+    fprintf(stderr, "ZenFS: Could not create logger");
+  } else {
+    logger->SetInfoLogLevel(INFO_LEVEL);
+  }
+
+  struct {
+    const char *name;
+    bool (*fn)(std::shared_ptr<Logger>);
+  } tests[] = {
+      {"readcache", TestReadCache},
+      {"oldformat", TestOldFormat},
+      {"spanning", TestSpanning},
+      {"link", TestLink},
+      {"snapshot", TestSnapshot},
+      {"ranges", TestRanges},
+      {"streams", TestStreams},
+      {"recovery", TestRecovery},
+      {"divergence", TestDivergence},
+      {"extents", TestExtents},
+      {"delete", TestDelete},
+  };
+
+  for (auto &t : tests) {
+    if (!Enabled(t.name)) continue;
+    bool ok = t.fn(logger);
+    fprintf(stdout, "%-12s %s\n", t.name, ok ? "OK" : "FAILED");
+    if (!ok) failures++;
+  }
+
+  return failures ? 1 : 0;
+}
+
+}  // namespace ROCKSDB_NAMESPACE
+
+int main(int argc, char **argv) {
+  gflags::SetUsageMessage(std::string("\nUSAGE:\n") + std::string(argv[0]) +
+                          +" --zbd=<zoned block device> --aux_path=<path> "
+                           "[--tests=readcache,oldformat,spanning,link,"
+                           "snapshot,ranges,streams,recovery,divergence,"
+                           "extents,delete]");
+
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+
+  return ROCKSDB_NAMESPACE::featuretest();
+}
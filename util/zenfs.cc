@@ -23,7 +23,10 @@ using GFLAGS_NAMESPACE::ParseCommandLineFlags;
 using GFLAGS_NAMESPACE::RegisterFlagValidator;
 using GFLAGS_NAMESPACE::SetUsageMessage;
 
-DEFINE_string(zbd, "", "Path to a zoned block device.");
+DEFINE_string(zbd, "",
+              "Path to a zoned block device, or a comma separated list of "
+              "devices to span, or mirror:<device>,<mirror>. Append "
+              "@<first zone>+<nr zones> to use a range of zones.");
 DEFINE_string(aux_path, "",
               "Path for auxiliary file storage (log and lock files).");
 DEFINE_bool(force, false, "Force file system creation.");
@@ -33,6 +36,12 @@ DEFINE_string(restore_path, "", "Path to restore files");
 DEFINE_string(backup_path, "", "Path to backup files");
 DEFINE_int32(max_active_zones, 0, "Max active zone limit");
 DEFINE_int32(max_open_zones, 0, "Max active zone limit");
+DEFINE_int32(op_streams, 1, "Number of parallel op log streams");
+DEFINE_int64(snapshot, -1,
+             "File system snapshot to back up from, or to delete with "
+             "delete-snapshot");
+DEFINE_int32(files_per_zone, 1,
+             "Table files per zone to advise file sizes for with geometry");
 
 namespace ROCKSDB_NAMESPACE {
 
@@ -104,7 +113,8 @@ int zenfs_tool_mkfs() {
   if (FLAGS_aux_path.back() != '/') FLAGS_aux_path.append("/");
 
   s = zenFS->MkFS(FLAGS_aux_path, FLAGS_finish_threshold,
-                  FLAGS_max_open_zones, FLAGS_max_active_zones);
+                  FLAGS_max_open_zones, FLAGS_max_active_zones,
+                  FLAGS_op_streams);
   if (!s.ok()) {
     fprintf(stderr, "Failed to create file system, error: %s\n",
             s.ToString().c_str());
@@ -214,10 +224,59 @@ int zenfs_tool_df() {
               free / (1024 * 1024), used / (1024 * 1024), reclaimable / (1024 * 1024),
               (100 * reclaimable) / used);
 
+  static const char *pressure_names[] = {"none", "low", "high", "critical"};
+  fprintf(stdout, "Space pressure: %s\n",
+          pressure_names[(int)zbd->GetSpaceInfo().pressure]);
+
   return 0;
 }
 
 
+int zenfs_tool_geometry() {
+  Status s;
+  IOStatus io_status;
+  ZonedBlockDevice *zbd = zbd_open(true);
+  if (zbd == nullptr) return 1;
+
+  ZenFS *zenFS;
+  s = zenfs_mount(zbd, &zenFS, true);
+  if (!s.ok()) {
+    fprintf(stderr, "Failed to mount filesystem, error: %s\n",
+            s.ToString().c_str());
+    return 1;
+  }
+
+  ZoneGeometry geo = zenFS->GetZoneGeometry();
+  fprintf(stdout,
+          "Zone size: %lu MB\nZone capacity: %lu MB\nBlock size: %u\n"
+          "IO zones: %u\nMax active zones: %u\n",
+          geo.zone_size / (1024 * 1024), geo.zone_capacity / (1024 * 1024),
+          geo.block_size, geo.io_zones, geo.max_active_zones);
+  for (size_t i = 0; i < geo.streams.size(); i++) {
+    const ZoneStreamInfo &stream = geo.streams[i];
+    fprintf(stdout,
+            "Lifetime %zu: zones=%u partial=%u live=%lu MB tail=%lu MB\n", i,
+            stream.zones, stream.partial_zones,
+            stream.live_bytes / (1024 * 1024),
+            stream.tail_bytes / (1024 * 1024));
+  }
+
+  ZoneFileSizeAdvice advice;
+  io_status = zenFS->AdviseFileSizes(FLAGS_files_per_zone, &advice);
+  if (!io_status.ok()) {
+    fprintf(stderr, "Failed to advise file sizes, error: %s\n",
+            io_status.ToString().c_str());
+    return 1;
+  }
+  fprintf(stdout,
+          "Advice for %u files per zone: target_file_size_base=%lu "
+          "target_file_size_multiplier=1 write_buffer_size=%lu\n",
+          advice.files_per_zone, advice.target_file_size,
+          advice.write_buffer_size);
+
+  return 0;
+}
+
 int zenfs_tool_stat() {
   Status s;
   ZonedBlockDevice *zbd = zbd_open(true);
@@ -235,7 +294,13 @@ int zenfs_tool_stat() {
   for (auto &&zone : stat) {
     std::cout << "Zone total=" << zone.total_capacity
               << " write_position=" << zone.write_position
-              << " start_position=" << zone.start_position << std::endl;
+              << " start_position=" << zone.start_position
+              << " used=" << zone.used_capacity
+              << " oldest_extent_age=" << zone.oldest_extent_age
+              << " lifetime_bytes=";
+    for (size_t i = 0; i < zone.lifetime_bytes.size(); i++)
+      std::cout << (i ? "," : "") << zone.lifetime_bytes[i];
+    std::cout << std::endl;
     for (auto &&file : zone.files) {
       std::cout << "  [" << file.file_id << "] " << file.filename << " "
                 << file.size_in_zone << std::endl;
@@ -405,13 +470,27 @@ int zenfs_tool_backup() {
     return 1;
   }
 
+  /* Back up from a snapshot if given, the copy then sees the files as they
+   * were when the snapshot was taken */
+  FileSystem *source = zenFS;
+  std::unique_ptr<FileSystem> snapshot;
+  if (FLAGS_snapshot >= 0) {
+    io_status = zenFS->OpenSnapshot(FLAGS_snapshot, &snapshot);
+    if (!io_status.ok()) {
+      fprintf(stderr, "Failed to open snapshot, error: %s\n",
+              io_status.ToString().c_str());
+      return 1;
+    }
+    source = snapshot.get();
+  }
+
   if (!FLAGS_backup_path.empty() && FLAGS_backup_path.back() != '/') {
     std::string dest_filename = FLAGS_path + "/" + 
                                 FLAGS_backup_path.substr(FLAGS_backup_path.find_last_of('/')+1);
-    io_status = zenfs_tool_copy_file(zenFS, FLAGS_backup_path, FileSystem::Default().get(), 
+    io_status = zenfs_tool_copy_file(source, FLAGS_backup_path, FileSystem::Default().get(), 
                                      dest_filename);
   } else {
-    io_status = zenfs_tool_copy_dir(zenFS, FLAGS_backup_path, FileSystem::Default().get(),
+    io_status = zenfs_tool_copy_dir(source, FLAGS_backup_path, FileSystem::Default().get(),
                                     FLAGS_path);
   }
   if (!io_status.ok()) {
@@ -456,6 +535,84 @@ int zenfs_tool_restore() {
   return 0;
 }
 
+int zenfs_tool_snapshot() {
+  Status s;
+  IOStatus io_status;
+  uint64_t id;
+
+  ZonedBlockDevice *zbd = zbd_open(false);
+  if (zbd == nullptr) return 1;
+
+  ZenFS *zenFS;
+  s = zenfs_mount(zbd, &zenFS, false);
+  if (!s.ok()) {
+    fprintf(stderr, "Failed to mount filesystem, error: %s\n",
+            s.ToString().c_str());
+    return 1;
+  }
+
+  io_status = zenFS->CreateSnapshot(&id);
+  if (!io_status.ok()) {
+    fprintf(stderr, "Failed to create snapshot, error: %s\n",
+            io_status.ToString().c_str());
+    delete zenFS;
+    return 1;
+  }
+
+  fprintf(stdout, "Created snapshot %lu\n", id);
+  delete zenFS;
+  return 0;
+}
+
+int zenfs_tool_list_snapshots() {
+  Status s;
+  ZonedBlockDevice *zbd = zbd_open(true);
+  if (zbd == nullptr) return 1;
+
+  ZenFS *zenFS;
+  s = zenfs_mount(zbd, &zenFS, true);
+  if (!s.ok()) {
+    fprintf(stderr, "Failed to mount filesystem, error: %s\n",
+            s.ToString().c_str());
+    return 1;
+  }
+
+  for (uint64_t id : zenFS->ListSnapshots()) fprintf(stdout, "%lu\n", id);
+
+  return 0;
+}
+
+int zenfs_tool_delete_snapshot() {
+  Status s;
+  IOStatus io_status;
+
+  if (FLAGS_snapshot < 0) {
+    fprintf(stderr, "Error: Specify the snapshot to delete with --snapshot\n");
+    return 1;
+  }
+
+  ZonedBlockDevice *zbd = zbd_open(false);
+  if (zbd == nullptr) return 1;
+
+  ZenFS *zenFS;
+  s = zenfs_mount(zbd, &zenFS, false);
+  if (!s.ok()) {
+    fprintf(stderr, "Failed to mount filesystem, error: %s\n",
+            s.ToString().c_str());
+    return 1;
+  }
+
+  io_status = zenFS->DeleteSnapshot(FLAGS_snapshot);
+  delete zenFS;
+  if (!io_status.ok()) {
+    fprintf(stderr, "Failed to delete snapshot, error: %s\n",
+            io_status.ToString().c_str());
+    return 1;
+  }
+
+  return 0;
+}
+
 int zenfs_tool_dump() {
   Status s;
   ZonedBlockDevice *zbd = zbd_open(true);
@@ -483,7 +640,9 @@ int zenfs_tool_dump() {
 
 int main(int argc, char **argv) {
   gflags::SetUsageMessage(std::string("\nUSAGE:\n") + std::string(argv[0]) +
-                  +" <command> [OPTIONS]...\nCommands: mkfs, list, ls-uuid, df, backup, restore");
+                  +" <command> [OPTIONS]...\nCommands: mkfs, list, ls-uuid, df, backup, "
+                    "restore, snapshot, list-snapshots, delete-snapshot, "
+                    "geometry");
   if (argc < 2) {
     fprintf(stderr, "You need to specify a command.\n");
     return 1;
@@ -510,8 +669,16 @@ int main(int argc, char **argv) {
     return ROCKSDB_NAMESPACE::zenfs_tool_restore();
   } else if (subcmd == "dump") {
     return ROCKSDB_NAMESPACE::zenfs_tool_dump();
+  } else if (subcmd == "geometry") {
+    return ROCKSDB_NAMESPACE::zenfs_tool_geometry();
   } else if (subcmd == "stat") {
     return ROCKSDB_NAMESPACE::zenfs_tool_stat();
+  } else if (subcmd == "snapshot") {
+    return ROCKSDB_NAMESPACE::zenfs_tool_snapshot();
+  } else if (subcmd == "list-snapshots") {
+    return ROCKSDB_NAMESPACE::zenfs_tool_list_snapshots();
+  } else if (subcmd == "delete-snapshot") {
+    return ROCKSDB_NAMESPACE::zenfs_tool_delete_snapshot();
   } else {
     fprintf(stderr, "Subcommand not recognized: %s\n", subcmd.c_str());
     return 1;
@@ -1,3 +1,9 @@
-zenfs_SOURCES = fs/fs_zenfs.cc fs/zbd_zenfs.cc fs/io_zenfs.cc
-zenfs_HEADERS = fs/fs_zenfs.h fs/zbd_zenfs.h fs/io_zenfs.h fs/zbd_stat.h
+zenfs_SOURCES = fs/fs_zenfs.cc fs/zbd_zenfs.cc fs/io_zenfs.cc fs/zone_cache.cc fs/zone_fault.cc fs/zone_uring.cc fs/zone_latency.cc fs/zone_finish.cc
+zenfs_HEADERS = fs/fs_zenfs.h fs/zbd_zenfs.h fs/io_zenfs.h fs/zbd_stat.h fs/zone_cache.h fs/zone_fault.h fs/zone_uring.h fs/zone_latency.h fs/zone_finish.h
 zenfs_LDFLAGS = -lzbd -laio -u zenfs_filesystem_reg
+
+# Polled WAL writes through io_uring, see ZonedBlockDevice::EnablePolledWAL
+ifeq ($(ZENFS_IO_URING),1)
+zenfs_CXXFLAGS += -DZENFS_IO_URING
+zenfs_LDFLAGS += -luring
+endif